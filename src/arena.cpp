@@ -0,0 +1,181 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+
+std::size_t round_up(std::size_t size, std::size_t to) {
+    return (size + to - 1) / to * to;
+}
+
+// Tries to get size bytes backed by large pages, returns nullptr if the system refuses.
+std::byte* map_huge(std::size_t size) {
+#ifdef _WIN32
+    // needs SeLockMemoryPrivilege, which most accounts don't have
+    auto p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (p == nullptr)
+        p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return static_cast<std::byte*>(p);
+#else
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        // no reserved huge pages, ask for transparent ones
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    return static_cast<std::byte*>(p);
+#endif
+}
+
+void unmap_huge(std::byte* p, std::size_t size) {
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+}
+
+}
+
+arena::arena(arena_options options) : _options(options) {}
+
+arena::~arena() {
+    release();
+}
+
+void* arena::allocate(std::size_t size, std::size_t align) {
+    auto aligned = [align](std::byte* p) {
+        return reinterpret_cast<std::byte*>(round_up(reinterpret_cast<std::uintptr_t>(p), align));
+    };
+
+    if (_head == nullptr || std::size_t(_end - _head) < size + std::size_t(aligned(_head) - _head))
+        next_chunk(size, align);
+
+    auto p = aligned(_head);
+    _head = p + size;
+    return p;
+}
+
+void arena::next_chunk(std::size_t size, std::size_t align) {
+    if (_head != nullptr) {
+        _used_before_current += std::size_t(_head - _chunks[_current].data);
+        ++_current;
+    }
+
+    // chunks kept by reset are reused, unless the allocation doesn't fit
+    while (_current < _chunks.size() && _chunks[_current].size < size + align)
+        ++_current;
+
+    if (_current == _chunks.size()) {
+        std::size_t chunk_size = std::max(_options.chunk_size, size + align);
+        chunk c{nullptr, chunk_size, false};
+        if (_options.huge_pages) {
+            c.size = round_up(chunk_size, HugePageSize);
+            c.data = map_huge(c.size);
+            c.mapped = c.data != nullptr;
+        }
+        if (c.data == nullptr) {
+            c.size = chunk_size;
+            c.data = static_cast<std::byte*>(std::malloc(c.size));
+            if (c.data == nullptr)
+                throw std::bad_alloc{};
+        }
+        _chunks.push_back(c);
+    }
+
+    _head = _chunks[_current].data;
+    _end = _head + _chunks[_current].size;
+}
+
+void arena::reset() {
+    _high_water_mark = high_water_mark();
+    _current = 0;
+    _used_before_current = 0;
+    _head = _chunks.empty() ? nullptr : _chunks[0].data;
+    _end = _chunks.empty() ? nullptr : _chunks[0].data + _chunks[0].size;
+}
+
+void arena::release() {
+    _high_water_mark = high_water_mark();
+    for (auto&& c : _chunks) {
+        if (c.mapped)
+            unmap_huge(c.data, c.size);
+        else
+            std::free(c.data);
+    }
+    _chunks.clear();
+    _current = 0;
+    _used_before_current = 0;
+    _head = nullptr;
+    _end = nullptr;
+}
+
+void arena::adopt(arena& other) {
+    if (other._chunks.empty())
+        return;
+
+    // chunks other allocated from go in front of the current one, so they count as used and are only handed out
+    // again after a reset, the ones it didn't get to are kept for reuse
+    auto used = other.used();
+    auto used_chunks = std::ptrdiff_t(other._head != nullptr ? other._current + 1 : other._current);
+    auto first = other._chunks.begin();
+    _chunks.insert(_chunks.begin() + std::ptrdiff_t(_current), first, first + used_chunks);
+    _chunks.insert(_chunks.end(), first + used_chunks, other._chunks.end());
+    _current += std::size_t(used_chunks);
+    _used_before_current += used;
+
+    other._high_water_mark = other.high_water_mark();
+    other._chunks.clear();
+    other._current = 0;
+    other._used_before_current = 0;
+    other._head = nullptr;
+    other._end = nullptr;
+}
+
+void arena::lend(arena& other, std::size_t size) {
+    auto spare = _head != nullptr ? _current + 1 : _current;
+    std::size_t lent = 0;
+    while (lent < size && spare < _chunks.size()) {
+        lent += _chunks.back().size;
+        other._chunks.push_back(_chunks.back());
+        _chunks.pop_back();
+    }
+}
+
+std::size_t arena::used() const {
+    if (_head == nullptr)
+        return _used_before_current;
+    return _used_before_current + std::size_t(_head - _chunks[_current].data);
+}
+
+std::size_t arena::high_water_mark() const {
+    return std::max(_high_water_mark, used());
+}
+
+std::size_t arena::reserved() const {
+    std::size_t result = 0;
+    for (auto&& c : _chunks)
+        result += c.size;
+    return result;
+}
+
+arena& default_arena() {
+    thread_local arena a;
+    return a;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+struct arena_options {
+    std::size_t chunk_size = 256 * 1024;
+    bool huge_pages = false; // back chunks with large pages if the system grants them, regular pages otherwise
+};
+
+/**
+ * Bump allocator for objects that are never destroyed individually, like lexemes. An arena is not synchronized,
+ * each thread uses its own: either one owned by whatever runs on the thread or default_arena().
+ */
+class arena {
+public:
+    explicit arena(arena_options options = {});
+    ~arena();
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t align = alignof(std::max_align_t));
+
+    template<typename T, typename... Args>
+    T* create(Args&&... args) {
+        return new(allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Makes all memory available again without returning it to the system. Objects allocated before are gone.
+     */
+    void reset();
+
+    /**
+     * Like reset, but returns the memory to the system.
+     */
+    void release();
+
+    /**
+     * Takes over the memory of other, which is left empty. Objects allocated from other live until this arena is
+     * reset or released.
+     */
+    void adopt(arena& other);
+
+    /**
+     * Hands chunks that are kept for reuse to other until they add up to at least size bytes, so a short lived
+     * arena on another thread doesn't have to get fresh memory from the system. adopt gives them back.
+     */
+    void lend(arena& other, std::size_t size);
+
+    // bytes handed out since the last reset
+    std::size_t used() const;
+    // highest number of bytes handed out between two resets
+    std::size_t high_water_mark() const;
+    // bytes obtained from the system
+    std::size_t reserved() const;
+
+private:
+    struct chunk {
+        std::byte* data;
+        std::size_t size;
+        bool mapped;
+    };
+
+    void next_chunk(std::size_t size, std::size_t align);
+
+    arena_options _options;
+    std::vector<chunk> _chunks;
+    std::size_t _current = 0;
+    std::size_t _used_before_current = 0;
+    std::size_t _high_water_mark = 0;
+    std::byte* _head = nullptr;
+    std::byte* _end = nullptr;
+};
+
+/**
+ * The arena of the calling thread, used by whoever doesn't bring their own.
+ */
+arena& default_arena();
@@ -0,0 +1,65 @@
+#include "directive_index.h"
+
+#include <algorithm>
+
+directive_kind directive_kind_of(std::string_view name) {
+    if (name == "if")
+        return directive_kind::IF;
+    if (name == "ifdef")
+        return directive_kind::IFDEF;
+    if (name == "ifndef")
+        return directive_kind::IFNDEF;
+    if (name == "elif")
+        return directive_kind::ELIF;
+    if (name == "else")
+        return directive_kind::ELSE;
+    if (name == "endif")
+        return directive_kind::ENDIF;
+    if (name == "include")
+        return directive_kind::INCLUDE;
+    if (name == "define")
+        return directive_kind::DEFINE;
+    return directive_kind::OTHER;
+}
+
+void directive_index::add(u32 line, directive_kind kind) {
+    auto i = u32(_directives.size());
+    _directives.push_back(directive{line, kind, NONE});
+
+    switch (kind) {
+        case directive_kind::IF:
+        case directive_kind::IFDEF:
+        case directive_kind::IFNDEF:
+            _open.push_back(i);
+            break;
+
+        case directive_kind::ELIF:
+        case directive_kind::ELSE:
+            if (_open.empty()) {
+                _open.push_back(i);
+            } else {
+                _directives[_open.back()].next = i;
+                _open.back() = i;
+            }
+            break;
+
+        case directive_kind::ENDIF:
+            if (!_open.empty()) {
+                _directives[_open.back()].next = i;
+                _open.pop_back();
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+u32 directive_index::find(u32 line) const {
+    auto it = std::lower_bound(_directives.begin(), _directives.end(), line, [](const directive& d, u32 line) {
+        return d.line < line;
+    });
+    if (it == _directives.end() || it->line != line)
+        return NONE;
+    return u32(it - _directives.begin());
+}
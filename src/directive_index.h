@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include "types.h"
+
+enum class directive_kind : u8 {
+    IF,
+    IFDEF,
+    IFNDEF,
+    ELIF,
+    ELSE,
+    ENDIF,
+    INCLUDE,
+    DEFINE,
+    OTHER, // any other name behind the hash
+};
+
+directive_kind directive_kind_of(std::string_view name);
+
+/**
+ * The directive lines of a file, with every #if, #ifdef and #ifndef linked to its #elif, #else and #endif lines in
+ * turn. A conditional that is false can go on right at its next branch without looking at the lines in between.
+ *
+ * Lines are added in the order of the file from its start, a branch is linked as soon as the line of the next one is
+ * added. Branches of a conditional that started in front of the file are linked among themselves.
+ */
+class directive_index {
+public:
+    static constexpr u32 NONE = ~u32(0);
+
+    struct directive {
+        u32 line; // offset of the start of the line in the file
+        directive_kind kind;
+        u32 next; // of a conditional, the index of its next #elif, #else or #endif, NONE if not added yet
+    };
+
+    /**
+     * Adds the directive of the line starting at offset line, behind all others.
+     */
+    void add(u32 line, directive_kind kind);
+
+    /**
+     * Index of the directive of the line starting at offset line, NONE if the line is not a directive or not added yet.
+     */
+    u32 find(u32 line) const;
+
+    const directive& operator[](u32 i) const {
+        return _directives[i];
+    }
+
+    std::size_t size() const {
+        return _directives.size();
+    }
+
+private:
+    std::vector<directive> _directives;
+    std::vector<u32> _open; // last branch added of every conditional not ended yet, innermost last
+};
@@ -71,7 +71,7 @@ file_content filesystem_service::resolve_load(std::string_view cwd, std::string_
     return {"", nullptr, nullptr};
 
 load:
-    std::string abs_p = fs::absolute(p).string();
+    std::string abs_p = fs::absolute(p).lexically_normal().string(); // one path for every way to get to the file
     auto cached = std::find_if(_data->_file_cache.begin(), _data->_file_cache.end(), [abs_p](const file_content& fc) {
         return fc.file == abs_p;
     });
@@ -82,15 +82,20 @@ load:
     auto&& c = _data->_file_contents.emplace_back(size_t(fs::file_size(p)));
     std::fstream f{abs_p.c_str(), std::ios::in | std::ios::binary};
     f.read(c.data(), c.size());
+    auto encoding = decode_source(c);
 
     if (c.size() == 0) {
         c.push_back(' ');
     }
-    return _data->_file_cache.emplace_back(std::move(abs_p), &*c.begin(), &*c.begin() + c.size());
+    return _data->_file_cache.emplace_back(std::move(abs_p), &*c.begin(), &*c.begin() + c.size(), encoding);
 }
 
 struct memory_file_service_data {
-    phmap::flat_hash_map<std::string, std::string> file_store;
+    struct file {
+        std::string content;
+        text_encoding encoding;
+    };
+    phmap::flat_hash_map<std::string, file> file_store;
 };
 
 memory_file_service::memory_file_service() : _data{std::make_unique<memory_file_service_data>()} {}
@@ -103,7 +108,9 @@ bool memory_file_service::add_file(std::string_view path, std::string_view conte
     if (it != _data->file_store.end())
         return false;
 
-    _data->file_store.emplace(std::move(strpath), content);
+    std::vector<char> bytes(content.begin(), content.end());
+    auto encoding = decode_source(bytes);
+    _data->file_store.emplace(std::move(strpath), memory_file_service_data::file{{bytes.begin(), bytes.end()}, encoding});
     return true;
 }
 
@@ -125,5 +132,6 @@ file_content memory_file_service::resolve_load(std::string_view, std::string_vie
     if (it == _data->file_store.end())
         return {"", nullptr, nullptr};
 
-    return {std::move(strpath), &*it->second.begin(), &*it->second.begin() + it->second.size()};
+    auto&& content = it->second.content;
+    return {std::move(strpath), &*content.begin(), &*content.begin() + content.size(), it->second.encoding};
 }
@@ -4,11 +4,13 @@
 #include <string>
 #include <string_view>
 #include <vector>
+#include "text_encoding.h"
 
 struct file_content {
     std::string file;
     char* begin;
     char* end;
+    text_encoding encoding = text_encoding::UTF8; // of the file, the content is UTF-8 unless this is BYTES
 };
 
 struct file_service {
@@ -26,7 +28,7 @@ struct file_service {
     
     /**
      * Tries to resolve path to a file, loads that file into memory and returns information about the file.
-     * Content pointers are nullptr if the file couldnt be found/loaded.
+     * Content pointers are nullptr if the file couldnt be found/loaded. UTF-16LE files are transcoded to UTF-8.
      */
     virtual file_content resolve_load(std::string_view cwd, std::string_view path) = 0;
 };
@@ -1,90 +1,118 @@
 #include "lexer.h"
+#include "lexer_dispatch.h"
+#include "lexer_sink.h"
+#include "simd_scan.h"
+#include "text_encoding.h"
+#include "token_buffer.h"
+#include <algorithm>
 #include <iostream>
 #include <cctype>
 #include <array>
 #include <cstddef>
 
-enum char_category : char {
-    ERR, WS, LF, CR, NOT, DQ, HSH, DOL, PCT, AND, SQ, OP, CP, MUL, ADD, COM,
-    SUB, DOT, SL, NUL, DIG, COL, SC, LT, EQ, GT, AT, ID, OBK, BSL, CBK, CIR,
-    OB, OR, CB, TIL
-};
-
-// clang-format off
-static constexpr char_category DispatchTable[256] = {
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, WS,  LF,  WS,  WS,  CR,  ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    WS,  NOT, DQ,  HSH, DOL, PCT, AND, SQ,  OP,  CP,  MUL, ADD, COM, SUB, DOT, SL,
-    NUL, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, COL, SC,  LT,  EQ,  GT,  ERR,
-    AT,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,
-    ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  OBK, BSL, CBK, CIR, ID,
-    ERR, ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,
-    ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  OB,  OR,  CB,  TIL, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
-};
-// clang-format on
-
 lexer::result lexer::run(char* begin, char* end) {
-    i32 line = 1;
+    return run(begin, end, sources().add(file_path, begin, end));
+}
+
+lexer::result lexer::run(char* begin, char* end, source_location base) {
+    result out;
+    lexeme_list_sink sink{
+        .lexemes = out.lexemes,
+        .memory = options.lexemes ? *options.lexemes : default_arena(),
+        .symbols = options.symbols,
+        .file_begin = begin,
+        .base = base,
+        .fold_trivia = options.fold_trivia,
+    };
+    if (options.threads == 1 || !run_parallel(begin, end, sink, out.errors))
+        run(begin, end, sink, out.errors);
+    sink.finish();
+    return out;
+}
+
+std::vector<lex_err> lexer::run(char* begin, char* end, token_buffer& out) {
+    std::vector<lex_err> errors;
+    token_buffer_sink sink{
+        out,
+        out.add_file(file_path, begin, end),
+        begin,
+        sources().add(file_path, begin, end),
+        options.symbols
+    };
+    run(begin, end, sink, errors);
+    return errors;
+}
+
+std::optional<lexeme_type> lexer::lex_one(char* begin, char* end) {
+    std::vector<lex_err> errors;
+    single_lexeme_sink sink;
+    run_state_machine(begin, end, end, sink, errors);
+    if (!errors.empty() || sink.count != 1)
+        return std::nullopt;
+    return sink.type;
+}
+
+template<typename Sink>
+void lexer::run(char* begin, char* end, Sink& sink, std::vector<lex_err>& errors) {
     auto c = begin;
-    auto line_start = c;
+
+    c += utf8_bom_size(c, end);
+
+    if (options.engine == lexer_engine::STRUCTURAL) {
+        run_structural(c, end, sink, errors);
+    } else if (options.engine == lexer_engine::DFA) {
+        run_dfa(c, end, sink, errors);
+    } else {
+        run_state_machine(c, end, end, sink, errors);
+    }
+}
+
+template<typename Sink>
+char* lexer::run_state_machine(
+    char* c,
+    char* end,
+    char* stop,
+    Sink& sink,
+    std::vector<lex_err>& errors
+) {
     auto token_start = c;
-    i32 token_line = 1;
-    i32 token_offset = 0;
-    lexeme_list lexemes;
-    std::vector<lex_err> errors;
+    auto&& scan = scan_kernels_active();
 
-#define PRODUCE(TOKEN)                                                 \
-    do {                                                               \
-        lexemes.push_back(*create_lexeme(                              \
-            file_path,                                                 \
-            lexeme_type::TOKEN,                                        \
-            token_line,                                                \
-            token_offset,                                              \
-            i32(c - token_start),                                      \
-            std::string_view{ &*token_start, size_t(c - token_start) } \
-        ));                                                            \
-    } while(0)                                                         \
+#define PRODUCE(TOKEN)                                        \
+    do {                                                      \
+        sink.produce(lexeme_type::TOKEN, token_start, c);     \
+    } while(0)                                                \
 
 #define LEX_ERR(MSG)                                                    \
     do {                                                                \
         errors.emplace_back(                                            \
             std::string_view{ &*token_start, size_t(c - token_start) }, \
             MSG_DEBUG "error: " MSG,                                    \
-            token_line,                                                 \
-            token_offset                                                \
+            sink.location(token_start)                                  \
         );                                                              \
     } while(0)                                                          \
 
-#define GOTO(LABEL)                         \
-    do {                                    \
-        token_start = c;                    \
-        token_line = line;                  \
-        token_offset = i32(c - line_start); \
-        goto LABEL;                         \
-    } while (0)                             \
-
-#define NEW_LINE() do { ++line; line_start = c; } while(0)
+#define GOTO(LABEL)         \
+    do {                    \
+        token_start = c;    \
+        goto LABEL;         \
+    } while (0)             \
 
-    if (end - c >= 3 && c[0] == 0xEF && c[1] == 0xBB && c[2] == 0xBF)
-        c += 3;
+    // runs of bytes that need no per-byte decision are consumed by the scan kernels
+#define SCAN(KERNEL, ...) (c = c + (scan.KERNEL(c, end __VA_OPT__(,) __VA_ARGS__) - c))
 
 dispatch:
     if (c == end) {
         goto eof;
+    } else if (c >= stop) {
+        return c;
     }
-    switch (DispatchTable[std::size_t(*c)]) {
+    switch (DispatchTable[u8(*c)]) {
         default:
         case ERR:
+            // a character outside of strings, names and comments is dropped as a whole, not byte by byte
             token_start = c;
-            ++c;
+            c += std::max<std::size_t>(1, utf8_sequence_size(c, end));
             LEX_ERR("dropping unexpected symbol");
             goto dispatch;
         case WS:
@@ -162,43 +190,30 @@ dispatch:
 line_end_cr:
     if (++c == end) {
         PRODUCE(LINE_END); // \r
-        NEW_LINE();
         goto eof;
     } else if (*c == '\n') {
         goto line_end; // \r\n
     } else {
         PRODUCE(LINE_END); // \r
-        NEW_LINE();
         goto dispatch;
     }
 
 line_end:
     ++c;
     PRODUCE(LINE_END); // \n
-    NEW_LINE();
     goto dispatch;
 
 whitespace:
-    if (++c == end) {
-        PRODUCE(WHITESPACE);
-        goto eof;
-    } else if (std::isspace(*c)) {
-        goto whitespace;
-    } else {
-        PRODUCE(WHITESPACE);
-        goto dispatch;
-    }
+    ++c;
+    SCAN(whitespace);
+    PRODUCE(WHITESPACE);
+    goto dispatch;
 
 identifier:
-    if (++c == end) {
-        PRODUCE(IDENTIFIER);
-        goto eof;
-    } else if (std::isalnum(*c) || *c == '_') {
-        goto identifier;
-    } else {
-        PRODUCE(IDENTIFIER);
-        goto dispatch;
-    }
+    ++c;
+    SCAN(identifier);
+    PRODUCE(IDENTIFIER);
+    goto dispatch;
 
 plus:
     if (++c == end) {
@@ -304,7 +319,9 @@ xor_operator:
     goto dispatch;
 
 string:
-    if (++c == end) {
+    ++c;
+    SCAN(quoted, '"');
+    if (c == end) {
         LEX_ERR("unclosed string");
         goto eof;
     } else if (*c == '"') {
@@ -328,7 +345,9 @@ string_escape:
     goto string;
 
 name:
-    if (++c == end) {
+    ++c;
+    SCAN(quoted, '\'');
+    if (c == end) {
         LEX_ERR("unclosed name");
         goto eof;
     } else if (*c == '\'') {
@@ -392,7 +411,7 @@ hexadecimal_start:
     } else {
         LEX_ERR("invalid hexadecimal literal");
         PRODUCE(HEXADECIMAL);
-        goto eof;
+        goto abort;
     }
 
 hexadecimal:
@@ -433,7 +452,7 @@ float_exponent_sign:
         goto float_exponent;
     } else {
         LEX_ERR("invalid float literal");
-        goto eof;
+        goto abort;
     }
 
 float_exponent_sign_after:
@@ -444,7 +463,7 @@ float_exponent_sign_after:
         goto float_exponent;
     } else {
         LEX_ERR("invalid float literal");
-        goto eof;
+        goto abort;
     }
 
 float_exponent:
@@ -580,7 +599,6 @@ line_continuation:
         goto line_continuation_cr;
     } else if (*c == '\n') {
         ++c;
-        NEW_LINE();
         goto dispatch;
     } else {
         PRODUCE(BACKSLASH);
@@ -592,38 +610,33 @@ line_continuation_cr:
         goto eof;
     } else if (*c == '\n') {
         ++c;
-        NEW_LINE();
         goto dispatch;
     } else {
-        NEW_LINE();
         goto dispatch;
     }
 
 line_comment:
-    if (++c == end) {
-        PRODUCE(COMMENT);
+    ++c;
+    SCAN(line_comment);
+    PRODUCE(COMMENT);
+    if (c == end) {
         goto eof;
     } else if (*c == '\n') {
-        PRODUCE(COMMENT);
         GOTO(line_end);
-    } else if (*c == '\r') {
-        PRODUCE(COMMENT);
-        GOTO(line_end_cr);
     } else {
-        goto line_comment;
+        GOTO(line_end_cr);
     }
 
+    // c points to the last byte consumed by the comment in all block_comment states
 block_comment:
-    if (++c == end) {
+    ++c;
+    SCAN(block_comment);
+    if (c == end) {
         goto block_comment_error;
     } else if (*c == '*') {
         goto block_comment_end;
-    } else if (*c == '\r') {
-        goto block_comment_line_end_cr;
-    } else if (*c == '\n') {
-        goto block_comment_line_end;
     } else {
-        goto block_comment;
+        goto block_comment; // line ending
     }
 
 block_comment_end:
@@ -633,29 +646,9 @@ block_comment_end:
         ++c;
         PRODUCE(COMMENT);
         goto dispatch;
-    } else if (*c == '\r') {
-        goto block_comment_line_end_cr;
-    } else if (*c == '\n') {
-        goto block_comment_line_end;
-    } else {
-        goto block_comment;
-    }
-
-block_comment_line_end:
-    if (++c == end) {
-        goto block_comment_error;
-    } else {
-        NEW_LINE();
-        goto block_comment;
-    }
-
-block_comment_line_end_cr:
-    if (++c == end) {
-        goto block_comment_error;
-    } else if (*c == '\n') {
-        goto block_comment_line_end;
+    } else if (*c == '*') {
+        goto block_comment_end;
     } else {
-        NEW_LINE();
         goto block_comment;
     }
 
@@ -675,10 +668,12 @@ dot:
     goto dispatch;
 
 dot_dot:
-    if (++c == end) {
-        LEX_ERR("unexpected second dot");
-    } else if (*c == '.') {
+    // two dots without a third are two dot lexemes, the second one is lexed again
+    if (c + 1 != end && c[1] == '.') {
+        c += 2;
         PRODUCE(ELLIPSIS);
+    } else {
+        PRODUCE(DOT);
     }
     goto dispatch;
 
@@ -728,42 +723,54 @@ close_bracket:
     goto dispatch;
 
 eof:
-    return { std::move(lexemes), errors };
+    return end;
+
+abort:
+    return nullptr;
 
 #undef PRODUCE
 #undef LEX_ERR
 #undef GOTO
-#undef NEW_LINE
+#undef SCAN
 }
 
+template char* lexer::run_state_machine(char*, char*, char*, lexeme_list_sink&, std::vector<lex_err>&);
+template char* lexer::run_state_machine(char*, char*, char*, token_buffer_sink&, std::vector<lex_err>&);
+template char* lexer::run_state_machine(char*, char*, char*, single_lexeme_sink&, std::vector<lex_err>&);
+template char* lexer::run_state_machine(
+    char*, char*, char*, line_end_sink<lexeme_list_sink>&, std::vector<lex_err>&
+);
+
 void lexeme::write_to(std::ostream& os, const lexeme& next) {
+    write_to(os);
+    if (next.trivia == 0 && needs_separator(type, next.type))
+        os.put(' ');
+}
+
+bool needs_separator(lexeme_type type, lexeme_type next) {
     switch (type) {
         case lexeme_type::IDENTIFIER:
         case lexeme_type::OCTAL:
         case lexeme_type::DECIMAL:
         case lexeme_type::HEXADECIMAL:
         case lexeme_type::FLOAT:
-            write_to(os);
-            switch (next.type) {
+            switch (next) {
                 case lexeme_type::IDENTIFIER:
                 case lexeme_type::OCTAL:
                 case lexeme_type::DECIMAL:
                 case lexeme_type::HEXADECIMAL:
                 case lexeme_type::FLOAT:
-                    os.put(' ');
-                    break;
+                    return true;
+                default:
+                    return false;
             }
-            break;
 
         case lexeme_type::EQ:
         case lexeme_type::BIT_AND:
         case lexeme_type::BIT_OR:
         case lexeme_type::BIT_XOR:
         case lexeme_type::HASH:
-            write_to(os);
-            if (next.type == type)
-                os.put(' ');
-            break;
+            return next == type;
 
         case lexeme_type::LT:
         case lexeme_type::NOT:
@@ -776,58 +783,19 @@ void lexeme::write_to(std::ostream& os, const lexeme& next) {
         case lexeme_type::MOD:
         case lexeme_type::CONCAT:
         case lexeme_type::CONCAT_SPACE:
-            write_to(os);
-            if (next.type == type || next.type == lexeme_type::EQ)
-                os.put(' ');
-            break;
+            return next == type || next == lexeme_type::EQ;
 
         case lexeme_type::GT:
-            write_to(os);
-            if (next.type == type || next.type == lexeme_type::EQ || next.type == lexeme_type::SHR)
-                os.put(' ');
-            break;
+            return next == type || next == lexeme_type::EQ || next == lexeme_type::SHR;
 
         case lexeme_type::SHR:
-            write_to(os);
-            if (next.type == type || next.type == lexeme_type::EQ || next.type == lexeme_type::GT)
-                os.put(' ');
-            break;
+            return next == type || next == lexeme_type::EQ || next == lexeme_type::GT;
 
         default:
-            write_to(os);
-            break;
+            return false;
     }
 }
 
 void lexeme::write_to(std::ostream& os) {
-    os.write(text.data(), text.length());
-}
-
-struct chunk {
-    std::array<std::byte, sizeof(lexeme) * 4096> data;
-    std::byte* head;
-    chunk* next;
-};
-static chunk* chunks_head;
-
-void* allocate_lexeme_space() {
-    static int _atexit_failed = std::atexit([]() {
-        while (chunks_head) {
-            auto c = chunks_head->next;
-            delete chunks_head;
-            chunks_head = c;
-        }
-    });
-
-    if (chunks_head == nullptr || chunks_head->head == (void*) &chunks_head->head) {
-        auto c = new chunk{};
-        c->head = c->data.data();
-        c->next = chunks_head;
-        chunks_head = c;
-    }
-
-    auto that = chunks_head->head;
-    chunks_head->head += sizeof(lexeme);
-
-    return that;
+    os.write(text.data() - trivia, std::streamsize(trivia + text.length()));
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <optional>
 #include <string_view>
 #include <vector>
 #include <boost/intrusive/list.hpp>
+#include "arena.h"
+#include "source_map.h"
 #include "types.h"
 
 enum class lexeme_type : char {
@@ -67,21 +70,30 @@ enum class lexeme_type : char {
     OPEN_BRACKET,
     CLOSE_BRACKET,
     COMMENT,
+};
 
-    META_USED_DEFINE_POP,
+// What the whitespace and comments folded into a lexeme were, see lexer_options::fold_trivia.
+enum lexeme_flags : u8 {
+    SPACE_BEFORE = 1,
+    COMMENT_BEFORE = 2,
+    PAINTED = 4, // set by the preprocessor on a macro name found inside of its own expansion, it is never expanded
 };
 
 struct lexeme : boost::intrusive::list_base_hook<> {
-    explicit lexeme(std::string_view fp, lexeme_type type, i32 line, i32 line_offset, i32 src_length, std::string_view text) :
-        file_path(fp), type(type), line(line), line_offset(line_offset), src_length(src_length), text(text)
+    explicit lexeme(lexeme_type type, source_location location, std::string_view text) :
+        type(type), location(location), text(text)
     {}
 
-    std::string_view file_path;
     lexeme_type type;
-    i32 line;
-    i32 line_offset;
-    i32 src_length;
+    u8 flags = 0;             // lexeme_flags
+    source_location location; // where the lexeme starts, resolved by the source_map the lexer used
     std::string_view text;
+    u32 symbol = 0; // symbol_table id of an identifier, 0 if not interned
+    u32 trivia = 0; // size of the whitespace and comments folded into the lexeme, they are right in front of text
+
+    std::string_view leading_trivia() const {
+        return {text.data() - trivia, trivia};
+    }
 
     lexeme(lexeme&&) = default;
     lexeme(const lexeme&) = default;
@@ -89,6 +101,7 @@ struct lexeme : boost::intrusive::list_base_hook<> {
     lexeme& operator=(lexeme&&) = default;
     lexeme& operator=(const lexeme&) = default;
 
+    // both write the leading trivia in front of the text
     void write_to(std::ostream& os, const lexeme& next);
     void write_to(std::ostream& os);
 
@@ -97,30 +110,71 @@ struct lexeme : boost::intrusive::list_base_hook<> {
     };
 };
 
-void* allocate_lexeme_space();
+/**
+ * Whether a space has to be written between two adjacent lexemes so they are lexed the same way again.
+ */
+bool needs_separator(lexeme_type type, lexeme_type next);
+
+template<typename... Args>
+lexeme* create_lexeme(arena& a, Args&&... args) {
+    return a.create<lexeme>(std::forward<Args>(args)...);
+}
 
 template<typename... Args>
 lexeme* create_lexeme(Args&&... args) {
-    return new(allocate_lexeme_space()) lexeme(std::forward<Args>(args)...);
+    return create_lexeme(default_arena(), std::forward<Args>(args)...);
 }
 
 struct lex_err {
-    explicit lex_err(std::string_view problem, std::string_view explanation, i32 line, i32 line_offset) :
-        problem(problem), explanation(explanation), line(line), line_offset(line_offset)
+    explicit lex_err(std::string_view problem, std::string_view explanation, source_location location) :
+        problem(problem), explanation(explanation), location(location)
     {}
 
     std::string_view problem;
     std::string_view explanation;
-    i32 line;
-    i32 line_offset;
+    source_location location;
 };
 
 using lexeme_list = boost::intrusive::list<lexeme>;
 using lex_iter = lexeme_list::iterator;
 
+// Goes up whenever the same text is lexed into other lexemes, images of lexed files of another version are not used.
+constexpr u32 LexerVersion = 2;
+
+enum class lexer_engine : char {
+    STATE_MACHINE, // goto based state machine, the reference implementation
+    STRUCTURAL,    // classifies 64 byte blocks into bitmaps first, then walks the bitmaps to produce lexemes
+    DFA,           // transition table generated at compile time, one table load and jump per byte
+};
+
+class symbol_table;
+struct lexeme_list_sink;
+
+/**
+ * Replacement of old_length bytes at offset by new_length bytes.
+ */
+struct text_edit {
+    std::size_t offset;
+    std::size_t old_length;
+    std::size_t new_length;
+};
+
+struct lexer_options {
+    lexer_engine engine = lexer_engine::STATE_MACHINE; // of run and lexed_file, lexer_cursor runs the state machine
+    symbol_table* symbols = nullptr; // identifiers are interned into this table if set
+    arena* lexemes = nullptr;        // where lexemes are allocated, default_arena() if not set
+    source_map* sources = nullptr;   // where lexed buffers get their locations, default_source_map() if not set
+    unsigned threads = 1;            // run into a lexeme list splits large buffers over this many threads, 0 for one per core
+
+    // Lexeme lists get no whitespace and comment lexemes, they are folded into the trivia and flags of the lexeme
+    // behind them instead. Trivia at the end of the input with nothing behind it stays one lexeme. Token buffers
+    // keep all lexemes.
+    bool fold_trivia = false;
+};
+
 class lexer {
 public:
-    lexer(std::string_view fp) : file_path(fp) {}
+    lexer(std::string_view fp, lexer_options options = {}) : file_path(fp), options(options) {}
 
     struct result {
         lexeme_list lexemes;
@@ -134,6 +188,62 @@ public:
     }
     result run(char* begin, char* end);
 
+    /**
+     * Appends the lexemes to a token buffer instead of allocating a node per lexeme, [begin, end) has to outlive out.
+     */
+    std::vector<lex_err> run(char* begin, char* end, class token_buffer& out);
+
+    /**
+     * Returns the type of the lexeme [begin, end) lexes to, nothing if it is not exactly one lexeme. The text gets
+     * no locations and no lexemes are made, for text put together from other lexemes.
+     */
+    std::optional<lexeme_type> lex_one(char* begin, char* end);
+
+    // byte range of the new buffer that was lexed again
+    struct relexed {
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    /**
+     * Updates the result of lexing [old_begin, old_begin + old size) to the result of lexing [begin, end), which is
+     * the old buffer with edit applied. Lexing restarts at the last lexeme boundary that the edit can't affect and
+     * stops as soon as it reaches a boundary of the old lexemes behind the edit, the old lexemes from there on are
+     * moved to the new buffer. The new buffer gets locations of its own, the range of the old one goes back to the
+     * source map, so its locations can't be resolved any more. The old buffer is not read and may already be gone.
+     */
+    relexed relex(result& previous, const char* old_begin, text_edit edit, char* begin, char* end);
+
 private:
+    friend class stream_lexer;
+    friend class lexer_cursor;
+    friend class lexed_file;
+
+    // run for a buffer added to the source map already, base is its location
+    result run(char* begin, char* end, source_location base);
+
+    template<typename Sink>
+    void run(char* begin, char* end, Sink& sink, std::vector<lex_err>& errors);
+
+    // Lexes with the state machine until it is back in its dispatch state at or after stop.
+    // Returns where lexing stopped, end if the input was exhausted, nullptr if an error aborted lexing.
+    template<typename Sink>
+    char* run_state_machine(char* c, char* end, char* stop, Sink& sink, std::vector<lex_err>& errors);
+
+    // Lexes [begin, end) in chunks on several threads with the state machine, see lexer_parallel.cpp.
+    // Returns false without lexing anything if the buffer is too small to be worth splitting.
+    bool run_parallel(char* begin, char* end, lexeme_list_sink& sink, std::vector<lex_err>& errors);
+
+    template<typename Sink>
+    void run_structural(char* c, char* end, Sink& sink, std::vector<lex_err>& errors);
+
+    template<typename Sink>
+    void run_dfa(char* c, char* end, Sink& sink, std::vector<lex_err>& errors);
+
+    source_map& sources() const {
+        return options.sources ? *options.sources : default_source_map();
+    }
+
     std::string_view file_path;
+    lexer_options options;
 };
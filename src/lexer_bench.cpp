@@ -0,0 +1,233 @@
+#include "lexer.h"
+#include "token_buffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/*
+Lexer throughput
+
+Lexes every corpus with every engine, into a lexeme list and into a token buffer, and prints the median MB/s and
+lexemes/s of a number of runs. The synthetic corpora stress one class of lexemes each. Files or directories given
+on the command line (*.uc, *.uci, *.uh) are added as one corpus each, to measure real code. The state machine is
+also measured lexing into a list on several threads, one per core unless --threads says otherwise.
+
+    LexerBench [--runs N] [--size MB] [--threads N] [path...]
+ */
+
+namespace {
+
+struct corpus {
+    std::string name;
+    std::vector<char> text;
+};
+
+// repeats pieces in order until the text is at least size bytes
+corpus synthetic(std::string name, std::size_t size, const std::vector<std::string>& pieces) {
+    corpus c{std::move(name), {}};
+    c.text.reserve(size + 256);
+    for (std::size_t i = 0; c.text.size() < size; ++i) {
+        auto&& p = pieces[i % pieces.size()];
+        c.text.insert(c.text.end(), p.begin(), p.end());
+    }
+    return c;
+}
+
+std::string with_crlf(const std::string& s) {
+    std::string result;
+    for (auto c : s) {
+        if (c == '\n')
+            result += '\r';
+        result += c;
+    }
+    return result;
+}
+
+const std::string UnrealScriptClass =
+    "class Bench extends Actor\n"
+    "    config(Bench);\n"
+    "\n"
+    "var config float Speed;\n"
+    "var() string Description; // shown in the editor\n"
+    "\n"
+    "/* Moves towards the target and reports\n"
+    "   when it got there. */\n"
+    "function bool MoveTo(Actor Target, optional float Tolerance) {\n"
+    "    local vector Delta;\n"
+    "    local int i;\n"
+    "\n"
+    "    if (Target == none || Tolerance < 0.5)\n"
+    "        return false;\n"
+    "    Delta = Target.Location - Location;\n"
+    "    for (i = 0; i < 16; i++)\n"
+    "        Velocity += Normal(Delta) * Speed * 0x10;\n"
+    "    Log(\"moved\"@Target.Name$\" by \"$VSize(Delta), 'Bench');\n"
+    "    return VSize(Delta) <= Tolerance;\n"
+    "}\n"
+    "\n";
+
+std::vector<corpus> synthetic_corpora(std::size_t size) {
+    std::vector<corpus> result;
+    result.push_back(synthetic("identifiers", size, {
+        "local PlayerController Controller; Controller = Level.Game.GetController(Owner);\n",
+        "simulated function ReplicatedEvent(name VarName) { super.ReplicatedEvent(VarName); }\n",
+    }));
+    result.push_back(synthetic("operators", size, {
+        "a+=b*c-(d<<2)>>e;f=g!=h&&i||j^^k;l**=m%n;o$=p@q;r=~s|t&u^v;w++;--x;y[z]={a,b};\n",
+    }));
+    result.push_back(synthetic("comments", size, {
+        "// a line comment that explains what the next line does, as usual\n",
+        "/* a block comment\n * that spans a few lines\n * like documentation does */\n",
+    }));
+    result.push_back(synthetic("numbers", size, {
+        "1234 0x1F00 3.14159 017 42 0.5 65535 0xFFFFFFFF 1.0 7\n",
+    }));
+    result.push_back(synthetic("strings", size, {
+        "\"a string literal with \\\"escapes\\\" in it\" 'NameLiteral' \"another string\"\n",
+    }));
+    result.push_back(synthetic("class LF", size, {UnrealScriptClass}));
+    result.push_back(synthetic("class CRLF", size, {with_crlf(UnrealScriptClass)}));
+    return result;
+}
+
+bool is_unrealscript(const fs::path& p) {
+    auto ext = p.extension();
+    return ext == ".uc" || ext == ".uci" || ext == ".uh";
+}
+
+void append_file(const fs::path& p, std::vector<char>& text) {
+    std::ifstream in{p, std::ios::binary};
+    text.insert(text.end(), std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+    text.push_back('\n');
+}
+
+corpus load_corpus(const fs::path& path) {
+    corpus c{path.string(), {}};
+    if (fs::is_directory(path)) {
+        for (auto&& entry : fs::recursive_directory_iterator{path}) {
+            if (entry.is_regular_file() && is_unrealscript(entry.path()))
+                append_file(entry.path(), c.text);
+        }
+    } else {
+        append_file(path, c.text);
+    }
+    return c;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// run lexes once and returns how long lexing took, tearing down the result is not measured
+template<typename Run>
+double median_seconds(int runs, Run run) {
+    std::vector<double> seconds;
+    for (int i = 0; i < runs; ++i)
+        seconds.push_back(run());
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    int runs = 9;
+    std::size_t size = 4;
+    unsigned threads = 0;
+    std::vector<fs::path> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg{argv[i]};
+        if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--size" && i + 1 < argc) {
+            size = std::size_t(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = unsigned(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--help" || arg == "-h") {
+            std::cout << "LexerBench [--runs N] [--size MB] [--threads N] [path...]\n";
+            return EXIT_SUCCESS;
+        } else {
+            paths.emplace_back(arg);
+        }
+    }
+
+    auto corpora = synthetic_corpora(size * 1024 * 1024);
+    for (auto&& p : paths)
+        corpora.push_back(load_corpus(p));
+
+    const std::pair<const char*, lexer_engine> engines[] = {
+        {"state machine", lexer_engine::STATE_MACHINE},
+        {"structural", lexer_engine::STRUCTURAL},
+        {"dfa", lexer_engine::DFA},
+    };
+
+    std::cout << std::format("{:<24} {:<14} {:<7} {:>10} {:>12}\n", "corpus", "engine", "output", "MB/s", "lexemes/s");
+    for (auto&& c : corpora) {
+        if (c.text.empty())
+            continue;
+        char* begin = c.text.data();
+        char* end = begin + c.text.size();
+
+        for (auto&& [engine_name, engine] : engines) {
+            arena lexemes;
+            std::size_t lexeme_count = 0;
+            auto list = median_seconds(runs, [&]() {
+                lexemes.reset();
+                auto start = std::chrono::steady_clock::now();
+                auto result = lexer{c.name, {engine, nullptr, &lexemes}}.run(begin, end);
+                auto seconds = seconds_since(start);
+                lexeme_count = std::size_t(std::distance(result.lexemes.begin(), result.lexemes.end()));
+                return seconds;
+            });
+            auto buffer = median_seconds(runs, [&]() {
+                token_buffer tokens;
+                auto start = std::chrono::steady_clock::now();
+                lexer{c.name, {engine}}.run(begin, end, tokens);
+                return seconds_since(start);
+            });
+
+            for (auto&& [output, seconds] : {std::pair{"list", list}, std::pair{"buffer", buffer}}) {
+                std::cout << std::format(
+                    "{:<24} {:<14} {:<7} {:>10.1f} {:>12.3e}\n",
+                    c.name,
+                    engine_name,
+                    output,
+                    double(c.text.size()) / seconds / 1e6,
+                    double(lexeme_count) / seconds
+                );
+            }
+        }
+
+        arena lexemes;
+        std::size_t lexeme_count = 0;
+        lexer_options options{lexer_engine::STATE_MACHINE, nullptr, &lexemes};
+        options.threads = threads;
+        auto seconds = median_seconds(runs, [&]() {
+            lexemes.reset();
+            auto start = std::chrono::steady_clock::now();
+            auto result = lexer{c.name, options}.run(begin, end);
+            auto seconds = seconds_since(start);
+            lexeme_count = std::size_t(std::distance(result.lexemes.begin(), result.lexemes.end()));
+            return seconds;
+        });
+        std::cout << std::format(
+            "{:<24} {:<14} {:<7} {:>10.1f} {:>12.3e}\n",
+            c.name,
+            "parallel",
+            "list",
+            double(c.text.size()) / seconds / 1e6,
+            double(lexeme_count) / seconds
+        );
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,500 @@
+#include "lexer_cursor.h"
+#include "lexer_dispatch.h"
+#include "lexer_sink.h"
+#include "simd_scan.h"
+#include "text_encoding.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+#include <parallel_hashmap/phmap.h>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+namespace {
+
+/*
+Image of a lexed file
+
+A header, then the line starts (position of the first lexeme, then offset in the text), the directives, the
+identifier spellings and the lexemes. Numbers are in the byte order of the machine that wrote the image, the header
+records it, images of the other byte order are not used. Symbols and locations are not stored, the spellings are
+interned again when the image is read and locations are the base the text gets plus the offset. The directive index
+is added to again, which links the branches the way lexing did.
+
+The XXH3 of everything behind the header is in the header, an image that matches it is the one written and is not
+walked lexeme by lexeme when it is read.
+ */
+constexpr char ImageMagic[8] = {'U', 'C', 'P', 'P', 'T', 'O', 'K', '\0'};
+constexpr u32 ImageByteOrder = 0x01020304; // reads as another number in the other byte order
+
+struct image_header {
+    char magic[8];
+    u32 byte_order; // ImageByteOrder
+    u32 version;    // LexerVersion
+    u64 hash;       // XXH3 of the text
+    u64 size;       // of the text
+    u64 check;      // XXH3 of the image behind the header
+    u32 fold_trivia;
+    u32 lines;      // the end included
+    u32 directives;
+    u32 spellings;
+    u32 tokens;     // bytes of lexemes
+};
+
+// the type of a lexeme fits in the byte it shares with its flags
+static_assert(u8(lexeme_type::COMMENT) < 64 && (SPACE_BEFORE | COMMENT_BEFORE) < 4);
+
+void put_varint(std::string& out, u32 v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(char(v));
+}
+
+u32 get_varint(const char*& c) {
+    u32 v = 0;
+    for (int shift = 0;; shift += 7) {
+        auto b = u8(*c++);
+        v |= u32(b & 0x7F) << shift;
+        if (b < 0x80)
+            return v;
+    }
+}
+
+// finds the directive among the lexemes of a line, a hash in front of everything else and a name behind it
+bool find_directive(lex_iter l, lex_iter end, directive_kind& kind) {
+    auto skip_trivia = [&]() {
+        while (l != end && (l->type == lexeme_type::WHITESPACE || l->type == lexeme_type::COMMENT))
+            ++l;
+    };
+    skip_trivia();
+    if (l == end || l->type != lexeme_type::HASH)
+        return false;
+    ++l;
+    skip_trivia();
+    if (l == end || l->type != lexeme_type::IDENTIFIER)
+        return false;
+    kind = directive_kind_of(l->text);
+    return true;
+}
+
+}
+
+lexer_cursor::lexer_cursor(std::string_view fp, char* begin, char* end, lexer_options options) :
+    _lexer(fp, options), _c(begin), _end(end), _begin(begin), _line(begin)
+{
+    _base = _lexer.sources().add(fp, begin, end);
+    _lexer.file_path = _lexer.sources().file_path(_base); // fp may go away before the cursor does
+    _c += utf8_bom_size(_c, end);
+    _indexed = _c;
+}
+
+lexer_cursor::lexer_cursor(char* begin, char* end, source_location base, lexer_options options) :
+    _lexer("", options), _c(begin), _end(end), _begin(begin), _line(begin), _base(base)
+{
+    _lexer.file_path = _lexer.sources().file_path(_base);
+    _c += utf8_bom_size(_c, end);
+    _indexed = _c;
+}
+
+lexed_file::~lexed_file() {
+    if (_sources)
+        _sources->release(_base);
+}
+
+std::unique_ptr<lexed_file> lexed_file::lex(
+    std::string_view fp,
+    char* begin,
+    char* end,
+    lexer_options options,
+    std::optional<source_location> base
+) {
+    auto file = std::make_unique<lexed_file>();
+    file->_begin = begin;
+    file->_end = end;
+    file->_fold_trivia = options.fold_trivia;
+    if (base) {
+        file->_base = *base;
+    } else {
+        file->_sources = options.sources ? options.sources : &default_source_map();
+        file->_base = file->_sources->add(fp, begin, end);
+    }
+
+    // the whole file is lexed at once, with the engine and threads of options, then cut into the lines a cursor
+    // would hand out: a line ends behind its line end lexeme
+    arena memory;
+    options.lexemes = &memory;
+    auto out = lexer{fp, options}.run(begin, end, file->_base);
+    if (!out.errors.empty())
+        return nullptr;
+    phmap::flat_hash_map<std::string_view, u32> spellings;
+
+    auto&& tokens = file->_storage;
+    u32 text = u32(utf8_bom_size(begin, end)); // where the text of the lexemes so far ends
+    for (auto line = out.lexemes.begin(); line != out.lexemes.end();) {
+        file->_lines.push_back(u32(tokens.size()));
+        file->_offsets.push_back(text);
+        auto line_end = line;
+        while (line_end != out.lexemes.end() && (line_end++)->type != lexeme_type::LINE_END);
+        directive_kind kind;
+        if (find_directive(line, line_end, kind))
+            file->_directives.add(text, kind);
+
+        for (; line != line_end; ++line) {
+            auto&& l = *line;
+            // trivia has to come with flags and lexemes have to follow each other for the text to be left out
+            auto offset = u32(l.text.data() - begin);
+            if (offset - l.trivia != text || (l.trivia != 0) != (l.flags != 0))
+                return nullptr;
+            text = offset + u32(l.text.size());
+
+            tokens.push_back(char(u8(l.type) | l.flags << 6));
+            put_varint(tokens, u32(l.text.size()));
+            if (l.flags)
+                put_varint(tokens, l.trivia);
+            if (l.type == lexeme_type::IDENTIFIER) {
+                auto [spelling, added] = spellings.try_emplace(l.text, u32(file->_symbols.size()));
+                if (added) {
+                    file->_symbols.push_back(l.symbol);
+                    file->_spellings.push_back(offset);
+                    file->_spellings.push_back(u32(l.text.size()));
+                }
+                put_varint(tokens, spelling->second);
+            }
+        }
+    }
+    if (!file->_offsets.empty() && text != u32(end - begin))
+        return nullptr;
+    file->_lines.push_back(u32(tokens.size()));
+    file->_offsets.push_back(u32(end - begin));
+    file->_tokens = tokens;
+    return file;
+}
+
+void lexed_file::write_image(std::ostream& out, u64 hash) const {
+    std::string body; // everything behind the header
+    auto put = [&](u32 v) {
+        body.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    for (auto line : _lines)
+        put(line);
+    for (auto offset : _offsets)
+        put(offset);
+    for (u32 d = 0; d < _directives.size(); ++d) {
+        put(_directives[d].line);
+        put(u32(_directives[d].kind));
+    }
+    for (auto spelling : _spellings)
+        put(spelling);
+    body += _tokens;
+
+    image_header header{};
+    std::memcpy(header.magic, ImageMagic, sizeof(ImageMagic));
+    header.byte_order = ImageByteOrder;
+    header.version = LexerVersion;
+    header.fold_trivia = _fold_trivia;
+    header.hash = hash;
+    header.size = u64(_end - _begin);
+    header.lines = u32(_lines.size());
+    header.directives = u32(_directives.size());
+    header.spellings = u32(_symbols.size());
+    header.tokens = u32(_tokens.size());
+    header.check = XXH3_64bits(body.data(), body.size());
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(body.data(), std::streamsize(body.size()));
+}
+
+std::unique_ptr<lexed_file> lexed_file::from_image(
+    std::string_view image,
+    std::shared_ptr<const void> owner,
+    std::string_view fp,
+    char* begin,
+    char* end,
+    u64 hash,
+    lexer_options options,
+    std::optional<source_location> base
+) {
+    image_header header;
+    if (image.size() < sizeof(header))
+        return nullptr;
+    std::memcpy(&header, image.data(), sizeof(header));
+    auto size = u64(end - begin);
+    if (std::memcmp(header.magic, ImageMagic, sizeof(ImageMagic)) != 0 || header.byte_order != ImageByteOrder ||
+        header.version != LexerVersion || header.fold_trivia != u32(options.fold_trivia) || header.hash != hash ||
+        header.size != size || header.lines == 0)
+        return nullptr;
+    auto tables = (u64(header.lines) * 2 + u64(header.directives) * 2 + u64(header.spellings) * 2) * sizeof(u32);
+    if (image.size() != sizeof(header) + tables + header.tokens)
+        return nullptr;
+    // a damaged image is not used, the lexemes of one that checks out decode as they were written
+    if (XXH3_64bits(image.data() + sizeof(header), image.size() - sizeof(header)) != header.check)
+        return nullptr;
+
+    // tables are copied out, the image needs no alignment
+    auto at = image.data() + sizeof(header);
+    auto read = [&](std::vector<u32>& table, u32 count) {
+        table.resize(count);
+        std::memcpy(table.data(), at, count * sizeof(u32));
+        at += count * sizeof(u32);
+    };
+
+    auto file = std::make_unique<lexed_file>();
+    file->_begin = begin;
+    file->_end = end;
+    file->_fold_trivia = options.fold_trivia;
+    read(file->_lines, header.lines);
+    read(file->_offsets, header.lines);
+    std::vector<u32> directives;
+    read(directives, header.directives * 2);
+    read(file->_spellings, header.spellings * 2);
+    file->_tokens = std::string_view{at, header.tokens};
+    file->_image = std::move(owner);
+
+    for (u32 i = 0; i + 1 < header.lines; ++i) {
+        if (file->_lines[i] > file->_lines[i + 1] || file->_offsets[i] > file->_offsets[i + 1])
+            return nullptr;
+    }
+    if (file->_lines.back() != header.tokens || file->_offsets.back() != size)
+        return nullptr;
+    for (u32 i = 0; i < header.directives; ++i) {
+        auto line = directives[2 * i];
+        auto kind = directives[2 * i + 1];
+        if (kind > u32(directive_kind::OTHER) || line > size || (i > 0 && line <= directives[2 * i - 2]))
+            return nullptr;
+        file->_directives.add(line, directive_kind(kind));
+    }
+    file->_symbols.resize(header.spellings);
+    for (u32 i = 0; i < header.spellings; ++i) {
+        auto offset = file->_spellings[2 * i];
+        auto length = file->_spellings[2 * i + 1];
+        if (offset > size || length > size - offset)
+            return nullptr;
+        if (options.symbols)
+            file->_symbols[i] = options.symbols->intern(std::string_view{begin + offset, length});
+    }
+    if (base) {
+        file->_base = *base;
+    } else {
+        file->_sources = options.sources ? options.sources : &default_source_map();
+        file->_base = file->_sources->add(fp, begin, end);
+    }
+    return file;
+}
+
+lexeme lexed_file::decode(position& p) const {
+    auto c = _tokens.data() + p.token;
+    auto head = u8(*c++);
+    auto size = get_varint(c);
+    auto trivia = head >> 6 ? get_varint(c) : 0;
+    auto text = p.text + trivia;
+
+    lexeme l{lexeme_type(head & 63), _base + text, std::string_view{_begin + text, size}};
+    l.flags = head >> 6;
+    l.trivia = trivia;
+    if (l.type == lexeme_type::IDENTIFIER)
+        l.symbol = _symbols[get_varint(c)];
+    p.token = u32(c - _tokens.data());
+    p.text = text + size;
+    return l;
+}
+
+lexer_cursor::lexer_cursor(const lexed_file& file, lexer_options options) :
+    _lexer("", options), _c(file._begin + file._offsets[0]), _end(file._end), _begin(file._begin),
+    _line(_c), _base(file._base), _indexed(file._end), _lexed(&file), _next{file._lines[0], file._offsets[0]}
+{}
+
+bool lexer_cursor::next_line(lexeme_list& out, std::vector<lex_err>& errors) {
+    if (_c == nullptr || _c == _end)
+        return false;
+
+    if (_lexed) {
+        auto&& memory = _lexer.options.lexemes ? *_lexer.options.lexemes : default_arena();
+        // lexing again from a rewind on would find no trivia in front of the first lexeme
+        bool rewound = _next.token != _lexed->_lines[_next_line];
+        _line = _c;
+        for (auto last = _lexed->_lines[_next_line + 1]; _next.token != last; rewound = false) {
+            auto l = create_lexeme(memory, _lexed->decode(_next));
+            if (rewound) {
+                l->trivia = 0;
+                l->flags = 0;
+            }
+            out.push_back(*l);
+        }
+        _c = _begin + _lexed->_offsets[++_next_line];
+        return true;
+    }
+
+    auto&& options = _lexer.options;
+    lexeme_list_sink sink{
+        .lexemes = out,
+        .memory = options.lexemes ? *options.lexemes : default_arena(),
+        .symbols = options.symbols,
+        .file_begin = _begin,
+        .base = _base,
+        .fold_trivia = options.fold_trivia,
+    };
+    auto last = out.empty() ? out.end() : std::prev(out.end());
+    _line = _c;
+    _c = lex_line(_c, sink, errors);
+    sink.finish();
+
+    // lines are indexed in order, not again when rewound or ahead of the index
+    if (_line == _indexed && _c != nullptr) {
+        directive_kind kind;
+        if (find_directive(last == out.end() ? out.begin() : std::next(last), out.end(), kind))
+            _directives.add(u32(_line - _begin), kind);
+        _indexed = _c;
+    }
+    return true;
+}
+
+std::string_view lexer_cursor::skip_branch(std::vector<lex_err>& errors) {
+    if (_c == nullptr)
+        return {};
+    auto&& directives = this->directives();
+    auto i = directives.find(u32(_line - _begin));
+    if (i == directive_index::NONE)
+        return {};
+    auto kind = directives[i].kind;
+    if (kind == directive_kind::ENDIF || kind == directive_kind::INCLUDE || kind == directive_kind::DEFINE ||
+        kind == directive_kind::OTHER)
+        return {};
+
+    if (directives[i].next == directive_index::NONE && !_lexed)
+        index_ahead(i);
+    auto next = directives[i].next;
+    auto to = next != directive_index::NONE ? _begin + directives[next].line : _indexed;
+
+    // errors found ahead are reported if their lines are skipped, the others are lexed again
+    auto skipped_end = std::find_if(_lookahead_errors.begin(), _lookahead_errors.end(), [to](const lex_err& e) {
+        return e.problem.data() >= to;
+    });
+    for (auto e = _lookahead_errors.begin(); e != skipped_end; ++e) {
+        if (e->problem.data() >= _c)
+            errors.push_back(*e);
+    }
+    _lookahead_errors.erase(_lookahead_errors.begin(), skipped_end);
+
+    std::string_view skipped{_c, std::size_t(to - _c)};
+    _c = to;
+    if (_lexed) {
+        auto&& offsets = _lexed->_offsets;
+        _next_line = u32(std::lower_bound(offsets.begin(), offsets.end(), u32(to - _begin)) - offsets.begin());
+        _next = lexed_file::position{_lexed->_lines[_next_line], offsets[_next_line]};
+    }
+    return skipped;
+}
+
+void lexer_cursor::rewind(const lexeme& l) {
+    _c = const_cast<char*>(l.text.data());
+    if (_lexed) {
+        // l is a copy of a lexeme of the line its text is in
+        auto&& offsets = _lexed->_offsets;
+        auto line = u32(std::upper_bound(offsets.begin(), offsets.end(), u32(_c - _begin)) - offsets.begin()) - 1;
+        lexed_file::position p{_lexed->_lines[line], offsets[line]};
+        while (p.token != _lexed->_lines[line + 1]) {
+            auto at = p;
+            if (_lexed->decode(p).text.data() == l.text.data()) {
+                _next_line = line;
+                _next = at;
+                return;
+            }
+        }
+    }
+}
+
+// Indexes the lines from _indexed on until directive i has its next branch, without lexing them. Of the bytes in
+// between only those that decide where lines start are looked at, comments, strings, names and line continuations.
+void lexer_cursor::index_ahead(u32 i) {
+    auto&& scan = scan_kernels_active();
+    const char* c = _indexed;
+    const char* end = _end;
+
+    auto block_comment = [&]() {
+        auto start = c;
+        for (c += 2; (c = scan.block_comment(c, end)) != end; ++c) {
+            if (*c == '*' && c + 1 != end && c[1] == '/') {
+                c += 2;
+                return;
+            }
+        }
+        _lookahead_errors.emplace_back(
+            std::string_view{start, std::size_t(end - start)},
+            MSG_DEBUG "error: unexpected EOF in comment",
+            _base + source_location(start - _begin)
+        );
+    };
+    auto trivia = [&]() {
+        while ((c = scan.whitespace(c, end)) != end && end - c >= 2) {
+            if (c[0] == '/' && c[1] == '*')
+                block_comment();
+            else if (c[0] == '\\' && (c[1] == '\n' || c[1] == '\r'))
+                c += c[1] == '\r' && end - c >= 3 && c[2] == '\n' ? 3 : 2;
+            else
+                break;
+        }
+    };
+
+    while (c != end && _directives[i].next == directive_index::NONE) {
+        // a hash in front of everything but trivia and a name behind it make a directive
+        auto line = c;
+        trivia();
+        if (c != end && *c == '#' && (c + 1 == end || c[1] != '#')) {
+            ++c;
+            trivia();
+            if (c != end && DispatchTable[u8(*c)] == ID) {
+                auto name = c;
+                c = scan.identifier(c, end);
+                _directives.add(u32(line - _begin), directive_kind_of({name, std::size_t(c - name)}));
+            }
+        }
+
+        // strings and names end at the end of the line unless it is escaped, block comments go on over it, and a line
+        // goes on over a line ending behind a backslash unless that is in a line comment or string
+        const char* ends_line = nullptr; // a line ending that does, whatever is in front of it
+        for (;;) {
+            c = scan.inactive(c, end);
+            if (c == end) {
+                break;
+            } else if (*c == '\n' || *c == '\r') {
+                bool continued = c != _begin && c[-1] == '\\' && c != ends_line;
+                c += *c == '\r' && c + 1 != end && c[1] == '\n' ? 2 : 1;
+                if (!continued)
+                    break;
+            } else if (*c == '"' || *c == '\'') {
+                auto quote = *c++;
+                while ((c = scan.quoted(c, end, quote)) != end && *c != '\r' && *c != '\n') {
+                    if (*c++ == quote)
+                        break;
+                    if (c != end)
+                        ++c; // escaped, a line end as well
+                }
+                ends_line = c;
+            } else if (c + 1 != end && c[1] == '/') {
+                c = ends_line = scan.line_comment(c, end);
+            } else if (c + 1 != end && c[1] == '*') {
+                block_comment();
+            } else {
+                ++c;
+            }
+        }
+    }
+    _indexed = const_cast<char*>(c);
+}
+
+template<typename Sink>
+char* lexer_cursor::lex_line(char* c, Sink& sink, std::vector<lex_err>& errors) {
+    // a comment, string or line continuation can go on over the line ending, then the line goes on to the next line
+    // ending
+    line_end_sink<Sink> line{sink};
+    do {
+        auto stop = const_cast<char*>(scan_kernels_active().line_comment(c, _end));
+        if (stop != _end)
+            ++stop;
+        c = _lexer.run_state_machine(c, _end, stop, line, errors);
+    } while (c != nullptr && c != _end && !line.ended);
+    return c;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "directive_index.h"
+#include "lexer.h"
+
+/**
+ * All lines of a file lexed up front, for files that are included again and again. A cursor over it decodes the
+ * lexemes of a line instead of lexing it, so what is stored never changes and the cursors over a file don't see each
+ * other. The text has to outlive it, the lexemes point into it.
+ *
+ * Lexemes are stored in a few bytes each: the type and flags in one, then the sizes of the text and of the trivia,
+ * and of identifiers the index of their spelling. Where the text starts follows from where the one in front ends,
+ * the lexemes of a line cover it without gaps. The same bytes are the image of the file saved to disk, an image
+ * mapped into memory is used as it is.
+ */
+class lexed_file {
+public:
+    /**
+     * Lexes [begin, end) into the lines a lexer_cursor hands out, all of it at once with the engine and threads of
+     * options. Returns nullptr if there are errors, they depend on which lines are skipped, so a file with errors is
+     * left to a cursor over its text. So is a file with line continuations, the text of its lexemes has gaps.
+     *
+     * base is the location of [begin, end) if it is in the source map of options already. Otherwise the text is
+     * added, and its range goes back to the source map with the lexed file.
+     */
+    static std::unique_ptr<lexed_file> lex(
+        std::string_view fp,
+        char* begin,
+        char* end,
+        lexer_options options,
+        std::optional<source_location> base = std::nullopt
+    );
+
+    ~lexed_file();
+
+    /**
+     * Writes the image of the lexed file, hash is the XXH3 of the text.
+     */
+    void write_image(std::ostream& out, u64 hash) const;
+
+    /**
+     * Turns an image write_image wrote back into the lexed file of [begin, end) without lexing it, the lexemes are
+     * decoded from the image, which owner keeps alive. Returns nullptr if the image is of another text, LexerVersion,
+     * fold_trivia option or byte order, or is damaged. base is taken like lex takes it.
+     */
+    static std::unique_ptr<lexed_file> from_image(
+        std::string_view image,
+        std::shared_ptr<const void> owner,
+        std::string_view fp,
+        char* begin,
+        char* end,
+        u64 hash,
+        lexer_options options,
+        std::optional<source_location> base = std::nullopt
+    );
+
+    bool fold_trivia() const {
+        return _fold_trivia;
+    }
+
+private:
+    friend class lexer_cursor;
+
+    // a lexeme in _tokens, and where the trivia in front of it starts in the text
+    struct position {
+        u32 token;
+        u32 text;
+    };
+
+    // decodes the lexeme at p and moves p to the one behind it
+    lexeme decode(position& p) const;
+
+    char* _begin;
+    char* _end;
+    bool _fold_trivia;
+    source_location _base; // location of _begin
+    source_map* _sources = nullptr; // set if the range of _base was added for this file, it is given back with it
+    std::string _storage;  // _tokens of a file lexed, not loaded
+    std::shared_ptr<const void> _image; // _tokens of a file loaded
+    std::string_view _tokens;
+    std::vector<u32> _lines;     // position in _tokens of the first lexeme of every line, the size of _tokens last
+    std::vector<u32> _offsets;   // offset of the start of every line, the size of the file last
+    std::vector<u32> _spellings; // offset and size in the text of every identifier spelling
+    std::vector<u32> _symbols;   // symbol of every identifier spelling
+    directive_index _directives;
+};
+
+/**
+ * Lexes a file on demand, one line at a time, so a consumer only ever holds the lexemes of the line it is working
+ * on. A line ends with its line end lexeme, lines starting inside a block comment or string include the rest of it.
+ *
+ * Always uses the state machine, the other engines need to see the whole input before producing anything. Files
+ * lexed whole for a lexed_file use the engine of the options.
+ *
+ * Directive lines go into an index of the file as they are lexed. Inactive code is skipped a branch at a time: the
+ * next branch of a conditional is looked up there, lines not lexed yet are scanned ahead for directives byte by
+ * byte, the lines of skipped branches are never lexed.
+ */
+class lexer_cursor {
+public:
+    lexer_cursor(std::string_view fp, char* begin, char* end, lexer_options options = {});
+
+    /**
+     * Lexes a buffer added to the source map of options before, base is its location. For buffers lexed again and
+     * again, they keep their locations instead of using up new ones.
+     */
+    lexer_cursor(char* begin, char* end, source_location base, lexer_options options = {});
+
+    /**
+     * Hands out the lines of a file lexed before, copied into the arena of options.
+     */
+    explicit lexer_cursor(const lexed_file& file, lexer_options options = {});
+
+    /**
+     * Appends the lexemes and errors of the next line. Returns false if there is nothing left to lex.
+     */
+    bool next_line(lexeme_list& out, std::vector<lex_err>& errors);
+
+    /**
+     * Skips the lines behind the line lexed last, an #if, #ifdef, #ifndef, #elif or #else, up to the line of its
+     * next branch, so that is lexed next. Returns the text skipped: up to the end of the file if the conditional
+     * doesn't end in it, nothing if the line lexed last isn't one of those directives. Of the lexing errors in the
+     * lines skipped only a comment left open at the end of the file is appended to errors.
+     */
+    std::string_view skip_branch(std::vector<lex_err>& errors);
+
+    /**
+     * Continues lexing at l, a lexeme this cursor handed out.
+     */
+    void rewind(const lexeme& l);
+
+    const directive_index& directives() const {
+        return _lexed ? _lexed->_directives : _directives;
+    }
+
+    // offset of the start of the line lexed last
+    std::size_t line_offset() const {
+        return std::size_t(_line - _begin);
+    }
+
+private:
+    template<typename Sink>
+    char* lex_line(char* c, Sink& sink, std::vector<lex_err>& errors);
+    void index_ahead(u32 directive);
+
+    lexer _lexer;
+    char* _c;   // nullptr once an error aborted lexing
+    char* _end;
+    char* _begin;
+    char* _line; // start of the line lexed last
+    source_location _base; // location of _begin
+
+    directive_index _directives;
+    char* _indexed; // the lines in front of it are in _directives
+    std::vector<lex_err> _lookahead_errors; // found scanning ahead for the index, in order
+
+    const lexed_file* _lexed = nullptr; // lines are copied from it instead of lexed if set
+    u32 _next_line = 0;               // of _lexed, the line handed out next
+    lexed_file::position _next{0, 0}; // of _lexed, the lexeme handed out next, inside of _next_line after a rewind
+};
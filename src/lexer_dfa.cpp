@@ -0,0 +1,236 @@
+#include "lexer.h"
+#include "lexer_dispatch.h"
+#include "lexer_sink.h"
+
+#include <array>
+#include <string_view>
+
+/*
+DFA lexer
+
+The transition table maps a state and an input byte to the next state. It is generated at compile time from the
+spec below and from DispatchTable, so a byte costs one table load and one indirect jump. Two pseudo states end a
+lexeme: DEAD emits the lexeme accepted by the current state and starts the next one at the current byte, HANDOFF
+lets the state machine lex the lexeme from its start. Everything that needs more than a transition (block
+comments, numbers starting with 0 and floats, dots, line continuations, unclosed strings, errors) is handed off,
+which keeps the lexemes identical to the state machine's.
+ */
+
+namespace {
+
+struct token_spec {
+    std::string_view spelling;
+    lexeme_type type;
+};
+
+constexpr token_spec Punctuators[] = {
+    {"+", lexeme_type::PLUS},          {"++", lexeme_type::INCREMENT},       {"+=", lexeme_type::ADD_EQ},
+    {"-", lexeme_type::MINUS},         {"--", lexeme_type::DECREMENT},       {"-=", lexeme_type::SUB_EQ},
+    {"*", lexeme_type::MUL},           {"*=", lexeme_type::MUL_EQ},          {"**", lexeme_type::POW},
+    {"/", lexeme_type::DIV},           {"/=", lexeme_type::DIV_EQ},
+    {"%", lexeme_type::MOD},           {"%=", lexeme_type::MOD_EQ},
+    {"&", lexeme_type::BIT_AND},       {"&&", lexeme_type::AND},
+    {"|", lexeme_type::BIT_OR},        {"||", lexeme_type::OR},
+    {"^", lexeme_type::BIT_XOR},       {"^^", lexeme_type::XOR},
+    {"#", lexeme_type::HASH},          {"##", lexeme_type::TOKEN_CONCAT},
+    {"$", lexeme_type::CONCAT},        {"$=", lexeme_type::CONCAT_EQ},
+    {"@", lexeme_type::CONCAT_SPACE},  {"@=", lexeme_type::CONCAT_SPACE_EQ},
+    {"=", lexeme_type::EQ},            {"==", lexeme_type::EQ_EQ},
+    {"!", lexeme_type::NOT},           {"!=", lexeme_type::NEQ},
+    {"~", lexeme_type::BIT_NOT},       {"~=", lexeme_type::ALMOST},
+    {"<", lexeme_type::LT},            {"<=", lexeme_type::LT_EQ},           {"<<", lexeme_type::SHL},
+    {">", lexeme_type::GT},            {">=", lexeme_type::GT_EQ},
+    {">>", lexeme_type::SHR},          {">>>", lexeme_type::SHR_UNSIGNED},
+    {".", lexeme_type::DOT},
+    {",", lexeme_type::COMMA},         {":", lexeme_type::COLON},            {";", lexeme_type::SEMICOLON},
+    {"(", lexeme_type::OPEN_PAREN},    {")", lexeme_type::CLOSE_PAREN},
+    {"{", lexeme_type::OPEN_BRACE},    {"}", lexeme_type::CLOSE_BRACE},
+    {"[", lexeme_type::OPEN_BRACKET},  {"]", lexeme_type::CLOSE_BRACKET},
+    {"\n", lexeme_type::LINE_END},     {"\r", lexeme_type::LINE_END},        {"\r\n", lexeme_type::LINE_END},
+};
+
+constexpr int MaxStates = 64;
+constexpr u8 DEAD = MaxStates;
+constexpr u8 HANDOFF = MaxStates + 1;
+constexpr u8 START = 0;
+
+struct dfa {
+    std::array<std::array<u8, 256>, MaxStates> next{};
+    std::array<lexeme_type, MaxStates> accepts{};
+    std::array<bool, MaxStates> accepting{};
+    int states = 0;
+
+    // bytes without a transition end the lexeme if the state accepts one, otherwise they are handed off
+    constexpr u8 add_state(bool accept, lexeme_type type = {}) {
+        u8 s = u8(states++);
+        accepting[s] = accept;
+        accepts[s] = type;
+        next[s].fill(accept ? DEAD : HANDOFF);
+        return s;
+    }
+
+    template<typename Pred>
+    constexpr void on(u8 from, Pred category, u8 to) {
+        for (int b = 0; b < 256; ++b) {
+            if (category(DispatchTable[b]))
+                next[from][b] = to;
+        }
+    }
+
+    constexpr void on(u8 from, char byte, u8 to) {
+        next[from][u8(byte)] = to;
+    }
+
+    constexpr void on_any(u8 from, u8 to) {
+        next[from].fill(to);
+    }
+};
+
+constexpr dfa make_dfa() {
+    dfa d;
+    d.add_state(false); // START, unknown bytes are errors the state machine reports
+
+    for (auto&& p : Punctuators) {
+        u8 s = START;
+        for (std::size_t i = 0; i < p.spelling.size(); ++i) {
+            u8 t = d.next[s][u8(p.spelling[i])];
+            if (t == DEAD || t == HANDOFF) {
+                t = d.add_state(false);
+                d.on(s, p.spelling[i], t);
+            }
+            s = t;
+        }
+        d.accepting[s] = true;
+        d.accepts[s] = p.type;
+        for (auto&& t : d.next[s]) {
+            if (t == HANDOFF)
+                t = DEAD;
+        }
+    }
+
+    auto is = [](char_category c) {
+        return [c](char_category x) { return x == c; };
+    };
+    auto is_identifier = [](char_category x) {
+        return x == ID || x == DIG || x == NUL;
+    };
+    auto is_digit = [](char_category x) {
+        return x == DIG || x == NUL;
+    };
+    auto is_line_end = [](char_category x) {
+        return x == LF || x == CR;
+    };
+
+    u8 whitespace = d.add_state(true, lexeme_type::WHITESPACE);
+    d.on(START, is(WS), whitespace);
+    d.on(whitespace, is(WS), whitespace);
+
+    u8 identifier = d.add_state(true, lexeme_type::IDENTIFIER);
+    d.on(START, is(ID), identifier);
+    d.on(identifier, is_identifier, identifier);
+
+    u8 decimal = d.add_state(true, lexeme_type::DECIMAL);
+    d.on(START, is(DIG), decimal);
+    d.on(decimal, is_digit, decimal);
+    d.on(decimal, '.', HANDOFF); // float
+
+    u8 dot = d.next[START][u8('.')];
+    d.on(dot, '.', HANDOFF);
+
+    u8 slash = d.next[START][u8('/')];
+    u8 line_comment = d.add_state(true, lexeme_type::COMMENT);
+    d.on(slash, '/', line_comment);
+    d.on(slash, '*', HANDOFF); // block comment
+    d.on_any(line_comment, line_comment);
+    d.on(line_comment, is_line_end, DEAD);
+
+    for (auto [quote, type] : {std::pair{'"', lexeme_type::STRING}, std::pair{'\'', lexeme_type::NAME}}) {
+        u8 text = d.add_state(false);
+        u8 escape = d.add_state(false);
+        u8 closed = d.add_state(true, type);
+        d.on(START, quote, text);
+        d.on_any(text, text);
+        d.on(text, quote, closed);
+        d.on(text, '\\', escape);
+        d.on(text, is_line_end, HANDOFF);
+        d.on_any(escape, text);
+        d.on(escape, is_line_end, HANDOFF);
+    }
+
+    return d;
+}
+
+constexpr auto Dfa = make_dfa();
+static_assert(Dfa.states <= MaxStates);
+
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define UCPP_COMPUTED_GOTO 1
+#endif
+
+template<typename Sink>
+void lexer::run_dfa(char* c, char* end, Sink& sink, std::vector<lex_err>& errors) {
+    auto token_start = c;
+    u8 state = START;
+    u8 next;
+
+#ifdef UCPP_COMPUTED_GOTO
+    static constexpr auto Targets = [] {
+        std::array<int, MaxStates + 2> t{};
+        t[DEAD] = 1;
+        t[HANDOFF] = 2;
+        return t;
+    }();
+    static void* const Labels[] = {&&advance, &&emit, &&handoff};
+#define JUMP(NEXT) goto* Labels[Targets[NEXT]]
+#else
+#define JUMP(NEXT)               \
+    do {                         \
+        if (NEXT == DEAD)        \
+            goto emit;           \
+        else if (NEXT == HANDOFF) \
+            goto handoff;        \
+        goto advance;            \
+    } while (0)
+#endif
+
+step:
+    if (c == end)
+        goto at_end;
+    next = Dfa.next[state][u8(*c)];
+    JUMP(next);
+
+advance:
+    state = next;
+    ++c;
+    goto step;
+
+emit:
+    sink.produce(Dfa.accepts[state], token_start, c);
+    state = START;
+    token_start = c;
+    goto step;
+
+handoff:
+    c = run_state_machine(token_start, end, token_start + 1, sink, errors);
+    if (c == nullptr)
+        return;
+    state = START;
+    token_start = c;
+    goto step;
+
+at_end:
+    if (state == START) {
+        return;
+    } else if (Dfa.accepting[state]) {
+        sink.produce(Dfa.accepts[state], token_start, c);
+    } else {
+        run_state_machine(token_start, end, end, sink, errors);
+    }
+
+#undef JUMP
+}
+
+template void lexer::run_dfa(char*, char*, lexeme_list_sink&, std::vector<lex_err>&);
+template void lexer::run_dfa(char*, char*, token_buffer_sink&, std::vector<lex_err>&);
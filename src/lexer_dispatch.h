@@ -0,0 +1,30 @@
+#pragma once
+
+// Byte categories the lexer engines dispatch on at the start of a lexeme.
+
+enum char_category : char {
+    ERR, WS, LF, CR, NOT, DQ, HSH, DOL, PCT, AND, SQ, OP, CP, MUL, ADD, COM,
+    SUB, DOT, SL, NUL, DIG, COL, SC, LT, EQ, GT, AT, ID, OBK, BSL, CBK, CIR,
+    OB, OR, CB, TIL
+};
+
+// clang-format off
+inline constexpr char_category DispatchTable[256] = {
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, WS,  LF,  WS,  WS,  CR,  ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    WS,  NOT, DQ,  HSH, DOL, PCT, AND, SQ,  OP,  CP,  MUL, ADD, COM, SUB, DOT, SL,
+    NUL, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, DIG, COL, SC,  LT,  EQ,  GT,  ERR,
+    AT,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,
+    ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  OBK, BSL, CBK, CIR, ID,
+    ERR, ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,
+    ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  ID,  OB,  OR,  CB,  TIL, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+    ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR, ERR,
+};
+// clang-format on
@@ -0,0 +1,129 @@
+#include "lexer.h"
+#include "lexer_sink.h"
+#include "text_encoding.h"
+
+#include <iterator>
+
+/*
+Incremental lexing
+
+Every lexeme starts in the dispatch state of the state machine, and deciding where a lexeme ends looks at most at
+the two bytes behind it (a dot needs two to tell whether an ellipsis follows). So the lexemes that end at least two
+bytes in front of the edit are unaffected, lexing restarts right behind the last of them. Behind the edit the new stream is back in step with the old one at the first
+position where both are in the dispatch state, that is where the new stream has a lexeme boundary that is also
+the start of an old lexeme. From there on the old lexemes only need to be moved by the size difference of the
+edit. That last step still touches every lexeme behind the edit, since text and locations are absolute.
+ */
+
+lexer::relexed lexer::relex(result& previous, const char* old_begin, text_edit edit, char* begin, char* end) {
+    auto&& lexemes = previous.lexemes;
+    auto old_offset = [old_begin](std::string_view text) {
+        return std::size_t(text.data() - old_begin);
+    };
+    auto moved = [begin, old_offset](std::string_view text, std::ptrdiff_t by) {
+        return std::string_view{begin + old_offset(text) + by, text.size()};
+    };
+    std::ptrdiff_t delta = std::ptrdiff_t(edit.new_length) - std::ptrdiff_t(edit.old_length);
+
+    // every lexeme gets a location in the new buffer, which takes over the range of the old one if it fits
+    if (!lexemes.empty())
+        sources().release(lexemes.front().location);
+    else if (!previous.errors.empty())
+        sources().release(previous.errors.front().location);
+    auto base = sources().add(file_path, begin, end);
+    auto location = [begin, base](std::string_view text) {
+        return base + source_location(text.data() - begin);
+    };
+
+    // lexemes in front of the edit stay, only their text moves to the new buffer
+    auto c = begin;
+    auto first_changed = lexemes.begin();
+    while (first_changed != lexemes.end() && old_offset(first_changed->text) + first_changed->text.size() + 1 < edit.offset) {
+        first_changed->text = moved(first_changed->text, 0);
+        first_changed->location = location(first_changed->text);
+        ++first_changed;
+    }
+
+    if (first_changed == lexemes.begin()) {
+        c += utf8_bom_size(c, end);
+    } else {
+        auto&& kept = *std::prev(first_changed);
+        c = const_cast<char*>(kept.text.data() + kept.text.size());
+    }
+
+    // lexing may have been aborted by an error, then nothing behind it was looked at
+    if (!previous.errors.empty()) {
+        auto error_start = begin + old_offset(previous.errors.back().problem);
+        if (error_start < c) {
+            c = error_start;
+            while (first_changed != lexemes.begin() && std::prev(first_changed)->text.data() >= c)
+                --first_changed;
+        }
+    }
+    auto restart = c;
+
+    // lex until a lexeme boundary behind the edit is the start of an old lexeme
+    lexeme_list fresh;
+    std::vector<lex_err> fresh_errors;
+    lexeme_list_sink sink{
+        .lexemes = fresh,
+        .memory = options.lexemes ? *options.lexemes : default_arena(),
+        .symbols = options.symbols,
+        .file_begin = begin,
+        .base = base,
+        .fold_trivia = options.fold_trivia,
+    };
+    auto old = first_changed;
+    auto stop = begin + edit.offset + edit.new_length;
+    bool in_step = false;
+    while (c != end) {
+        c = run_state_machine(c, end, stop, sink, fresh_errors);
+        if (c == nullptr || c == end) {
+            c = end;
+            break;
+        }
+
+        // with trivia folded an old lexeme starts where its trivia does, and the new stream is only in step if it
+        // has no trivia waiting
+        auto c_old = std::size_t(c - begin - delta);
+        while (old != lexemes.end() && old_offset(old->leading_trivia()) < c_old)
+            ++old;
+        if (old != lexemes.end() && old_offset(old->leading_trivia()) == c_old && sink.trivia.begin == nullptr) {
+            in_step = true;
+            break;
+        }
+        stop = c + 1;
+    }
+    sink.finish();
+    if (!in_step)
+        old = lexemes.end();
+
+    // everything behind the point of resynchronization moves by the edit
+    std::size_t in_step_old = in_step ? old_offset(old->leading_trivia()) : std::size_t(-1);
+    auto errors = std::move(previous.errors);
+    previous.errors.clear();
+    for (auto&& e : errors) {
+        if (old_offset(e.problem) < std::size_t(restart - begin)) {
+            auto problem = moved(e.problem, 0);
+            previous.errors.emplace_back(problem, e.explanation, location(problem));
+        }
+    }
+    for (auto&& e : fresh_errors) {
+        previous.errors.push_back(e);
+    }
+    for (auto&& e : errors) {
+        if (old_offset(e.problem) >= in_step_old) {
+            auto problem = moved(e.problem, delta);
+            previous.errors.emplace_back(problem, e.explanation, location(problem));
+        }
+    }
+
+    lexemes.erase_and_dispose(first_changed, old, lexeme::disposer{});
+    lexemes.splice(old, fresh);
+    for (; old != lexemes.end(); ++old) {
+        old->text = moved(old->text, delta);
+        old->location = location(old->text);
+    }
+
+    return relexed{std::size_t(restart - begin), std::size_t(c - begin)};
+}
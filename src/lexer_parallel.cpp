@@ -0,0 +1,145 @@
+#include "lexer.h"
+#include "lexer_sink.h"
+#include "symbol_table.h"
+#include "text_encoding.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <thread>
+
+/*
+Parallel lexing
+
+The buffer is split behind line endings into one chunk per thread, and every chunk is lexed on its own as if it
+started in the dispatch state of the state machine. Lexing a chunk goes on until the state machine is back in its
+dispatch state at or behind the start of the next chunk, so a lexeme is never cut in two.
+
+The guess is wrong for a chunk that starts inside a block comment. Like relexing an edit, the real lexemes and the
+guessed ones are in step from the first position where both are in the dispatch state: the chunks are joined in
+order, and where the previous chunk stopped is not a lexeme start of the next one, lexing goes on serially from
+there until it is. Usually that is right away, a comment costs a rerun of its own lexemes only.
+
+With trivia folded a lexeme starts where its trivia does, and the streams are only in step where no trivia is
+waiting to be folded into the next lexeme.
+
+Locations are the offset into the buffer plus the base it got from the source map, so they come out right without
+knowing how many lines the chunks in front have. Lexemes are allocated from an arena per chunk, which borrows the
+spare memory of the output arena and is adopted by it in the end, and identifiers are interned while joining, the symbol table is not synchronized.
+ */
+
+namespace {
+
+// below this a chunk is not worth a thread
+constexpr std::size_t MinChunkSize = 256 * 1024;
+
+struct chunk {
+    char* begin;
+    char* stopped; // where the state machine stopped behind the next chunk's begin, nullptr if lexing aborted
+    arena memory;
+    lexeme_list lexemes;
+    std::vector<lex_err> errors;
+    pending_trivia trivia; // in front of stopped
+};
+
+// with trivia folded a lexeme starts where its trivia does
+const char* lexeme_start(const lexeme& l) {
+    return l.leading_trivia().data();
+}
+
+}
+
+bool lexer::run_parallel(char* begin, char* end, lexeme_list_sink& sink, std::vector<lex_err>& errors) {
+    auto c = begin;
+    c += utf8_bom_size(c, end);
+
+    std::size_t threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::size_t count = std::min(threads, std::size_t(end - c) / MinChunkSize);
+    if (count < 2)
+        return false;
+
+    // chunks start behind the first line feed from an even split on, the last ones may end up empty
+    std::vector<chunk> chunks(count);
+    chunks[0].begin = c;
+    for (std::size_t i = 1; i < count; ++i) {
+        auto split = std::max(chunks[i - 1].begin, c + std::size_t(end - c) * i / count);
+        auto line_feed = static_cast<char*>(std::memchr(split, '\n', std::size_t(end - split)));
+        chunks[i].begin = line_feed ? line_feed + 1 : end;
+    }
+
+    // a lexeme takes about 16 times the bytes of its text, a reused output arena lends that much to every chunk
+    for (std::size_t i = 0; i < count; ++i) {
+        auto next = i + 1 < count ? chunks[i + 1].begin : end;
+        sink.memory.lend(chunks[i].memory, std::size_t(next - chunks[i].begin) * 16);
+    }
+
+    std::vector<std::future<void>> lexing;
+    for (std::size_t i = 0; i < count; ++i) {
+        lexing.push_back(std::async(std::launch::async, [&, i]() {
+            auto&& ch = chunks[i];
+            auto next = i + 1 < count ? chunks[i + 1].begin : end;
+            lexeme_list_sink chunk_sink{
+                .lexemes = ch.lexemes,
+                .memory = ch.memory,
+                .symbols = nullptr,
+                .file_begin = sink.file_begin,
+                .base = sink.base,
+                .fold_trivia = sink.fold_trivia,
+            };
+            ch.stopped = ch.begin == end ? end : run_state_machine(ch.begin, end, next, chunk_sink, ch.errors);
+            ch.trivia = chunk_sink.trivia;
+        }));
+    }
+    for (auto&& f : lexing)
+        f.get();
+
+    // join the chunks, lexing serially wherever the previous chunk didn't stop at a lexeme start of the next one
+    c = chunks[0].begin;
+    for (std::size_t i = 0; i < count && c != nullptr && c != end; ++i) {
+        auto&& ch = chunks[i];
+        auto next = i + 1 < count ? chunks[i + 1].begin : end;
+        auto l = ch.lexemes.begin();
+        for (;;) {
+            while (l != ch.lexemes.end() && lexeme_start(*l) < c)
+                ++l;
+
+            // trivia waiting for a lexeme has to be folded into it, so not in step yet
+            bool in_step = (l != ch.lexemes.end() && lexeme_start(*l) == c) || c == ch.stopped;
+            if (in_step && sink.trivia.begin == nullptr) {
+                for (auto&& e : ch.errors) {
+                    if (e.problem.data() >= c)
+                        errors.push_back(e);
+                }
+                if (sink.symbols) {
+                    for (auto it = l; it != ch.lexemes.end(); ++it) {
+                        if (it->type == lexeme_type::IDENTIFIER)
+                            it->symbol = sink.symbols->intern(it->text);
+                    }
+                }
+                // splicing a whole list is constant time, a range has to be counted
+                ch.lexemes.erase_and_dispose(ch.lexemes.begin(), l, lexeme::disposer{});
+                sink.lexemes.splice(sink.lexemes.end(), ch.lexemes);
+                sink.trivia = ch.trivia;
+                c = ch.stopped;
+                break;
+            }
+
+            // nothing of this chunk can be used anymore, the next one may still be in step
+            char* stop;
+            if (l != ch.lexemes.end())
+                stop = const_cast<char*>(in_step ? c + 1 : lexeme_start(*l));
+            else
+                stop = ch.stopped ? ch.stopped : next;
+            if (c >= stop)
+                break;
+
+            c = run_state_machine(c, end, stop, sink, errors);
+            if (c == nullptr || c == end)
+                break;
+        }
+    }
+
+    for (auto&& ch : chunks)
+        sink.memory.adopt(ch.memory);
+    return true;
+}
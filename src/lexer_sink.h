@@ -0,0 +1,111 @@
+#pragma once
+
+#include "lexer.h"
+#include "symbol_table.h"
+#include "token_buffer.h"
+
+// Where the lexer engines put the lexemes they produce.
+
+// Whitespace and comments waiting for the lexeme they are folded into.
+struct pending_trivia {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    u8 flags = 0;
+};
+
+struct lexeme_list_sink {
+    lexeme_list& lexemes;
+    arena& memory;
+    symbol_table* symbols;
+    const char* file_begin;
+    source_location base; // location of file_begin
+    bool fold_trivia = false;
+    pending_trivia trivia = {};
+
+    source_location location(const char* c) const {
+        return base + source_location(c - file_begin);
+    }
+
+    void produce(lexeme_type type, char* begin, char* end) {
+        // trivia is only folded into the lexeme right behind it, not over bytes an error dropped
+        if (trivia.begin && trivia.end != begin)
+            finish();
+        if (fold_trivia && (type == lexeme_type::WHITESPACE || type == lexeme_type::COMMENT)) {
+            if (trivia.begin == nullptr)
+                trivia.begin = begin;
+            trivia.end = end;
+            trivia.flags |= type == lexeme_type::WHITESPACE ? SPACE_BEFORE : COMMENT_BEFORE;
+            return;
+        }
+
+        auto l = create_lexeme(memory, type, location(begin), std::string_view{begin, size_t(end - begin)});
+        if (symbols && type == lexeme_type::IDENTIFIER)
+            l->symbol = symbols->intern(l->text);
+        if (trivia.begin) {
+            l->trivia = u32(begin - trivia.begin);
+            l->flags = trivia.flags;
+            trivia = {};
+        }
+        lexemes.push_back(*l);
+    }
+
+    // Trivia with no lexeme behind it, at the end of the input or in front of an error, becomes one lexeme.
+    void finish() {
+        if (trivia.begin == nullptr)
+            return;
+        auto type = trivia.flags & COMMENT_BEFORE ? lexeme_type::COMMENT : lexeme_type::WHITESPACE;
+        auto text = std::string_view{trivia.begin, size_t(trivia.end - trivia.begin)};
+        lexemes.push_back(*create_lexeme(memory, type, location(trivia.begin), text));
+        trivia = {};
+    }
+};
+
+struct token_buffer_sink {
+    token_buffer& tokens;
+    u16 file;
+    const char* file_begin;
+    source_location base; // location of file_begin, for errors
+    symbol_table* symbols;
+
+    source_location location(const char* c) const {
+        return base + source_location(c - file_begin);
+    }
+
+    void produce(lexeme_type type, char* begin, char* end) {
+        u32 symbol = 0;
+        if (symbols && type == lexeme_type::IDENTIFIER)
+            symbol = symbols->intern(std::string_view{begin, size_t(end - begin)});
+        tokens.push_back(type, file, u32(begin - file_begin), u32(end - begin), symbol);
+    }
+};
+
+// Passes lexemes on to another sink and notes whether the last of them ended a line. A line continuation ends none.
+template<typename Sink>
+struct line_end_sink {
+    Sink& inner;
+    bool ended = false;
+
+    source_location location(const char* c) const {
+        return inner.location(c);
+    }
+
+    void produce(lexeme_type type, char* begin, char* end) {
+        ended = type == lexeme_type::LINE_END;
+        inner.produce(type, begin, end);
+    }
+};
+
+// What a piece of text lexes to, for text put together instead of read from a file. Nothing gets a location.
+struct single_lexeme_sink {
+    std::size_t count = 0;
+    lexeme_type type = lexeme_type::WHITESPACE; // of the first lexeme
+
+    source_location location(const char*) const {
+        return 0;
+    }
+
+    void produce(lexeme_type t, char*, char*) {
+        if (count++ == 0)
+            type = t;
+    }
+};
@@ -0,0 +1,146 @@
+#include "lexer_stream.h"
+#include "lexer_sink.h"
+#include "text_encoding.h"
+
+#include <future>
+#include <istream>
+#include <iterator>
+
+stream_lexer::stream_lexer(std::string_view fp, lexer_options options) : _lexer(fp, options) {}
+
+stream_lexer::~stream_lexer() {
+    if (_block)
+        _lexer.sources().release(*_block);
+}
+
+void stream_lexer::feed(const char* data, std::size_t size, lexer::result& out) {
+    if (_aborted)
+        return;
+
+    _buffer.erase(_buffer.begin(), _buffer.begin() + _consumed);
+    _consumed = 0;
+    _buffer.insert(_buffer.end(), data, data + size);
+    if (_buffer.size() >= _retry_size)
+        lex(out, false);
+}
+
+void stream_lexer::finish(lexer::result& out) {
+    if (_aborted)
+        return;
+
+    _buffer.erase(_buffer.begin(), _buffer.begin() + _consumed);
+    _consumed = 0;
+    lex(out, true);
+}
+
+void stream_lexer::lex(lexer::result& out, bool last) {
+    auto begin = _buffer.data();
+    auto end = begin + _buffer.size();
+    auto c = begin;
+
+    if (!_started) {
+        if (!last && _buffer.size() < 3)
+            return; // could be the start of a byte order mark
+        _started = true;
+        c += utf8_bom_size(c, end);
+    }
+
+    // the buffer is gone by the time locations get resolved, so it is added as a fragment with its line table
+    auto&& options = _lexer.options;
+    auto&& sources = _lexer.sources();
+    if (_block)
+        sources.release(*_block);
+    auto base = sources.add_fragment(_lexer.file_path, begin, end, _line, _column);
+    _block = base;
+    lexeme_list fresh;
+    std::vector<lex_err> errors;
+    lexeme_list_sink sink{
+        .lexemes = fresh,
+        .memory = options.lexemes ? *options.lexemes : default_arena(),
+        .symbols = options.symbols,
+        .file_begin = begin,
+        .base = base,
+        .fold_trivia = options.fold_trivia,
+    };
+    auto stopped = _lexer.run_state_machine(c, end, end, sink, errors);
+
+    if (stopped == nullptr || last) {
+        sink.finish();
+        _aborted = stopped == nullptr;
+        out.lexemes.splice(out.lexemes.end(), fresh);
+        out.errors.insert(out.errors.end(), errors.begin(), errors.end());
+        _consumed = _buffer.size();
+        return;
+    }
+
+    // the last lexeme might go on in the next block, so might whatever was consumed behind it, trivia waiting for
+    // a lexeme included
+    auto held_back = fresh.end();
+    auto resume = c;
+    if (!fresh.empty()) {
+        auto&& l = fresh.back();
+        if (l.text.data() + l.text.size() == end) {
+            held_back = std::prev(fresh.end());
+            // so might a dot right in front of a dot, the two may be the start of an ellipsis
+            if (l.type == lexeme_type::DOT && l.trivia == 0 && held_back != fresh.begin()) {
+                auto&& dot = *std::prev(held_back);
+                if (dot.type == lexeme_type::DOT && dot.text.data() + dot.text.size() == l.text.data())
+                    --held_back;
+            }
+            resume = const_cast<char*>(held_back->leading_trivia().data());
+        } else {
+            resume = const_cast<char*>(l.text.data() + l.text.size());
+        }
+    }
+    auto next = sources.resolve(sink.location(resume));
+    _line = next.line;
+    _column = next.column;
+
+    out.lexemes.splice(out.lexemes.end(), fresh, fresh.begin(), held_back);
+    for (auto&& e : errors) {
+        if (e.problem.data() < resume)
+            out.errors.push_back(e);
+    }
+    _consumed = std::size_t(resume - begin);
+    // lexing the same long lexeme again for every block would be quadratic
+    _retry_size = _consumed == 0 ? 2 * _buffer.size() : 0;
+}
+
+bool lex_stream(
+    std::istream& in,
+    std::string_view fp,
+    lexer_options options,
+    std::size_t block_size,
+    const std::function<void(lexer::result&)>& consume
+) {
+    arena lexemes;
+    if (options.lexemes == nullptr)
+        options.lexemes = &lexemes;
+
+    stream_lexer stream{fp, options};
+    std::vector<char> current(block_size);
+    std::vector<char> next(block_size);
+    auto read = [&in](std::vector<char>& block) {
+        in.read(block.data(), std::streamsize(block.size()));
+        return std::size_t(in.gcount());
+    };
+
+    auto size = read(current);
+    while (size > 0 && !stream.aborted()) {
+        auto pending = std::async(std::launch::async, read, std::ref(next));
+        lexer::result out;
+        stream.feed(current.data(), size, out);
+        consume(out);
+        out.lexemes.clear();
+        if (options.lexemes == &lexemes)
+            lexemes.reset();
+
+        size = pending.get();
+        std::swap(current, next);
+    }
+
+    lexer::result out;
+    stream.finish(out);
+    consume(out);
+    return !stream.aborted();
+}
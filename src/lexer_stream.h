@@ -0,0 +1,69 @@
+#pragma once
+
+#include <functional>
+#include <iosfwd>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include "lexer.h"
+
+/**
+ * Lexes input that arrives in blocks, for pipes and files that don't fit in memory. Lexemes that might continue
+ * in the next block (partial lexemes, a pending \r, open comments and strings) are held back and lexed again
+ * together with it, so the lexemes are the same as if the input had been lexed in one piece.
+ *
+ * The text of the lexemes handed out points into a buffer of the stream lexer and stays valid until the next
+ * call to feed or finish, so do their locations. Memory use and the locations used up in the source map are
+ * bounded by the block size and the longest lexeme.
+ */
+class stream_lexer {
+public:
+    explicit stream_lexer(std::string_view fp, lexer_options options = {});
+    ~stream_lexer();
+
+    stream_lexer(const stream_lexer&) = delete;
+    stream_lexer& operator=(const stream_lexer&) = delete;
+
+    /**
+     * Lexes the next block of input, appends the lexemes and errors that are known to be final to out.
+     */
+    void feed(const char* data, std::size_t size, lexer::result& out);
+
+    /**
+     * Lexes what is left at the end of the input.
+     */
+    void finish(lexer::result& out);
+
+    /**
+     * True if an error stopped lexing, the rest of the input is ignored.
+     */
+    bool aborted() const {
+        return _aborted;
+    }
+
+private:
+    void lex(lexer::result& out, bool last);
+
+    lexer _lexer;
+    std::vector<char> _buffer;
+    std::size_t _consumed = 0;   // bytes at the front of _buffer that are lexed for good
+    std::size_t _retry_size = 0; // when nothing could be handed out, wait for this much input before lexing again
+    i32 _line = 1;
+    i32 _column = 0; // column of the first byte not consumed
+    std::optional<source_location> _block; // locations of the block lexed last, given back with the next one
+    bool _started = false;
+    bool _aborted = false;
+};
+
+/**
+ * Reads in in blocks of block_size bytes and lexes them, the next block is read while the current one is lexed.
+ * consume is called with the lexemes of every block, see stream_lexer for how long they stay valid.
+ * Returns false if an error aborted lexing.
+ */
+bool lex_stream(
+    std::istream& in,
+    std::string_view fp,
+    lexer_options options,
+    std::size_t block_size,
+    const std::function<void(lexer::result&)>& consume
+);
@@ -0,0 +1,227 @@
+#include "lexer.h"
+#include "lexer_sink.h"
+#include "simd_scan.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+/*
+Structural lexer
+
+Stage 1 classifies the whole input into block_masks, 64 bytes at a time.
+Stage 2 walks the input one lexeme at a time. Whitespace, identifiers, decimals, comments and strings end at
+the next set (or cleared) bit of the relevant bitmap, so their bytes are never looked at individually.
+Everything else (octal, hexadecimal and float literals, dots, line continuations, errors) is handed to the
+state machine for exactly one lexeme, which keeps the lexemes of both engines identical.
+ */
+
+namespace {
+
+struct punctuator {
+    bool valid = false;
+    lexeme_type single{};
+    char second[2] = {};
+    lexeme_type pair[2] = {};
+    char defer = 0; // second character that needs the state machine
+};
+
+constexpr std::array<punctuator, 256> make_punctuators() {
+    std::array<punctuator, 256> t{};
+    auto op = [&t](char c, lexeme_type single, char s0 = 0, lexeme_type p0 = {}, char s1 = 0, lexeme_type p1 = {}) {
+        t[u8(c)] = punctuator{true, single, {s0, s1}, {p0, p1}};
+    };
+
+    op('+', lexeme_type::PLUS, '+', lexeme_type::INCREMENT, '=', lexeme_type::ADD_EQ);
+    op('-', lexeme_type::MINUS, '-', lexeme_type::DECREMENT, '=', lexeme_type::SUB_EQ);
+    op('*', lexeme_type::MUL, '=', lexeme_type::MUL_EQ, '*', lexeme_type::POW);
+    op('/', lexeme_type::DIV, '=', lexeme_type::DIV_EQ);
+    op('%', lexeme_type::MOD, '=', lexeme_type::MOD_EQ);
+    op('&', lexeme_type::BIT_AND, '&', lexeme_type::AND);
+    op('|', lexeme_type::BIT_OR, '|', lexeme_type::OR);
+    op('^', lexeme_type::BIT_XOR, '^', lexeme_type::XOR);
+    op('#', lexeme_type::HASH, '#', lexeme_type::TOKEN_CONCAT);
+    op('$', lexeme_type::CONCAT, '=', lexeme_type::CONCAT_EQ);
+    op('@', lexeme_type::CONCAT_SPACE, '=', lexeme_type::CONCAT_SPACE_EQ);
+    op('=', lexeme_type::EQ, '=', lexeme_type::EQ_EQ);
+    op('!', lexeme_type::NOT, '=', lexeme_type::NEQ);
+    op('~', lexeme_type::BIT_NOT, '=', lexeme_type::ALMOST);
+    op('<', lexeme_type::LT, '=', lexeme_type::LT_EQ, '<', lexeme_type::SHL);
+    op('>', lexeme_type::GT, '=', lexeme_type::GT_EQ);
+    t[u8('>')].defer = '>';
+    op(',', lexeme_type::COMMA);
+    op(':', lexeme_type::COLON);
+    op(';', lexeme_type::SEMICOLON);
+    op('(', lexeme_type::OPEN_PAREN);
+    op(')', lexeme_type::CLOSE_PAREN);
+    op('{', lexeme_type::OPEN_BRACE);
+    op('}', lexeme_type::CLOSE_BRACE);
+    op('[', lexeme_type::OPEN_BRACKET);
+    op(']', lexeme_type::CLOSE_BRACKET);
+    return t;
+}
+
+constexpr auto Punctuators = make_punctuators();
+
+// Returns the position of the first set bit at or after pos, or n if there is none.
+template<typename Select>
+std::size_t next_set(const std::vector<block_masks>& blocks, std::size_t pos, std::size_t n, Select select) {
+    if (pos >= n)
+        return n;
+
+    auto block = pos / 64;
+    u64 bits = select(blocks[block]) & (~u64(0) << (pos % 64));
+    while (bits == 0) {
+        if (++block == blocks.size())
+            return n;
+        bits = select(blocks[block]);
+    }
+    return std::min(n, block * 64 + std::countr_zero(bits));
+}
+
+}
+
+template<typename Sink>
+void lexer::run_structural(char* begin, char* end, Sink& sink, std::vector<lex_err>& errors) {
+    auto&& scan = scan_kernels_active();
+    std::size_t n = std::size_t(end - begin);
+    std::vector<block_masks> blocks((n + 63) / 64);
+
+    // Stage 1
+    std::size_t full_blocks = n / 64;
+    for (std::size_t i = 0; i < full_blocks; ++i) {
+        scan.classify(begin + 64 * i, blocks[i]);
+    }
+    if (n % 64) {
+        // zero bytes are not part of any class
+        char tail[64] = {};
+        std::memcpy(tail, begin + 64 * full_blocks, n % 64);
+        scan.classify(tail, blocks[full_blocks]);
+    }
+
+    // Stage 2
+    auto c = begin;
+
+    auto produce = [&](lexeme_type type, char* token_end) {
+        sink.produce(type, c, token_end);
+        c = token_end;
+    };
+
+    auto at = [begin](std::size_t pos) {
+        return begin + pos;
+    };
+
+    auto state_machine = [&]() {
+        c = run_state_machine(c, end, c + 1, sink, errors);
+        if (c == nullptr)
+            c = end; // aborted
+    };
+
+    while (c != end) {
+        std::size_t pos = std::size_t(c - begin);
+        u64 bit = u64(1) << (pos % 64);
+        auto&& m = blocks[pos / 64];
+
+        if (m.whitespace & bit) {
+            produce(lexeme_type::WHITESPACE, at(next_set(blocks, pos, n, [](const block_masks& b) {
+                return ~b.whitespace;
+            })));
+            continue;
+        }
+
+        if (m.identifier & ~m.digit & bit) {
+            produce(lexeme_type::IDENTIFIER, at(next_set(blocks, pos, n, [](const block_masks& b) {
+                return ~b.identifier;
+            })));
+            continue;
+        }
+
+        if (m.line_feed & bit) {
+            produce(lexeme_type::LINE_END, c + 1);
+            continue;
+        }
+
+        if (m.carriage_return & bit) {
+            produce(lexeme_type::LINE_END, (c + 1 != end && c[1] == '\n') ? c + 2 : c + 1);
+            continue;
+        }
+
+        if ((m.slash & bit) && c + 1 != end && c[1] == '/') {
+            produce(lexeme_type::COMMENT, at(next_set(blocks, pos + 2, n, [](const block_masks& b) {
+                return b.line_feed | b.carriage_return;
+            })));
+            continue;
+        }
+
+        if ((m.slash & bit) && c + 1 != end && c[1] == '*') {
+            auto star = next_set(blocks, pos + 2, n, [](const block_masks& b) {
+                return b.star;
+            });
+            while (star + 1 < n && *at(star + 1) != '/') {
+                star = next_set(blocks, star + 1, n, [](const block_masks& b) {
+                    return b.star;
+                });
+            }
+            if (star + 1 < n) {
+                produce(lexeme_type::COMMENT, at(star + 2));
+                continue;
+            }
+            state_machine(); // unterminated comment
+            continue;
+        }
+
+        if (m.double_quote & bit || m.single_quote & bit) {
+            bool is_string = (m.double_quote & bit) != 0;
+            auto stop = next_set(blocks, pos + 1, n, [is_string](const block_masks& b) {
+                return (is_string ? b.double_quote : b.single_quote) | b.backslash | b.line_feed | b.carriage_return;
+            });
+            while (stop + 1 < n && *at(stop) == '\\' && *at(stop + 1) != '\n' && *at(stop + 1) != '\r') {
+                stop = next_set(blocks, stop + 2, n, [is_string](const block_masks& b) {
+                    return (is_string ? b.double_quote : b.single_quote) | b.backslash | b.line_feed | b.carriage_return;
+                });
+            }
+            if (stop < n && *at(stop) == *c) {
+                produce(is_string ? lexeme_type::STRING : lexeme_type::NAME, at(stop + 1));
+                continue;
+            }
+            state_machine(); // unclosed string or name
+            continue;
+        }
+
+        if ((m.digit & bit) && *c != '0') {
+            auto digits_end = next_set(blocks, pos, n, [](const block_masks& b) {
+                return ~b.digit;
+            });
+            if (digits_end == n || *at(digits_end) != '.') {
+                produce(lexeme_type::DECIMAL, at(digits_end));
+                continue;
+            }
+            state_machine(); // float literal
+            continue;
+        }
+
+        auto&& p = Punctuators[u8(*c)];
+        if (p.valid) {
+            char next = (c + 1 != end) ? c[1] : 0;
+            if (c + 1 == end || next == 0) {
+                produce(p.single, c + 1);
+                continue;
+            } else if (next == p.second[0]) {
+                produce(p.pair[0], c + 2);
+                continue;
+            } else if (next == p.second[1]) {
+                produce(p.pair[1], c + 2);
+                continue;
+            } else if (next != p.defer) {
+                produce(p.single, c + 1);
+                continue;
+            }
+        }
+
+        state_machine();
+    }
+}
+
+template void lexer::run_structural(char*, char*, lexeme_list_sink&, std::vector<lex_err>&);
+template void lexer::run_structural(char*, char*, token_buffer_sink&, std::vector<lex_err>&);
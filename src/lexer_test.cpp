@@ -1,5 +1,18 @@
+#include "directive_index.h"
 #include "lexer.h"
+#include "lexer_cursor.h"
+#include "lexer_stream.h"
+#include "simd_scan.h"
+#include "symbol_table.h"
+#include "text_encoding.h"
+#include "token_buffer.h"
 #include <catch.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
 
 TEST_CASE("Empty content returns no lexemes") {
     std::vector<char> c(std::size_t(0));
@@ -71,3 +84,1121 @@ TEST_CASE("zero followed by dot f produces FLOAT lexeme") {
     REQUIRE(result.lexemes.size() == 1);
     REQUIRE(result.lexemes.begin()->type == lexeme_type::FLOAT);
 }
+
+TEST_CASE("whitespace followed by line feed produces WHITESPACE and LINE_END lexemes") {
+    std::vector<char> c{' ', '\t', '\n', ' '};
+    lexer l{"test"};
+    auto result = l.run(c);
+
+    REQUIRE(result.lexemes.size() == 3);
+    auto it = result.lexemes.begin();
+    REQUIRE((it++)->type == lexeme_type::WHITESPACE);
+    REQUIRE(it->type == lexeme_type::LINE_END);
+    REQUIRE(default_source_map().resolve((it++)->location).line == 1);
+    REQUIRE(it->type == lexeme_type::WHITESPACE);
+    REQUIRE(default_source_map().resolve(it->location).line == 2);
+}
+
+TEST_CASE("block comment closed by multiple asterisks produces COMMENT lexeme") {
+    std::string s = "/* banner ***/";
+    lexer l{"test"};
+    auto result = l.run(&*s.begin(), &*s.begin() + s.size());
+
+    REQUIRE(result.errors.size() == 0);
+    REQUIRE(result.lexemes.size() == 1);
+    REQUIRE(result.lexemes.begin()->type == lexeme_type::COMMENT);
+}
+
+TEST_CASE("block comment closed at start of line counts lines") {
+    std::string s = "/*\r\n\n*/x";
+    lexer l{"test"};
+    auto result = l.run(&*s.begin(), &*s.begin() + s.size());
+
+    REQUIRE(result.errors.size() == 0);
+    REQUIRE(result.lexemes.size() == 2);
+    REQUIRE(result.lexemes.begin()->type == lexeme_type::COMMENT);
+    REQUIRE(result.lexemes.rbegin()->type == lexeme_type::IDENTIFIER);
+    auto location = default_source_map().resolve(result.lexemes.rbegin()->location);
+    REQUIRE(location.file_path == "test");
+    REQUIRE(location.line == 3);
+    REQUIRE(location.column == 2);
+}
+
+TEST_CASE("three dots produce ELLIPSIS lexeme and two dots produce two DOT lexemes") {
+    std::string s = "...a..";
+    lexer l{"test"};
+    auto result = l.run(&*s.begin(), &*s.begin() + s.size());
+
+    REQUIRE(result.errors.size() == 0);
+    std::vector<std::pair<lexeme_type, std::string_view>> lexemes;
+    for (auto&& x : result.lexemes)
+        lexemes.emplace_back(x.type, x.text);
+    REQUIRE(lexemes == std::vector<std::pair<lexeme_type, std::string_view>>{
+        {lexeme_type::ELLIPSIS, "..."},
+        {lexeme_type::IDENTIFIER, "a"},
+        {lexeme_type::DOT, "."},
+        {lexeme_type::DOT, "."},
+    });
+}
+
+TEST_CASE("escaped line end continues a string") {
+    std::string s = "\"a\\\nb\"";
+    lexer l{"test"};
+    auto result = l.run(&*s.begin(), &*s.begin() + s.size());
+
+    REQUIRE(result.errors.size() == 0);
+    REQUIRE(result.lexemes.size() == 1);
+    REQUIRE(result.lexemes.begin()->type == lexeme_type::STRING);
+    REQUIRE(result.lexemes.begin()->text == s);
+}
+
+TEST_CASE("scan kernels agree with scalar kernels") {
+    std::string alphabet = "aZ_09 \t\v\f\r\n*\"'\\/#$.\x80\xff";
+    std::string s;
+    u32 seed = 12345;
+    for (int i = 0; i < 4096; ++i) {
+        seed = seed * 1103515245 + 12345;
+        // long runs of the same class exercise the vector loops, short ones the tails
+        auto run = (seed >> 16) % 70;
+        auto ch = alphabet[(seed >> 8) % alphabet.size()];
+        s.append(run, ch);
+    }
+
+    auto&& ref = scan_kernels_for(scan_isa::SCALAR);
+    for (auto isa : {scan_isa::SSE42, scan_isa::AVX2}) {
+        if (scan_isa_supported(isa) == false)
+            continue;
+
+        auto&& k = scan_kernels_for(isa);
+        auto end = s.data() + s.size();
+        std::size_t mismatches = 0;
+        for (auto c = s.data(); c != end; ++c) {
+            mismatches += k.whitespace(c, end) != ref.whitespace(c, end);
+            mismatches += k.identifier(c, end) != ref.identifier(c, end);
+            mismatches += k.line_comment(c, end) != ref.line_comment(c, end);
+            mismatches += k.block_comment(c, end) != ref.block_comment(c, end);
+            mismatches += k.quoted(c, end, '"') != ref.quoted(c, end, '"');
+            mismatches += k.quoted(c, end, '\'') != ref.quoted(c, end, '\'');
+            mismatches += k.inactive(c, end) != ref.inactive(c, end);
+            mismatches += k.ascii(c, end) != ref.ascii(c, end);
+        }
+        REQUIRE(mismatches == 0);
+
+        // code units are all ASCII, mostly, with a non-ASCII byte every now and then in the low or high half
+        std::string units;
+        for (std::size_t i = 0; i < 4096; ++i) {
+            seed = seed * 1103515245 + 12345;
+            units += char('a' + i % 26);
+            units += (seed >> 16) % 97 == 0 ? '\x01' : '\0';
+            if ((seed >> 8) % 89 == 0)
+                units[units.size() - 2] = '\x80';
+        }
+        auto units_end = units.data() + units.size();
+        std::string out(units.size() / 2, '\0'), ref_out(units.size() / 2, '\0');
+        for (auto c = units.data(); c != units_end; ++c) {
+            auto stop = k.narrow_utf16(c, units_end, out.data());
+            mismatches += stop != ref.narrow_utf16(c, units_end, ref_out.data());
+            mismatches += out.compare(0, std::size_t(stop - c) / 2, ref_out, 0, std::size_t(stop - c) / 2) != 0;
+        }
+        REQUIRE(mismatches == 0);
+    }
+}
+
+TEST_CASE("UTF-16LE is transcoded to UTF-8") {
+    // every code point with one of the UTF-8 sizes, surrogate pairs, and unpaired surrogates
+    std::u16string text = u"class \u00e9\u20ac\U0001F600 x;";
+    text += char16_t(0xD800);
+    text += u"a";
+    text += char16_t(0xDC00);
+    std::string expected = "class \xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 x;\xef\xbf\xbd" "a\xef\xbf\xbd";
+
+    std::vector<char> bytes{'\xFF', '\xFE'};
+    for (auto unit : text) {
+        bytes.push_back(char(unit & 0xFF));
+        bytes.push_back(char(unit >> 8));
+    }
+    REQUIRE(decode_source(bytes) == text_encoding::UTF16LE);
+    REQUIRE(std::string(bytes.begin(), bytes.end()) == expected);
+
+    // long ASCII runs go through the vector kernels
+    std::string ascii(1000, 'x');
+    std::vector<char> wide{'\xFF', '\xFE'};
+    for (auto ch : ascii + "\xc3\xa9" + ascii) {
+        wide.push_back(ch == '\xc3' ? '\xe9' : ch);
+        wide.push_back('\0');
+        if (ch == '\xc3')
+            break;
+    }
+    for (auto ch : ascii) {
+        wide.push_back(ch);
+        wide.push_back('\0');
+    }
+    wide.push_back('y');
+    REQUIRE(decode_source(wide) == text_encoding::UTF16LE);
+    REQUIRE(std::string(wide.begin(), wide.end()) == ascii + "\xc3\xa9" + ascii + "\xef\xbf\xbd");
+}
+
+TEST_CASE("UTF-8 is validated") {
+    auto encoding = [](std::string s) {
+        std::vector<char> bytes(s.begin(), s.end());
+        return decode_source(bytes);
+    };
+    REQUIRE(encoding("") == text_encoding::UTF8);
+    REQUIRE(encoding("\xEF\xBB\xBF" "class") == text_encoding::UTF8);
+    REQUIRE(encoding(std::string(100, 'a') + "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf") == text_encoding::UTF8);
+    REQUIRE(encoding(std::string(100, 'a') + "caf\xe9") == text_encoding::BYTES); // Windows-1252
+    REQUIRE(encoding("\xc0\xaf") == text_encoding::BYTES);                        // overlong
+    REQUIRE(encoding("\xed\xa0\x80") == text_encoding::BYTES);                    // surrogate
+    REQUIRE(encoding("\xf4\x90\x80\x80") == text_encoding::BYTES);                // above U+10FFFF
+    REQUIRE(encoding("\xe2\x82") == text_encoding::BYTES);                        // cut off
+}
+
+TEST_CASE("lexer skips the byte order mark and drops non-ASCII characters whole") {
+    for (auto engine : {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA}) {
+        std::string s = "\xEF\xBB\xBFs = \"h\xc3\xa9\"; // \xe2\x82\xac\n/* \xe2\x82\xac */ n = 'N\xc3\xa9'; x\xc3\xa9\xe9y\n";
+        auto result = lexer{"test", {engine}}.run(s.data(), s.data() + s.size());
+        REQUIRE(result.lexemes.front().text == "s");
+        REQUIRE(result.errors.size() == 2);
+        REQUIRE(result.errors[0].problem == "\xc3\xa9");
+        REQUIRE(result.errors[1].problem == "\xe9");
+    }
+}
+
+// line and column, lexing the same buffer twice gives it two ranges of locations
+static std::pair<i32, i32> line_column(source_location location) {
+    auto resolved = default_source_map().resolve(location);
+    return {resolved.line, resolved.column};
+}
+
+static bool same_lexemes(const lexer::result& a, const lexer::result& b) {
+    if (a.lexemes.size() != b.lexemes.size() || a.errors.size() != b.errors.size())
+        return false;
+
+    auto bl = b.lexemes.begin();
+    for (auto&& l : a.lexemes) {
+        if (l.type != bl->type || l.text.data() != bl->text.data() || l.text.size() != bl->text.size() ||
+            line_column(l.location) != line_column(bl->location) || l.trivia != bl->trivia || l.flags != bl->flags)
+            return false;
+        ++bl;
+    }
+
+    for (std::size_t i = 0; i < a.errors.size(); ++i) {
+        auto&& ea = a.errors[i];
+        auto&& eb = b.errors[i];
+        if (ea.problem.data() != eb.problem.data() || ea.problem.size() != eb.problem.size() ||
+            ea.explanation != eb.explanation || line_column(ea.location) != line_column(eb.location))
+            return false;
+    }
+    return true;
+}
+
+static std::vector<std::string> lexer_corpus() {
+    std::vector<std::string> corpus{
+        "",
+        " \t\v\f",
+        "\n",
+        "\r",
+        "\r\n",
+        "0",
+        "0.",
+        "0.f",
+        " \t\n ",
+        "/* banner ***/",
+        "/*\r\n\n*/x",
+        "class Foo extends Actor\r\n    config(Game);\r\n",
+        "var() config float Speed, Accel; // speed\n",
+        "#define FOO(a, b) ((a) ## (b))\n#if defined(FOO) && FOO >= 2200\n#endif\n",
+        "x = a<<b >> c >>> d >= e <= f != g == h ~= i;\n",
+        "s = \"abc\\\"def\" $ 'Name' @ \"unclosed\n",
+        "a+=b-=c*=d/=e%=f$=g@=h++i--j**k&&l||m^^n##o\n",
+        "f = 0x1F + 017 + 08 + 1.5e+3f + 2.0 + 3e + .5 + 0x;\n",
+        "a...b..c.d\\\ne\\\r\nf\\g",
+        "/* unterminated\n comment",
+        "'unclosed name",
+        "\x01\x7f\x80 ` ? \xff",
+        "x\xc3\xa9y \xe2\x82 \xf0\x9f\x98\x80\xc3\n\"\xc3\xa9\" // \xe2\x82\xac\n",
+        "defaultproperties\n{\n\tName=\"Default\"\n\tTag='Tag'\n}\n",
+    };
+
+    std::string alphabet = "aZ_09 \t\n\r*/\"'\\.#<>=+-!x.eEf$@&|^~%:;,(){}[]";
+    u32 seed = 42;
+    for (int i = 0; i < 200; ++i) {
+        std::string s;
+        for (int j = 0; j < 300; ++j) {
+            seed = seed * 1103515245 + 12345;
+            auto run = 1 + (seed >> 28) % 4;
+            s.append(run, alphabet[(seed >> 8) % alphabet.size()]);
+        }
+        corpus.push_back(std::move(s));
+    }
+    return corpus;
+}
+
+TEST_CASE("structural lexer produces the same lexemes as the state machine") {
+    for (auto&& s : lexer_corpus()) {
+        std::vector<char> c(s.begin(), s.end());
+        auto expected = lexer{"test"}.run(c);
+        auto actual = lexer{"test", {lexer_engine::STRUCTURAL}}.run(c);
+        INFO(s);
+        REQUIRE(same_lexemes(expected, actual));
+    }
+}
+
+TEST_CASE("dfa lexer produces the same lexemes as the state machine") {
+    for (auto&& s : lexer_corpus()) {
+        std::vector<char> c(s.begin(), s.end());
+        auto expected = lexer{"test"}.run(c);
+        auto actual = lexer{"test", {lexer_engine::DFA}}.run(c);
+        INFO(s);
+        REQUIRE(same_lexemes(expected, actual));
+    }
+}
+
+TEST_CASE("token buffer holds the same lexemes as the lexeme list") {
+    for (auto engine : {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA}) {
+        for (auto&& s : lexer_corpus()) {
+            std::vector<char> c(s.begin(), s.end());
+            auto expected = lexer{"test"}.run(c);
+            token_buffer tokens;
+            auto errors = lexer{"test", {engine}}.run(c.data(), c.data() + c.size(), tokens);
+            INFO(s);
+            REQUIRE(errors.size() == expected.errors.size());
+
+            auto p = tokens.begin();
+            for (auto&& l : expected.lexemes) {
+                REQUIRE(p != tokens.end());
+                auto location = tokens.location(p.token);
+                REQUIRE(tokens.type(p.token) == l.type);
+                REQUIRE(tokens.text(p.token).data() == l.text.data());
+                REQUIRE(tokens.text(p.token).size() == l.text.size());
+                REQUIRE(std::pair{location.line, location.column} == line_column(l.location));
+                p = tokens.next(p);
+            }
+            REQUIRE(p == tokens.end());
+        }
+    }
+}
+
+static std::string buffer_text(const token_buffer& tokens) {
+    std::ostringstream os;
+    tokens.write_to(os);
+    return os.str();
+}
+
+TEST_CASE("token buffer splices lexemes") {
+    std::string outer = "a b c";
+    std::string inner = "x+y";
+    token_buffer tokens;
+    auto errors = lexer{"outer"}.run(outer.data(), outer.data() + outer.size(), tokens);
+    REQUIRE(errors.empty());
+    auto first = token_buffer::index(tokens.size());
+    errors = lexer{"inner"}.run(inner.data(), inner.data() + inner.size(), tokens);
+    REQUIRE(errors.empty());
+    auto last = token_buffer::index(tokens.size());
+    REQUIRE(tokens.file_path(tokens.file(first)) == "inner");
+
+    // the second run appended its lexemes, take them out again
+    auto p = tokens.begin();
+    for (int i = 0; i < 5; ++i)
+        p = tokens.next(p);
+    tokens.erase(p, tokens.end());
+    REQUIRE(buffer_text(tokens) == "a b c");
+
+    // replace "b" with the inner lexemes, twice
+    auto b = tokens.next(tokens.next(tokens.begin()));
+    b = tokens.insert(b, first, last);
+    b = tokens.insert(b, first, last);
+    for (int i = 0; i < 6; ++i)
+        b = tokens.next(b);
+    REQUIRE(tokens.text(b.token) == "b");
+    tokens.erase(b, tokens.next(b));
+    REQUIRE(buffer_text(tokens) == "a x+y x+y c");
+
+    tokens.erase(tokens.begin(), tokens.next(tokens.begin()));
+    REQUIRE(buffer_text(tokens) == " x+y x+y c");
+    tokens.erase(tokens.begin(), tokens.end());
+    REQUIRE(tokens.begin() == tokens.end());
+    REQUIRE(buffer_text(tokens).empty());
+}
+
+TEST_CASE("token buffer separates lexemes like lexeme list") {
+    std::string s = "a b 1 2 > > >> > = =";
+    token_buffer tokens;
+    lexer{"test"}.run(s.data(), s.data() + s.size(), tokens);
+
+    // drop whitespace so lexemes have to be separated again
+    for (auto p = tokens.begin(); p != tokens.end();) {
+        if (tokens.type(p.token) == lexeme_type::WHITESPACE)
+            p = tokens.erase(p, tokens.next(p));
+        else
+            p = tokens.next(p);
+    }
+    REQUIRE(buffer_text(tokens) == "a b 1 2> > >> > = =");
+}
+
+TEST_CASE("identifiers are interned into the symbol table") {
+    for (auto engine : {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA}) {
+        std::string s = "foo bar = foo + define + 1;";
+        symbol_table symbols;
+        auto before = symbols.size();
+        auto result = lexer{"test", {engine, &symbols}}.run(s.data(), s.data() + s.size());
+        REQUIRE(symbols.size() == before + 2);
+
+        std::vector<u32> ids;
+        for (auto&& l : result.lexemes) {
+            if (l.type == lexeme_type::IDENTIFIER) {
+                REQUIRE(symbols.spelling(l.symbol) == l.text);
+                ids.push_back(l.symbol);
+            } else {
+                REQUIRE(l.symbol == symbol_table::NONE);
+            }
+        }
+        REQUIRE(ids.size() == 4);
+        REQUIRE(ids[0] == ids[2]);
+        REQUIRE(ids[0] != ids[1]);
+        REQUIRE(ids[3] == symbol_table::DEFINE);
+
+        token_buffer tokens;
+        lexer{"test", {engine, &symbols}}.run(s.data(), s.data() + s.size(), tokens);
+        auto l = result.lexemes.begin();
+        for (auto p = tokens.begin(); p != tokens.end(); p = tokens.next(p), ++l)
+            REQUIRE(tokens.symbol(p.token) == l->symbol);
+    }
+}
+
+TEST_CASE("arena reuses its memory after reset") {
+    arena a{arena_options{4096, false}};
+    REQUIRE(a.used() == 0);
+    REQUIRE(a.reserved() == 0);
+
+    for (int i = 0; i < 1000; ++i) {
+        auto p = a.allocate(24, 8);
+        REQUIRE(reinterpret_cast<std::uintptr_t>(p) % 8 == 0);
+    }
+    auto reserved = a.reserved();
+    REQUIRE(a.used() >= 24000);
+    REQUIRE(a.high_water_mark() == a.used());
+
+    auto big = a.allocate(10000, 64);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(big) % 64 == 0);
+    auto high_water_mark = a.high_water_mark();
+
+    a.reset();
+    REQUIRE(a.used() == 0);
+    REQUIRE(a.high_water_mark() == high_water_mark);
+    for (int i = 0; i < 1000; ++i)
+        a.allocate(24, 8);
+    a.allocate(10000, 64);
+    REQUIRE(a.reserved() == reserved + 10000 + 64);
+
+    a.release();
+    REQUIRE(a.reserved() == 0);
+    REQUIRE(a.high_water_mark() == high_water_mark);
+}
+
+TEST_CASE("arena lends its spare memory and adopts it back") {
+    arena a{arena_options{4096, false}};
+    for (int i = 0; i < 100; ++i)
+        a.allocate(1000);
+    auto reserved = a.reserved();
+    a.reset();
+
+    arena b{arena_options{4096, false}};
+    a.lend(b, 10000);
+    REQUIRE(b.reserved() >= 10000);
+    REQUIRE(a.reserved() == reserved - b.reserved());
+    auto p = static_cast<int*>(b.allocate(sizeof(int)));
+    *p = 42;
+    for (int i = 0; i < 20; ++i)
+        b.allocate(1000);
+    auto used = b.used();
+
+    a.allocate(100);
+    a.adopt(b);
+    REQUIRE(b.reserved() == 0);
+    REQUIRE(b.used() == 0);
+    REQUIRE(a.used() == used + 100);
+    REQUIRE(a.reserved() >= reserved);
+    for (int i = 0; i < 100; ++i)
+        a.allocate(1000);
+    REQUIRE(*p == 42);
+}
+
+TEST_CASE("lexer allocates lexemes from the arena it is given") {
+    for (bool huge_pages : {false, true}) {
+        arena a{arena_options{64 * 1024, huge_pages}};
+        std::string s = "a b c";
+        auto result = lexer{"test", {lexer_engine::STATE_MACHINE, nullptr, &a}}.run(s.data(), s.data() + s.size());
+        REQUIRE(result.lexemes.size() == 5);
+        REQUIRE(a.used() >= 5 * sizeof(lexeme));
+        REQUIRE(result.lexemes.back().text == "c");
+    }
+}
+
+TEST_CASE("relexing an edit gives the same lexemes as lexing the edited buffer") {
+    std::string inserts[] = {"", "x", "/*", "*/", "\"", "\n", "\r", "'", "\\", "0x", ">", "// a\n", "1.5", "."};
+    u32 seed = 7;
+    auto random = [&seed](std::size_t n) {
+        seed = seed * 1103515245 + 12345;
+        return n ? (seed >> 8) % n : 0;
+    };
+
+    for (auto&& s : lexer_corpus()) {
+        for (int i = 0; i < 10; ++i) {
+            std::vector<char> old_buffer(s.begin(), s.end());
+            auto previous = lexer{"test"}.run(old_buffer);
+
+            text_edit edit{random(s.size() + 1), 0, 0};
+            edit.old_length = random(std::min<std::size_t>(8, s.size() - edit.offset) + 1);
+            auto&& inserted = inserts[random(std::size(inserts))];
+            edit.new_length = inserted.size();
+
+            std::string edited = s;
+            edited.replace(edit.offset, edit.old_length, inserted);
+            std::vector<char> new_buffer(edited.begin(), edited.end());
+            auto new_begin = new_buffer.data();
+            lexer{"test"}.relex(previous, old_buffer.data(), edit, new_begin, new_begin + new_buffer.size());
+            old_buffer.clear();
+            old_buffer.shrink_to_fit();
+
+            auto expected = lexer{"test"}.run(new_buffer);
+            INFO(s);
+            INFO(edited);
+            REQUIRE(same_lexemes(expected, previous));
+        }
+    }
+}
+
+TEST_CASE("relexing an edit behind two dots gives an ellipsis") {
+    std::string s = "a..b";
+    std::vector<char> old_buffer(s.begin(), s.end());
+    auto previous = lexer{"test"}.run(old_buffer);
+
+    std::string edited = "a...b";
+    std::vector<char> new_buffer(edited.begin(), edited.end());
+    lexer{"test"}.relex(
+        previous, old_buffer.data(), text_edit{3, 0, 1}, new_buffer.data(), new_buffer.data() + new_buffer.size()
+    );
+    REQUIRE(same_lexemes(lexer{"test"}.run(new_buffer), previous));
+    REQUIRE(std::next(previous.lexemes.begin())->type == lexeme_type::ELLIPSIS);
+}
+
+TEST_CASE("relexing an edit only lexes around the edit") {
+    std::string s;
+    for (int i = 0; i < 20000; ++i)
+        s += "var int Field" + std::to_string(i) + "; // comment\n";
+    std::vector<char> old_buffer(s.begin(), s.end());
+    auto previous = lexer{"test"}.run(old_buffer);
+
+    std::string edited = s;
+    auto offset = s.size() / 2;
+    edited.insert(offset, "x");
+    std::vector<char> new_buffer(edited.begin(), edited.end());
+    auto relexed = lexer{"test"}.relex(
+        previous, old_buffer.data(), text_edit{offset, 0, 1}, new_buffer.data(), new_buffer.data() + new_buffer.size()
+    );
+    REQUIRE(relexed.begin <= offset);
+    REQUIRE(relexed.end >= offset + 1);
+    REQUIRE(relexed.end - relexed.begin < 64);
+    REQUIRE(same_lexemes(lexer{"test"}.run(new_buffer), previous));
+}
+
+struct lexeme_copy {
+    lexeme_type type;
+    std::string text;
+    std::pair<i32, i32> line_column;
+    std::string trivia;
+
+    bool operator==(const lexeme_copy&) const = default;
+};
+
+struct lex_err_copy {
+    std::string problem;
+    std::string explanation;
+    std::pair<i32, i32> line_column;
+
+    bool operator==(const lex_err_copy&) const = default;
+};
+
+static void copy_result(const lexer::result& r, std::vector<lexeme_copy>& lexemes, std::vector<lex_err_copy>& errors) {
+    for (auto&& l : r.lexemes)
+        lexemes.push_back(lexeme_copy{l.type, std::string{l.text}, line_column(l.location), std::string{l.leading_trivia()}});
+    for (auto&& e : r.errors)
+        errors.push_back(lex_err_copy{std::string{e.problem}, std::string{e.explanation}, line_column(e.location)});
+}
+
+TEST_CASE("streaming lexer gives the same lexemes for any block size") {
+    for (auto&& s : lexer_corpus()) {
+        std::vector<lexeme_copy> expected;
+        std::vector<lex_err_copy> expected_errors;
+        std::vector<char> c(s.begin(), s.end());
+        copy_result(lexer{"test"}.run(c), expected, expected_errors);
+
+        for (std::size_t block_size : {1, 2, 3, 5, 64, 1000}) {
+            std::vector<lexeme_copy> actual;
+            std::vector<lex_err_copy> actual_errors;
+            stream_lexer stream{"test"};
+            for (std::size_t i = 0; i < s.size(); i += block_size) {
+                lexer::result out;
+                stream.feed(s.data() + i, std::min(block_size, s.size() - i), out);
+                copy_result(out, actual, actual_errors);
+            }
+            lexer::result out;
+            stream.finish(out);
+            copy_result(out, actual, actual_errors);
+
+            INFO(s);
+            INFO(block_size);
+            REQUIRE(actual == expected);
+            REQUIRE(actual_errors == expected_errors);
+        }
+    }
+}
+
+TEST_CASE("streaming lexer reads from a stream") {
+    std::string s;
+    for (int i = 0; i < 2000; ++i)
+        s += "/* block\n comment */ var string S" + std::to_string(i) + " = \"text\";\r\n";
+
+    std::vector<lexeme_copy> expected;
+    std::vector<lex_err_copy> expected_errors;
+    std::vector<char> c(s.begin(), s.end());
+    copy_result(lexer{"test"}.run(c), expected, expected_errors);
+
+    std::vector<lexeme_copy> actual;
+    std::vector<lex_err_copy> actual_errors;
+    std::istringstream in{s};
+    REQUIRE(lex_stream(in, "test", {}, 4096, [&](lexer::result& out) {
+        copy_result(out, actual, actual_errors);
+    }));
+    REQUIRE(actual == expected);
+    REQUIRE(actual_errors.empty());
+}
+
+TEST_CASE("parallel lexing gives the same lexemes as lexing serially") {
+    // comments and strings that cross the chunk boundaries, some of them with comment openers in them
+    const char* lines[] = {
+        "var int A;\n",
+        "/* comment\n",
+        "more */ x = 1;\n",
+        "// /* not a comment\n",
+        "s = \"/* not a comment\";\r\n",
+        "a = b / c * d;\n",
+        "/*/ still a comment */\n",
+        "n = 'Name' $ \"unclosed\n",
+        "f = 1.5e3 + 0x1F;\r",
+        "\n",
+    };
+    u32 seed = 3;
+    for (int i = 0; i < 6; ++i) {
+        bool fold = i % 2 == 1;
+        std::string s;
+        while (s.size() < 2560 * 1024) {
+            seed = seed * 1103515245 + 12345;
+            s += lines[(seed >> 8) % std::size(lines)];
+        }
+        if (i >= 4)
+            s.insert(s.size() * 3 / 4, " 0x; "); // aborts lexing
+
+        std::vector<char> c(s.begin(), s.end());
+        std::vector<lexeme_copy> expected;
+        std::vector<lex_err_copy> expected_errors;
+        symbol_table expected_symbols;
+        lexer_options serial_options{lexer_engine::STATE_MACHINE, &expected_symbols};
+        serial_options.fold_trivia = fold;
+        auto serial = lexer{"test", serial_options}.run(c);
+        copy_result(serial, expected, expected_errors);
+
+        for (unsigned threads : {2u, 3u, 8u, 0u}) {
+            std::vector<lexeme_copy> actual;
+            std::vector<lex_err_copy> actual_errors;
+            symbol_table symbols;
+            lexer_options options{lexer_engine::STATE_MACHINE, &symbols};
+            options.threads = threads;
+            options.fold_trivia = fold;
+            auto parallel = lexer{"test", options}.run(c);
+            copy_result(parallel, actual, actual_errors);
+
+            INFO(i);
+            INFO(threads);
+            REQUIRE(actual == expected);
+            REQUIRE(actual_errors == expected_errors);
+            REQUIRE(std::equal(
+                serial.lexemes.begin(), serial.lexemes.end(), parallel.lexemes.begin(), parallel.lexemes.end(),
+                [](const lexeme& a, const lexeme& b) { return a.symbol == b.symbol; }
+            ));
+        }
+    }
+}
+
+TEST_CASE("cursor gives the same lexemes line by line") {
+    for (auto&& s : lexer_corpus()) {
+        std::vector<lexeme_copy> expected;
+        std::vector<lex_err_copy> expected_errors;
+        std::vector<char> c(s.begin(), s.end());
+        copy_result(lexer{"test"}.run(c), expected, expected_errors);
+
+        std::vector<lexeme_copy> actual;
+        std::vector<lex_err_copy> actual_errors;
+        lexer_cursor cursor{"test", c.data(), c.data() + c.size()};
+        lexer::result out;
+        while (cursor.next_line(out.lexemes, out.errors)) {
+            copy_result(out, actual, actual_errors);
+            out.lexemes.clear();
+            out.errors.clear();
+        }
+
+        INFO(s);
+        REQUIRE(actual == expected);
+        REQUIRE(actual_errors == expected_errors);
+    }
+}
+
+// what lexing r with folded trivia gives: the lexemes of r without whitespace and comments, with the run of them
+// right in front of every lexeme as its trivia
+static std::vector<lexeme_copy> folded(const lexer::result& r) {
+    std::vector<lexeme_copy> out;
+    std::optional<lexeme_copy> trivia;
+    const char* trivia_end = nullptr;
+    for (auto&& l : r.lexemes) {
+        if (trivia && trivia_end != l.text.data()) {
+            out.push_back(*trivia);
+            trivia.reset();
+        }
+        if (l.type == lexeme_type::WHITESPACE || l.type == lexeme_type::COMMENT) {
+            if (!trivia)
+                trivia = lexeme_copy{l.type, "", line_column(l.location), ""};
+            if (l.type == lexeme_type::COMMENT)
+                trivia->type = l.type;
+            trivia->text += l.text;
+            trivia_end = l.text.data() + l.text.size();
+            continue;
+        }
+        out.push_back(lexeme_copy{l.type, std::string{l.text}, line_column(l.location), trivia ? trivia->text : ""});
+        trivia.reset();
+    }
+    if (trivia)
+        out.push_back(*trivia);
+    return out;
+}
+
+TEST_CASE("folded trivia is in front of the lexeme behind it") {
+    for (auto engine : {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA}) {
+        for (auto&& s : lexer_corpus()) {
+            std::vector<char> c(s.begin(), s.end());
+            std::vector<lexeme_copy> expected;
+            std::vector<lex_err_copy> expected_errors;
+            auto unfolded = lexer{"test", {engine}}.run(c);
+            copy_result(unfolded, expected, expected_errors);
+            expected = folded(unfolded);
+
+            lexer_options options{engine};
+            options.fold_trivia = true;
+            auto result = lexer{"test", options}.run(c);
+            std::vector<lexeme_copy> actual;
+            std::vector<lex_err_copy> actual_errors;
+            copy_result(result, actual, actual_errors);
+
+            INFO(s);
+            REQUIRE(actual == expected);
+            REQUIRE(actual_errors == expected_errors);
+            for (auto&& l : result.lexemes) {
+                auto trivia = l.leading_trivia();
+                bool comment = trivia.find('/') != trivia.npos;
+                REQUIRE(bool(l.flags & COMMENT_BEFORE) == comment);
+                if (!comment)
+                    REQUIRE(bool(l.flags & SPACE_BEFORE) == !trivia.empty());
+            }
+        }
+    }
+}
+
+TEST_CASE("folded trivia is the same for every way of lexing") {
+    lexer_options options;
+    options.fold_trivia = true;
+    u32 seed = 11;
+    auto random = [&seed](std::size_t n) {
+        seed = seed * 1103515245 + 12345;
+        return n ? (seed >> 8) % n : 0;
+    };
+
+    for (auto&& s : lexer_corpus()) {
+        std::vector<char> c(s.begin(), s.end());
+        std::vector<lexeme_copy> expected;
+        std::vector<lex_err_copy> expected_errors;
+        copy_result(lexer{"test", options}.run(c), expected, expected_errors);
+        INFO(s);
+
+        std::vector<lexeme_copy> lines;
+        std::vector<lex_err_copy> line_errors;
+        lexer_cursor cursor{"test", c.data(), c.data() + c.size(), options};
+        lexer::result out;
+        while (cursor.next_line(out.lexemes, out.errors)) {
+            copy_result(out, lines, line_errors);
+            out.lexemes.clear();
+            out.errors.clear();
+        }
+        REQUIRE(lines == expected);
+        REQUIRE(line_errors == expected_errors);
+
+        for (std::size_t block_size : {1, 3, 64}) {
+            std::vector<lexeme_copy> streamed;
+            std::vector<lex_err_copy> streamed_errors;
+            stream_lexer stream{"test", options};
+            for (std::size_t i = 0; i < s.size(); i += block_size) {
+                lexer::result block;
+                stream.feed(s.data() + i, std::min(block_size, s.size() - i), block);
+                copy_result(block, streamed, streamed_errors);
+            }
+            lexer::result rest;
+            stream.finish(rest);
+            copy_result(rest, streamed, streamed_errors);
+            INFO(block_size);
+            REQUIRE(streamed == expected);
+            REQUIRE(streamed_errors == expected_errors);
+        }
+
+        std::string inserts[] = {"", " ", "/*", "*/", "//", "\n", "x"};
+        for (int i = 0; i < 5; ++i) {
+            auto previous = lexer{"test", options}.run(c);
+            text_edit edit{random(s.size() + 1), 0, 0};
+            edit.old_length = random(std::min<std::size_t>(4, s.size() - edit.offset) + 1);
+            auto&& inserted = inserts[random(std::size(inserts))];
+            edit.new_length = inserted.size();
+            std::string edited = s;
+            edited.replace(edit.offset, edit.old_length, inserted);
+            std::vector<char> new_buffer(edited.begin(), edited.end());
+            lexer{"test", options}.relex(previous, c.data(), edit, new_buffer.data(), new_buffer.data() + new_buffer.size());
+            INFO(edited);
+            REQUIRE(same_lexemes(lexer{"test", options}.run(new_buffer), previous));
+        }
+    }
+}
+
+TEST_CASE("cursor lexes one line at a time") {
+    std::string s = "a b /* x\n y */ c\r\n  # if 1\nd 'e\nf\n";
+    lexer_cursor cursor{"test", s.data(), s.data() + s.size()};
+    lexer::result out;
+
+    auto line = [&]() {
+        out.lexemes.clear();
+        out.errors.clear();
+        if (!cursor.next_line(out.lexemes, out.errors))
+            return std::string{"<end>"};
+        std::string text;
+        for (auto&& l : out.lexemes)
+            text += std::string{l.text} + "|";
+        return text;
+    };
+
+    REQUIRE(line() == "a| |b| |/* x\n y */| |c|\r\n|");
+    REQUIRE(line() == "  |#| |if| |1|\n|");
+    REQUIRE(line() == "d| |\n|");
+    REQUIRE(out.errors.size() == 1); // the character literal left open
+    REQUIRE(line() == "f|\n|");
+    REQUIRE(line() == "<end>");
+
+    cursor.rewind(*std::next(lexer{"test"}.run(s.data(), s.data() + s.size()).lexemes.begin(), 2));
+    REQUIRE(line() == "b| |/* x\n y */| |c|\r\n|");
+}
+
+TEST_CASE("directive index links the branches of every conditional") {
+    directive_index index;
+    index.add(0, directive_kind::IF);
+    index.add(10, directive_kind::DEFINE);
+    index.add(20, directive_kind::IFDEF);
+    index.add(30, directive_kind::ELSE);
+    index.add(40, directive_kind::ENDIF);
+    index.add(50, directive_kind::ELIF);
+    index.add(60, directive_kind::ENDIF);
+    index.add(70, directive_kind::ELSE); // of a conditional in front of the file
+    index.add(80, directive_kind::ENDIF);
+
+    REQUIRE(index.size() == 9);
+    REQUIRE(index[0].next == 5);
+    REQUIRE(index[5].next == 6);
+    REQUIRE(index[2].next == 3);
+    REQUIRE(index[3].next == 4);
+    REQUIRE(index[7].next == 8);
+    REQUIRE(index[1].next == directive_index::NONE);
+    REQUIRE(index[6].next == directive_index::NONE);
+    REQUIRE(index.find(50) == 5);
+    REQUIRE(index.find(55) == directive_index::NONE);
+    REQUIRE(directive_kind_of("ifndef") == directive_kind::IFNDEF);
+    REQUIRE(directive_kind_of("undef") == directive_kind::OTHER);
+}
+
+TEST_CASE("cursor skips to the next branch of a conditional") {
+    std::string s = "a\n #if 0\nb /* \n#endif */\n#if 1\n#else\n#endif\n'c\n  # elif x\nd\n#endif\ne\n#else\n";
+    lexer_cursor cursor{"test", s.data(), s.data() + s.size()};
+    lexer::result out;
+
+    auto line = [&]() {
+        out.lexemes.clear();
+        if (!cursor.next_line(out.lexemes, out.errors))
+            return std::string{"<end>"};
+        std::string text;
+        for (auto&& l : out.lexemes)
+            text += l.text;
+        return text;
+    };
+
+    REQUIRE(line() == "a\n");
+    REQUIRE(cursor.skip_branch(out.errors).empty()); // not a conditional
+    REQUIRE(line() == " #if 0\n");
+    REQUIRE(cursor.directives().size() == 1);
+
+    // nested conditionals and directives in comments are skipped, skipped lines are not lexed
+    REQUIRE(cursor.skip_branch(out.errors) == "b /* \n#endif */\n#if 1\n#else\n#endif\n'c\n");
+    REQUIRE(out.errors.empty());
+    REQUIRE(line() == "  # elif x\n");
+    REQUIRE(cursor.directives().size() == 5);
+    REQUIRE(cursor.skip_branch(out.errors) == "d\n");
+    REQUIRE(line() == "#endif\n");
+    REQUIRE(line() == "e\n");
+
+    // lines are only indexed once
+    REQUIRE(line() == "#else\n");
+    REQUIRE(cursor.directives().size() == 7);
+    REQUIRE(cursor.skip_branch(out.errors).empty());
+    REQUIRE(line() == "<end>");
+    REQUIRE(out.errors.empty());
+}
+
+TEST_CASE("scanning ahead finds the directives lexing finds") {
+    std::string pieces[] = {
+        "#", "##", "if", "endif", "else", "x", " ", "\t", "/*", "*/", "//", "\"", "'", "\\", "\n", "\r\n", "\r"
+    };
+    u32 seed = 5;
+    for (int i = 0; i < 2000; ++i) {
+        std::string s = "#if 0\n";
+        for (int j = 0; j < 40; ++j) {
+            seed = seed * 1103515245 + 12345;
+            s += pieces[(seed >> 8) % std::size(pieces)];
+        }
+
+        lexer::result out;
+        lexer_cursor lexing{"test", s.data(), s.data() + s.size()};
+        while (lexing.next_line(out.lexemes, out.errors));
+
+        lexer_cursor scanning{"test", s.data(), s.data() + s.size()};
+        scanning.next_line(out.lexemes, out.errors);
+        auto skipped = scanning.skip_branch(out.errors);
+
+        INFO(s);
+        auto&& lexed = lexing.directives();
+        auto&& scanned = scanning.directives();
+        REQUIRE(scanned.size() <= lexed.size());
+        for (std::size_t d = 0; d < scanned.size(); ++d) {
+            REQUIRE(scanned[u32(d)].line == lexed[u32(d)].line);
+            REQUIRE(scanned[u32(d)].kind == lexed[u32(d)].kind);
+        }
+        auto next = lexed[0].next;
+        REQUIRE(skipped.size() == (next == directive_index::NONE ? s.size() : lexed[next].line) - 6);
+    }
+}
+
+TEST_CASE("a lexed file hands out the lines lexing hands out") {
+    std::string pieces[] = {"#", "if", "endif", "else", "x", "1", " ", "/*", "*/", "//", "\"", "\\", "\n", "\r\n"};
+    lexer_engine engines[] = {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA};
+    lexer_options options;
+    options.fold_trivia = true;
+    u32 seed = 7;
+    int lexed_count = 0;
+    for (int i = 0; i < 2000; ++i) {
+        std::string s;
+        for (int j = 0; j < 40; ++j) {
+            seed = seed * 1103515245 + 12345;
+            s += pieces[(seed >> 8) % std::size(pieces)];
+        }
+
+        // whichever engine lexes the file whole
+        options.engine = engines[i % std::size(engines)];
+        auto lexed = lexed_file::lex("test", s.data(), s.data() + s.size(), options);
+        lexer_cursor lexing{"test", s.data(), s.data() + s.size(), options};
+        if (lexed == nullptr) {
+            // a file with errors is left to lexing, so is one with line continuations, they leave gaps in the text
+            lexer::result out;
+            while (lexing.next_line(out.lexemes, out.errors));
+            bool continued = s.find("\\\n") != s.npos || s.find("\\\r") != s.npos;
+            REQUIRE((!out.errors.empty() || continued));
+            continue;
+        }
+        ++lexed_count;
+
+        // branches are skipped and lines are rewound to their second lexeme in turn
+        lexer_cursor copying{*lexed, options};
+        lexer::result a, b;
+        INFO(s);
+        for (int step = 0;; ++step) {
+            a.lexemes.clear();
+            b.lexemes.clear();
+            bool more = lexing.next_line(a.lexemes, a.errors);
+            REQUIRE(copying.next_line(b.lexemes, b.errors) == more);
+            if (!more)
+                break;
+            REQUIRE(same_lexemes(a, b));
+            REQUIRE(lexing.skip_branch(a.errors) == copying.skip_branch(b.errors));
+            if (step % 3 == 1 && a.lexemes.size() > 1) {
+                lexing.rewind(*std::next(a.lexemes.begin()));
+                copying.rewind(*std::next(b.lexemes.begin()));
+            }
+        }
+        REQUIRE(a.errors.empty());
+        REQUIRE(b.errors.empty());
+    }
+    REQUIRE(lexed_count > 100);
+}
+
+TEST_CASE("a lexed file comes back from its image") {
+    std::string s = "\xEF\xBB\xBF#if A /* x\n */\nfoo(bar, foo)\n#else\n  'c' // d\n#endif\n";
+    lexer_options options;
+    options.fold_trivia = true;
+    symbol_table symbols;
+    options.symbols = &symbols;
+    auto lexed = lexed_file::lex("test", s.data(), s.data() + s.size(), options);
+    REQUIRE(lexed != nullptr);
+
+    std::ostringstream out;
+    auto hash = u64(0x1234);
+    lexed->write_image(out, hash);
+    auto image = out.str();
+    auto load = [&](std::string_view image, u64 hash) {
+        return lexed_file::from_image(image, nullptr, "test", s.data(), s.data() + s.size(), hash, options);
+    };
+    auto loaded = load(image, hash);
+    REQUIRE(loaded != nullptr);
+
+    lexer_cursor lexing{"test", s.data(), s.data() + s.size(), options};
+    lexer_cursor copying{*loaded, options};
+    lexer::result a, b;
+    for (;;) {
+        a.lexemes.clear();
+        b.lexemes.clear();
+        bool more = lexing.next_line(a.lexemes, a.errors);
+        REQUIRE(copying.next_line(b.lexemes, b.errors) == more);
+        if (!more)
+            break;
+        REQUIRE(same_lexemes(a, b));
+        auto bl = b.lexemes.begin();
+        for (auto&& l : a.lexemes)
+            REQUIRE((bl++)->symbol == l.symbol);
+        REQUIRE(lexing.skip_branch(a.errors) == copying.skip_branch(b.errors));
+    }
+
+    // images of other text, of other options or damaged ones are not used
+    REQUIRE(load(image, hash + 1) == nullptr);
+    options.fold_trivia = false;
+    REQUIRE(load(image, hash) == nullptr);
+    options.fold_trivia = true;
+    REQUIRE(load(image.substr(0, image.size() - 1), hash) == nullptr);
+    auto damaged = image;
+    damaged.back() = '\x7F'; // the size of the line end at the end
+    REQUIRE(load(damaged, hash) == nullptr);
+    damaged = image;
+    damaged[image.size() / 2] ^= 1; // anywhere else
+    REQUIRE(load(damaged, hash) == nullptr);
+    auto swapped = image;
+    std::reverse(swapped.begin() + 8, swapped.begin() + 12); // the byte order
+    REQUIRE(load(swapped, hash) == nullptr);
+}
+
+TEST_CASE("source map resolves locations of every buffer") {
+    std::string a = "first\nsecond\r\nthird\rfourth";
+    std::string b = "x\ny";
+    source_map sources;
+    auto base_a = sources.add("a", a.data(), a.data() + a.size());
+    auto base_b = sources.add_fragment("b", b.data(), b.data() + b.size(), 7, 3);
+    b = "gone";
+
+    auto check = [&](source_location location, std::string_view file_path, i32 line, i32 column) {
+        auto resolved = sources.resolve(location);
+        REQUIRE(resolved.file_path == file_path);
+        REQUIRE(resolved.line == line);
+        REQUIRE(resolved.column == column);
+    };
+    check(base_a, "a", 1, 0);
+    check(base_a + 8, "a", 2, 2);
+    check(base_a + 14, "a", 3, 0);
+    check(base_a + 22, "a", 4, 2);
+    check(base_a + u32(a.size()), "a", 4, 6);
+    check(base_b + 0, "b", 7, 3);
+    check(base_b + 1, "b", 7, 4);
+    check(base_b + 2, "b", 8, 0);
+    REQUIRE(sources.file_path(base_b + 3) == "b");
+}
+
+TEST_CASE("source map gives the locations of released buffers to later ones") {
+    std::string a = "a\nb";
+    std::string b = "c\nd\ne";
+    source_map sources;
+    auto base_a = sources.add("a", a.data(), a.data() + a.size());
+    auto base_b = sources.add("b", b.data(), b.data() + b.size());
+
+    // the last range goes back to the space behind it, even a larger buffer gets it
+    sources.release(base_b);
+    REQUIRE(sources.add("b", b.data(), b.data() + b.size()) == base_b);
+    sources.release(base_b);
+    std::string c = b + b;
+    REQUIRE(sources.add("c", c.data(), c.data() + c.size()) == base_b);
+
+    // one in front of others is only given to buffers that fit
+    sources.release(base_a);
+    auto base_d = sources.add("d", c.data(), c.data() + c.size());
+    REQUIRE(base_d > base_b);
+    REQUIRE(sources.add("e", b.data(), b.data() + 1) == base_a);
+    REQUIRE(sources.resolve(base_a + 1).file_path == "e");
+    REQUIRE(sources.resolve(base_b + 9).line == 5);
+    REQUIRE(sources.resolve(base_d + 8).file_path == "d");
+}
+
+TEST_CASE("relexing and streaming don't use up source locations") {
+    source_map sources;
+    lexer_options options;
+    options.sources = &sources;
+
+    std::string s = "var int A;\nvar int B;\n";
+    std::vector<char> buffer(s.begin(), s.end());
+    auto previous = lexer{"test", options}.run(buffer);
+    for (int i = 0; i < 100; ++i) {
+        std::vector<char> edited = buffer;
+        edited.insert(edited.begin() + 4, 'x');
+        lexer{"test", options}.relex(previous, buffer.data(), text_edit{4, 0, 1}, edited.data(), edited.data() + edited.size());
+        buffer = std::move(edited);
+    }
+    REQUIRE(previous.lexemes.back().location <= buffer.size());
+    REQUIRE(sources.resolve(previous.lexemes.back().location).line == 2);
+
+    stream_lexer stream{"test", options};
+    for (int i = 0; i < 100; ++i) {
+        lexer::result out;
+        stream.feed(s.data(), s.size(), out);
+        REQUIRE(out.lexemes.back().location <= buffer.size() + 2 * s.size());
+        REQUIRE(sources.resolve(out.lexemes.back().location).line == 2 * i + 2);
+    }
+}
+
+TEST_CASE("lexing and loading a file again doesn't use up source locations") {
+    source_map sources;
+    lexer_options options;
+    options.sources = &sources;
+
+    // 256 MiB a time, 25 times are half again as many locations as there are
+    std::string s = "/*" + std::string(std::size_t(1) << 28, 'x') + "*/\n";
+    auto lexed = lexed_file::lex("test", s.data(), s.data() + s.size(), options);
+    REQUIRE(lexed != nullptr);
+    std::ostringstream out;
+    lexed->write_image(out, 0);
+    auto image = out.str();
+    lexed = nullptr;
+    for (int i = 0; i < 25; ++i) {
+        auto loaded = lexed_file::from_image(image, nullptr, "test", s.data(), s.data() + s.size(), 0, options);
+        REQUIRE(loaded != nullptr);
+    }
+
+    // files that can't be lexed whole give their range back too
+    s.resize(s.size() - 3);
+    for (int i = 0; i < 25; ++i)
+        REQUIRE(lexed_file::lex("test", s.data(), s.data() + s.size(), options) == nullptr);
+    REQUIRE(sources.add("test", s.data(), s.data() + s.size()) == 0);
+}
@@ -10,6 +10,7 @@ namespace opt = boost::program_options;
 
 #include "file_service.h"
 #include "preprocessor.h"
+#include "token_cache.h"
 
 constexpr const auto lf = "\n";
 
@@ -22,7 +23,12 @@ int main(int argc, char* argv[]) {
         ("output,o", opt::value<std::string>(), "file to write result to")
         ("input,i", opt::value<std::string>(), "file to preprocess")
         ("include-dir,I", opt::value<std::vector<std::string>>(), "include directories")
-        ("define,D", opt::value<std::vector<std::string>>(), "defined symbols");
+        ("define,D", opt::value<std::vector<std::string>>(), "defined symbols")
+        ("lexer", opt::value<std::string>(), "lexer engine for files included more than once, which are lexed whole: "
+            "state-machine (default), structural or dfa")
+        ("lexer-threads", opt::value<unsigned>(), "threads lexing a file included more than once, 0 for one per core")
+        ("huge-pages", "allocate lexemes from large pages if the system grants them")
+        ("cache-dir", opt::value<std::string>(), "directory to keep lexed included files in, shared between runs");
 
     opt::variables_map vm;
     opt::command_line_parser parser{ argc, argv };
@@ -55,6 +61,26 @@ int main(int argc, char* argv[]) {
         }
     }();
 
+    lexer_options lex_options;
+    auto engine = vm.find("lexer");
+    if (engine != vm.end()) {
+        auto&& name = engine->second.as<std::string>();
+        if (name == "structural") {
+            lex_options.engine = lexer_engine::STRUCTURAL;
+        } else if (name == "dfa") {
+            lex_options.engine = lexer_engine::DFA;
+        } else if (name != "state-machine") {
+            std::cerr << "Unknown lexer engine: " << name << lf;
+            return EXIT_FAILURE;
+        }
+    }
+    auto threads = vm.find("lexer-threads");
+    if (threads != vm.end())
+        lex_options.threads = threads->second.as<unsigned>();
+
+    arena_options arena_opts;
+    arena_opts.huge_pages = vm.find("huge-pages") != vm.end();
+
     std::vector<std::string> include_dirs;
     auto dirs = vm.find("include-dir");
     if (dirs != vm.end()) {
@@ -93,7 +119,12 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    preprocessor pp{ out, &fileser, defines };
+    std::unique_ptr<token_cache> tokens;
+    auto cache_dir = vm.find("cache-dir");
+    if (cache_dir != vm.end())
+        tokens = std::make_unique<token_cache>(cache_dir->second.as<std::string>());
+
+    preprocessor pp{ out, &fileser, defines, lex_options, arena_opts, tokens.get() };
     bool success = pp.preprocess_file(in_path, fs::current_path().string());
     for (auto&& s : pp.warnings()) {
         std::cout << s;
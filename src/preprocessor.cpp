@@ -1,27 +1,21 @@
 #include "preprocessor.h"
 #include "lexer.h"
+#include "lexer_cursor.h"
 #include "scope_guard.h"
+#include "simd_scan.h"
+#include "token_cache.h"
 
+#include <algorithm>
 #include <cctype>
+#include <sstream>
 #include <format>
 #include <charconv>
+#include <optional>
+#include <cstring>
+#include <utility>
 
 constexpr const auto lf = "\n";
 
-constexpr std::string_view dir_include{"include"};
-constexpr std::string_view dir_define{"define"};
-constexpr std::string_view dir_undef{"undef"};
-constexpr std::string_view dir_if{"if"};
-constexpr std::string_view dir_elif{"elif"};
-constexpr std::string_view dir_else{"else"};
-constexpr std::string_view dir_endif{"endif"};
-constexpr std::string_view dir_ifdef{"ifdef"};
-constexpr std::string_view dir_ifndef{"ifndef"};
-constexpr std::string_view sym_defined{"defined"};
-
-constexpr std::string_view sym_zero{"0"};
-constexpr std::string_view sym_one{"1"};
-
 // returns the next useful lexeme
 // skips over whitespace and comment lexemes
 // line endings are not counted as whitespace
@@ -30,11 +24,56 @@ lex_iter next_lexeme(lex_iter l, lex_iter end) {
     return l;
 }
 
+// whitespace, comments and line endings are nothing but separators inside of macro invocations
+bool is_space(lexeme_type type) {
+    return type == lexeme_type::WHITESPACE || type == lexeme_type::COMMENT || type == lexeme_type::LINE_END;
+}
+
+// whether whitespace or a comment went in front of l, also once its trivia is gone
+bool spaced(const lexeme& l) {
+    return l.trivia != 0 || l.flags & (SPACE_BEFORE | COMMENT_BEFORE);
+}
+
+// behind the operand of ## at i of the content of def, # and the parameter behind it are one
+std::size_t operand_end(const define& def, std::size_t i) {
+    bool stringified = def.has_parameters && def.content[i].type == lexeme_type::HASH && i + 1 < def.content.size() &&
+        def.references[i + 1] != define::NoParameter;
+    return i + (stringified ? 2 : 1);
+}
+
 lex_iter seek_line_end(lex_iter l, lex_iter end) {
     while (++l != end && l->type != lexeme_type::LINE_END);
     return l;
 }
 
+// writes only the line endings of skipped lines, so the lines behind them keep their line numbers
+void write_line_ends(std::ostream& out, std::string_view skipped) {
+    auto&& scan = scan_kernels_active();
+    auto c = skipped.data();
+    auto end = c + skipped.size();
+    while ((c = scan.line_comment(c, end)) != end) {
+        auto size = *c == '\r' && c + 1 != end && c[1] == '\n' ? 2 : 1;
+        out.write(c, size);
+        c += size;
+    }
+}
+
+// Follows whether all of a file is one #ifndef, only whitespace and comments around it. Lines of inactive branches are
+// skipped without looking at them, their content does not matter.
+struct include_guard {
+    enum state_t {
+        START,  // nothing but whitespace and comments yet
+        INSIDE, // in the #ifndef opened first
+        AFTER,  // behind its #endif
+        NONE,   // something else found outside of it, the file is not guarded
+    };
+
+    std::string file;
+    int depth; // of the conditionals the file is included in
+    state_t state = START;
+    symbol_id name = symbol_table::NONE;
+};
+
 /*
 Grammar
 
@@ -45,259 +84,60 @@ bit_or_expr  = bit_and_expr {("|"|"^") bit_and_expr}
 bit_and_expr = shift_expr {"&" shift_expr}
 shift_expr   = add_expr {("<<"|">>"|">>>") add_expr}
 add_expr     = mul_expr {("+"|"-") mul_expr}
-mul_expr     = pow_expr {("*"|"/"|"%") pow_expr}
-pow_expr     = unary_expr {"**" unary_expr}
-unary_expr   = [("+"|"-"|"~"|"!")] unary_expr
-             | "defined" paren_expr
-paren_expr   = Ident ["(" [or_expr {, or_expr}] ")"] -- not implemented currently
+mul_expr     = unary_expr {("*"|"/"|"%") unary_expr}
+unary_expr   = ("+"|"-"|"~"|"!") unary_expr
+             | "defined" Ident
+             | "defined" "(" Ident ")"
+             | paren_expr
+paren_expr   = Ident
              | Number
              | "(" or_expr ")"
  */
 
-struct value {
-    explicit value(u32 val) : _value(val) {}
-    u32 int_value() const {
-        return _value;
-    }
-private:
-    u32 _value;
-};
-
-enum class expression_type {
-    NONE,
-    OR,
-    AND,
-    EQ,
-    NEQ,
-    GT,
-    GEQ,
-    LT,
-    LEQ,
-    BIT_OR,
-    BIT_XOR,
-    BIT_AND,
-    SHL,
-    SHR,
-    SHRU,
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    MOD,
-    POW,
-    POS,
-    NEG,
-    NOT,
-    BIT_NOT,
-    DEF,
-    LITERAL,
-    NAME
-};
-
-struct expression {
-    expression(expression_parser* parser) : _parser(parser) {}
-    virtual ~expression() = default;
-    virtual value evaluate() const = 0;
-    virtual expression_type type() const = 0;
-
-protected:
-    expression_parser* _parser;
-};
-
-struct binary_expression : expression {
-    explicit binary_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept :
-        expression(parser), _lhs(lhs), _rhs(rhs) {}
-
-protected:
-    expression* _lhs;
-    expression* _rhs;
-};
-
-struct or_expression : binary_expression {
-    explicit or_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() || _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::OR; }
-};
-
-struct and_expression : binary_expression {
-    explicit and_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() && _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::AND; }
-};
-
-struct eq_expression : binary_expression {
-    explicit eq_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() == _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::EQ; }
-};
-
-struct neq_expression : binary_expression {
-    explicit neq_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() != _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::NEQ; }
-};
-
-struct gt_expression : binary_expression {
-    explicit gt_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() > _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::GT; }
-};
-
-struct geq_expression : binary_expression {
-    explicit geq_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() >= _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::GEQ; }
-};
-
-struct lt_expression : binary_expression {
-    explicit lt_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() < _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::LT; }
-};
-
-struct leq_expression : binary_expression {
-    explicit leq_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() <= _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::LEQ; }
-};
-
-struct bit_or_expression : binary_expression {
-    explicit bit_or_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() | _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::BIT_OR; }
-};
-
-struct bit_xor_expression : binary_expression {
-    explicit bit_xor_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() ^ _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::BIT_XOR; }
-};
-
-struct bit_and_expression : binary_expression {
-    explicit bit_and_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() & _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::BIT_AND; }
-};
-
-struct shl_expression : binary_expression {
-    explicit shl_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() << _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::SHL; }
-};
-
-struct shr_expression : binary_expression {
-    explicit shr_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{u32(i32(_lhs->evaluate().int_value()) >> _rhs->evaluate().int_value())}; }
-    expression_type type() const override { return expression_type::SHR; }
-};
-
-struct shru_expression : binary_expression {
-    explicit shru_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() >> _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::SHRU; }
-};
-
-struct add_expression : binary_expression {
-    explicit add_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() + _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::ADD; }
-};
-
-struct sub_expression : binary_expression {
-    explicit sub_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() - _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::SUB; }
-};
-
-struct mul_expression : binary_expression {
-    explicit mul_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() * _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::MUL; }
-};
-
-struct div_expression : binary_expression {
-    explicit div_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() / _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::DIV; }
-};
-
-struct mod_expression : binary_expression {
-    explicit mod_expression(expression_parser* parser, expression* lhs, expression* rhs) noexcept : binary_expression(parser, lhs, rhs) {}
-    value evaluate() const override { return value{_lhs->evaluate().int_value() % _rhs->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::MOD; }
-};
-
-struct unary_expression : expression {
-    explicit unary_expression(expression_parser* parser, expression* operand) noexcept : expression(parser), _operand(operand) {}
-
-protected:
-    expression* _operand;
-};
-
-struct pos_expression : unary_expression {
-    explicit pos_expression(expression_parser* parser, expression* operand) noexcept : unary_expression(parser, operand) {}
-    value evaluate() const override { return value{+_operand->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::POS; }
-};
-
-struct neg_expression : unary_expression {
-    explicit neg_expression(expression_parser* parser, expression* operand) noexcept : unary_expression(parser, operand) {}
-    value evaluate() const override { return value{u32(-i32(_operand->evaluate().int_value()))}; }
-    expression_type type() const override { return expression_type::NEG; }
-};
-
-struct not_expression : unary_expression {
-    explicit not_expression(expression_parser* parser, expression* operand) noexcept : unary_expression(parser, operand) {}
-    value evaluate() const override { return value{!_operand->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::NOT; }
-};
-
-struct bit_not_expression : unary_expression {
-    explicit bit_not_expression(expression_parser* parser, expression* operand) noexcept : unary_expression(parser, operand) {}
-    value evaluate() const override { return value{~_operand->evaluate().int_value()}; }
-    expression_type type() const override { return expression_type::BIT_NOT; }
-};
-
-//struct defined_expression : unary_expression {
-//    explicit defined_expression(expression_parser* parser, expression* operand) noexcept : unary_expression(parser, operand) {}
-//    value evaluate() const override {
-//
-//        // error 
-//        return value{0};
-//    }
-//    expression_type type() const override { return expression_type::DEF; }
-//};
-
-struct literal_expression : expression {
-    explicit literal_expression(expression_parser* parser, u32 value) noexcept : expression(parser), _value(value) {}
-    value evaluate() const override { return _value; }
-    expression_type type() const override { return expression_type::LITERAL; }
-
-protected:
-    value _value;
-};
-
-struct name_expression : expression {
-    explicit name_expression(expression_parser* parser, lexeme* name) : expression(parser), _name(name) {}
-    value evaluate() const override { return value{0}; }
-    expression_type type() const override { return expression_type::NAME; }
-    std::string_view name() const {
-        return _name->text;
+// of the binary operators, higher binds tighter, 0 if type is none
+int precedence(lexeme_type type) {
+    switch (type) {
+        case lexeme_type::OR:
+            return 1;
+        case lexeme_type::AND:
+            return 2;
+        case lexeme_type::EQ_EQ:
+        case lexeme_type::NEQ:
+        case lexeme_type::GT:
+        case lexeme_type::GT_EQ:
+        case lexeme_type::LT:
+        case lexeme_type::LT_EQ:
+            return 3;
+        case lexeme_type::BIT_OR:
+        case lexeme_type::BIT_XOR:
+            return 4;
+        case lexeme_type::BIT_AND:
+            return 5;
+        case lexeme_type::SHL:
+        case lexeme_type::SHR:
+        case lexeme_type::SHR_UNSIGNED:
+            return 6;
+        case lexeme_type::PLUS:
+        case lexeme_type::MINUS:
+            return 7;
+        case lexeme_type::MUL:
+        case lexeme_type::DIV:
+        case lexeme_type::MOD:
+            return 8;
+        default:
+            return 0;
     }
+}
 
-protected:
-    lexeme* _name;
-};
-
-struct expression_parser {
-    expression_parser(preprocessor* p) : _preprocessor(p) {}
-    ~expression_parser() {
-        while (_chunks) {
-            auto next = _chunks->next;
-            delete _chunks;
-            _chunks = next;
-        }
-    }
+// Evaluates the condition of an #if or #elif in one pass over its lexemes, by precedence climbing. Macros are
+// expanded in place once the lexemes they are named by are reached, the operands of defined are looked up as they
+// are. The operand of && or || that can't change the result is only checked for its syntax, nothing in it is expanded
+// or computed, a macro in it is taken for an operand along with the arguments of a function-like one. Values live on
+// the stack, nothing is allocated.
+struct condition_evaluator {
+    condition_evaluator(preprocessor* p, lex_iter beg, lex_iter end) :
+        _preprocessor(p), _at(beg), _unexpanded(beg), _end(end)
+    {}
 
     void error(lexeme* l, const char* msg) {
         _preprocessor->error(l, msg);
@@ -310,392 +150,319 @@ struct expression_parser {
 #define PARSE_ERR(LEX,MSG) error(LEX, MSG_DEBUG "error: "   MSG)
 #define PARSE_WARN(LEX,MSG) warn(LEX, MSG_DEBUG "warning: " MSG)
 
-    expression* parse(lex_iter beg, lex_iter end) {
-        if (beg == end)
-            return nullptr;
-        
-        for (auto l = beg; l != end;) {
-            if (l->type != lexeme_type::IDENTIFIER || l->text != sym_defined) {
-                l = _preprocessor->replace_identifier(l);
-                continue;
-            }
+    // the value of the condition, nothing if it could not be evaluated
+    std::optional<u32> evaluate() {
+        auto result = binary_expr(1);
+        if (result && peek() != _end) {
+            PARSE_ERR(&*_at, "unexpected token");
+            return std::nullopt;
+        }
+        return result;
+    }
 
-            auto it = next_lexeme(l, end);
-            if (it == end) {
-                PARSE_ERR(&*l, "missing operand for operator \"defined\"");
-                return nullptr;
-            }
-            bool paren_used = false;
-            if (it->type == lexeme_type::OPEN_PAREN) {
-                paren_used = true;
-                it = next_lexeme(it, end);
-                if (it == end) {
-                    PARSE_ERR(&*l, "missing operand for operator \"defined\"");
-                    return nullptr;
-                }
-            }
-            if (it->type == lexeme_type::IDENTIFIER) {
-                l = _preprocessor->insert(l, create_lexeme(
-                    l->file_path,
-                    lexeme_type::DECIMAL,
-                    l->line,
-                    l->line_offset,
-                    l->src_length,
-                    _preprocessor->is_defined(it->text) ? sym_one : sym_zero
-                ));
-            } else {
-                PARSE_ERR(&*it, "expected identifier");
-                return nullptr;
-            }
-            if (paren_used) {
-                it = next_lexeme(it, end);
-                if (it == end) {
-                    PARSE_ERR(&*it, "missing closing parenthesis");
-                    return nullptr;
-                }
-                if (it->type != lexeme_type::CLOSE_PAREN) {
-                    PARSE_ERR(&*it, "expected closing parenthesis");
-                    return nullptr;
-                }
+private:
+    // the lexeme read next with the macros there expanded, _end if there is none
+    lex_iter peek() {
+        if (_skipping)
+            return peek_unexpanded();
+        for (;;) {
+            skip_space();
+            if (_at == _end || _at != _unexpanded)
+                return _at;
+            if (_at->type != lexeme_type::IDENTIFIER || _preprocessor->symbol_of(*_at) == symbol_table::DEFINED) {
+                ++_unexpanded;
+                return _at;
             }
-            auto rem_it = l;
-            _preprocessor->remove(++rem_it, ++it);
-            l = it;
+            // the lexeme in front stays, what the macro expands to goes behind it and is not expanded again
+            auto before = std::prev(_at);
+            _unexpanded = _preprocessor->replace_identifier(_at, _end, nullptr, true);
+            _at = std::next(before);
         }
+    }
 
-        if (beg->type == lexeme_type::WHITESPACE || beg->type == lexeme_type::COMMENT)
-            beg = next_lexeme(beg, end);
-        return or_expr(beg, end);
+    // like peek, but macros are not expanded
+    lex_iter peek_unexpanded() {
+        skip_space();
+        if (_at != _end && _at == _unexpanded)
+            ++_unexpanded;
+        return _at;
     }
 
-    expression* or_expr(lex_iter& l, lex_iter end) {
-        auto result = and_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end && l->type == lexeme_type::OR) {
-            l = next_lexeme(l, end);
-            auto rhs = and_expr(l, end);
-            if (rhs == nullptr)
-                return nullptr;
-            result = create<or_expression>(result, rhs);
+    void skip_space() {
+        for (; _at != _end && is_space(_at->type); ++_at) {
+            if (_at == _unexpanded)
+                ++_unexpanded;
         }
-        return result;
     }
 
-    expression* and_expr(lex_iter& l, lex_iter end) {
-        auto result = cmp_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end && l->type == lexeme_type::AND) {
-            l = next_lexeme(l, end);
-            auto rhs = cmp_expr(l, end);
-            if (rhs == nullptr)
-                return nullptr;
-            result = create<and_expression>(result, rhs);
-        }
-        return result;
+    // the lexeme read last, for errors behind it
+    lexeme* last() {
+        return &*std::prev(_at);
     }
 
-    expression* cmp_expr(lex_iter& l, lex_iter end) {
-        auto result = bit_or_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end) {
-            if (l->type == lexeme_type::EQ_EQ) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<eq_expression>(result, rhs);
-            } else if (l->type == lexeme_type::NEQ) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<neq_expression>(result, rhs);
-            } else if (l->type == lexeme_type::GT) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<gt_expression>(result, rhs);
-            } else if (l->type == lexeme_type::GT_EQ) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<geq_expression>(result, rhs);
-            } else if (l->type == lexeme_type::LT) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<lt_expression>(result, rhs);
-            } else if (l->type == lexeme_type::LT_EQ) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_or_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<leq_expression>(result, rhs);
-            } else {
-                break;
+    // skips the arguments of a function-like macro that is not expanded, up to its closing parenthesis
+    std::optional<u32> skip_arguments() {
+        for (int depth = 0;;) {
+            auto l = peek_unexpanded();
+            if (l == _end) {
+                PARSE_ERR(last(), "missing )");
+                return std::nullopt;
             }
+            ++_at;
+            if (l->type == lexeme_type::OPEN_PAREN)
+                ++depth;
+            else if (l->type == lexeme_type::CLOSE_PAREN && --depth == 0)
+                return 0;
         }
-        return result;
     }
 
-    expression* bit_or_expr(lex_iter& l, lex_iter end) {
-        auto result = bit_and_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end) {
-            if (l->type == lexeme_type::BIT_OR) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_and_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<bit_or_expression>(result, rhs);
-            } else if (l->type == lexeme_type::BIT_XOR) {
-                l = next_lexeme(l, end);
-                auto rhs = bit_and_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<bit_xor_expression>(result, rhs);
-            } else {
+    std::optional<u32> binary_expr(int min_precedence) {
+        auto lhs = unary_expr();
+        while (lhs) {
+            auto op = peek();
+            if (op == _end)
                 break;
+            auto p = precedence(op->type);
+            if (p < min_precedence || p == 0)
+                break;
+            ++_at;
+            if ((op->type == lexeme_type::OR && *lhs) || (op->type == lexeme_type::AND && !*lhs)) {
+                auto skipping = std::exchange(_skipping, true);
+                auto rhs = binary_expr(p + 1);
+                _skipping = skipping;
+                if (!rhs)
+                    return std::nullopt;
+                lhs = u32(op->type == lexeme_type::OR);
+                continue;
             }
+            auto rhs = binary_expr(p + 1);
+            if (!rhs)
+                return std::nullopt;
+            lhs = _skipping ? 0 : apply(op, *lhs, *rhs);
         }
-        return result;
+        return lhs;
     }
 
-    expression* bit_and_expr(lex_iter& l, lex_iter end) {
-        auto result = shift_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end && l->type == lexeme_type::BIT_AND) {
-            l = next_lexeme(l, end);
-            auto rhs = shift_expr(l, end);
-            if (rhs == nullptr)
-                return nullptr;
-            result = create<bit_and_expression>(result, rhs);
+    std::optional<u32> apply(lex_iter op, u32 lhs, u32 rhs) {
+        switch (op->type) {
+            case lexeme_type::OR:           return u32(lhs || rhs);
+            case lexeme_type::AND:          return u32(lhs && rhs);
+            case lexeme_type::EQ_EQ:        return u32(lhs == rhs);
+            case lexeme_type::NEQ:          return u32(lhs != rhs);
+            case lexeme_type::GT:           return u32(lhs > rhs);
+            case lexeme_type::GT_EQ:        return u32(lhs >= rhs);
+            case lexeme_type::LT:           return u32(lhs < rhs);
+            case lexeme_type::LT_EQ:        return u32(lhs <= rhs);
+            case lexeme_type::BIT_OR:       return lhs | rhs;
+            case lexeme_type::BIT_XOR:      return lhs ^ rhs;
+            case lexeme_type::BIT_AND:      return lhs & rhs;
+            case lexeme_type::SHL:          return lhs << rhs;
+            case lexeme_type::SHR:          return u32(i32(lhs) >> rhs);
+            case lexeme_type::SHR_UNSIGNED: return lhs >> rhs;
+            case lexeme_type::PLUS:         return lhs + rhs;
+            case lexeme_type::MINUS:        return lhs - rhs;
+            case lexeme_type::MUL:          return lhs * rhs;
+            default:
+                if (rhs == 0) {
+                    PARSE_ERR(&*op, "division by zero");
+                    return std::nullopt;
+                }
+                return op->type == lexeme_type::DIV ? lhs / rhs : lhs % rhs;
         }
-        return result;
     }
 
-    expression* shift_expr(lex_iter& l, lex_iter end) {
-        auto result = add_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end) {
-            if (l->type == lexeme_type::SHL) {
-                l = next_lexeme(l, end);
-                auto rhs = add_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<shl_expression>(result, rhs);
-            } else if (l->type == lexeme_type::SHR) {
-                l = next_lexeme(l, end);
-                auto rhs = add_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<shr_expression>(result, rhs);
-            } else if (l->type == lexeme_type::SHR_UNSIGNED) {
-                l = next_lexeme(l, end);
-                auto rhs = add_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<shru_expression>(result, rhs);
-            } else {
-                break;
-            }
+    std::optional<u32> unary_expr() {
+        auto l = peek();
+        if (l == _end) {
+            PARSE_ERR(last(), "expected token, but found none");
+            return std::nullopt;
         }
-        return result;
-    }
-
-    expression* add_expr(lex_iter& l, lex_iter end) {
-        auto result = mul_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end) {
-            if (l->type == lexeme_type::PLUS) {
-                l = next_lexeme(l, end);
-                auto rhs = mul_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<add_expression>(result, rhs);
-            } else if (l->type == lexeme_type::MINUS) {
-                l = next_lexeme(l, end);
-                auto rhs = mul_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<sub_expression>(result, rhs);
-            } else {
-                break;
-            }
+        std::optional<u32> operand;
+        switch (l->type) {
+            case lexeme_type::PLUS:
+                ++_at;
+                return unary_expr();
+            case lexeme_type::MINUS:
+                ++_at;
+                operand = unary_expr();
+                return operand ? std::optional{u32(-i32(*operand))} : std::nullopt;
+            case lexeme_type::NOT:
+                ++_at;
+                operand = unary_expr();
+                return operand ? std::optional{u32(!*operand)} : std::nullopt;
+            case lexeme_type::BIT_NOT:
+                ++_at;
+                operand = unary_expr();
+                return operand ? std::optional{~*operand} : std::nullopt;
+            default:
+                return paren_expr();
         }
-        return result;
     }
 
-    expression* mul_expr(lex_iter& l, lex_iter end) {
-        auto result = pow_expr(l, end);
-        if (result == nullptr)
-            return nullptr;
-        while (l != end) {
-            if (l->type == lexeme_type::MUL) {
-                l = next_lexeme(l, end);
-                auto rhs = pow_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<mul_expression>(result, rhs);
-            } else if (l->type == lexeme_type::DIV) {
-                l = next_lexeme(l, end);
-                auto rhs = pow_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<div_expression>(result, rhs);
-            } else if (l->type == lexeme_type::MOD) {
-                l = next_lexeme(l, end);
-                auto rhs = pow_expr(l, end);
-                if (rhs == nullptr)
-                    return nullptr;
-                result = create<mod_expression>(result, rhs);
-            } else {
-                break;
+    std::optional<u32> defined_expr() {
+        auto op = _at++;
+        auto name = peek_unexpanded();
+        bool paren_used = name != _end && name->type == lexeme_type::OPEN_PAREN;
+        if (paren_used) {
+            ++_at;
+            name = peek_unexpanded();
+        }
+        if (name == _end) {
+            PARSE_ERR(&*op, "missing operand for operator \"defined\"");
+            return std::nullopt;
+        }
+        if (name->type != lexeme_type::IDENTIFIER) {
+            PARSE_ERR(&*name, "expected identifier");
+            return std::nullopt;
+        }
+        ++_at;
+        if (paren_used) {
+            auto close = peek_unexpanded();
+            if (close == _end) {
+                PARSE_ERR(last(), "missing closing parenthesis");
+                return std::nullopt;
+            }
+            if (close->type != lexeme_type::CLOSE_PAREN) {
+                PARSE_ERR(&*close, "expected closing parenthesis");
+                return std::nullopt;
             }
+            ++_at;
         }
-        return result;
-    }
-
-    expression* pow_expr(lex_iter& l, lex_iter end) {
-        auto result = unary_expr(l, end);
-        // maybe in the future if we support floats
-        return result;
+        return u32(_preprocessor->is_defined(_preprocessor->symbol_of(*name)));
     }
 
-    expression* unary_expr(lex_iter& l, lex_iter end) {
-        if (l->type == lexeme_type::PLUS) {
-            l = next_lexeme(l, end);
-            return create<pos_expression>(unary_expr(l, end));
-        } else if (l->type == lexeme_type::MINUS) {
-            l = next_lexeme(l, end);
-            return create<neg_expression>(unary_expr(l, end));
-        } else if (l->type == lexeme_type::NOT) {
-            l = next_lexeme(l, end);
-            return create<not_expression>(unary_expr(l, end));
-        } else if (l->type == lexeme_type::BIT_NOT) {
-            l = next_lexeme(l, end);
-            return create<bit_not_expression>(unary_expr(l, end));
-        //} else if (l->type == lexeme_type::IDENTIFIER && l->text == sym_defined) {
-        //    l = next_lexeme(l, end);
-        //    auto name = paren_expr(l, end);
-        //    if (name->type() == expression_type::NAME) {
-        //        bool defined = _preprocessor->is_defined(reinterpret_cast<name_expression*>(name)->name());
-        //        return create<literal_expression>(i32(defined));
-        //    }
-        //    return create<bit_not_expression>(name);
+    std::optional<u32> literal(int base, std::size_t prefix) {
+        auto l = _at++;
+        u32 val = 0;
+        auto text = l->text.substr(prefix);
+        auto err = std::from_chars(text.data(), text.data() + text.size(), val, base);
+        if (err.ec != std::errc{} || err.ptr != text.data() + text.size()) {
+            PARSE_ERR(&*l, "value too large");
+            val = INT_MAX;
         }
-        return paren_expr(l, end);
+        return val;
     }
 
-    expression* paren_expr(lex_iter& l, lex_iter end) {
-        if (l == end) {
-            PARSE_ERR(&*l, "expected token, but found none");
-            return nullptr;
-        } else if (l->type == lexeme_type::IDENTIFIER) {
-            auto result = create<name_expression>(&*l);
-            PARSE_WARN(&*l, "undefined macro, substituting 0");
-            l = next_lexeme(l, end);
-            return result;
-        } else if (l->type == lexeme_type::DECIMAL) {
-            u32 val = 0;
-            auto err = std::from_chars(l->text.data(), l->text.data() + l->text.size(), val, 10);
-            if (err.ec != std::errc{} || err.ptr != l->text.data() + l->text.size()) {
-                PARSE_ERR(&*l, "value too large");
-                val = INT_MAX;
-            }
-            l = next_lexeme(l, end);
-            return create<literal_expression>(val);
-        } else if (l->type == lexeme_type::OCTAL) {
-            u32 val = 0;
-            auto err = std::from_chars(l->text.data(), l->text.data() + l->text.size(), val, 8);
-            if (err.ec != std::errc{} || err.ptr != l->text.data() + l->text.size()) {
-                PARSE_ERR(&*l, "value too large");
-                val = INT_MAX;
-            }
-            l = next_lexeme(l, end);
-            return create<literal_expression>(val);
-        } else if (l->type == lexeme_type::HEXADECIMAL) {
-            u32 val = 0;
-            auto err = std::from_chars(l->text.data() + 2, l->text.data() + l->text.size(), val, 16); // skip 0x/0X
-            if (err.ec != std::errc{} || err.ptr != l->text.data() + l->text.size()) {
-                PARSE_ERR(&*l, "value too large");
-                val = INT_MAX;
+    std::optional<u32> paren_expr() {
+        auto l = _at;
+        switch (l->type) {
+            case lexeme_type::IDENTIFIER:
+            {
+                auto symbol = _preprocessor->symbol_of(*l);
+                if (symbol == symbol_table::DEFINED)
+                    return defined_expr();
+                ++_at;
+                if (_skipping) {
+                    if (_preprocessor->is_function_like(symbol) && peek() != _end && _at->type == lexeme_type::OPEN_PAREN)
+                        return skip_arguments();
+                    return 0;
+                }
+                PARSE_WARN(&*l, "undefined macro, substituting 0");
+                return 0;
             }
-            l = next_lexeme(l, end);
-            return create<literal_expression>(val);
-        } else if (l->type == lexeme_type::OPEN_PAREN) {
-            l = next_lexeme(l, end);
-            auto result = or_expr(l, end);
-            if (l->type != lexeme_type::CLOSE_PAREN) {
-                PARSE_ERR(&*l, "missing )");
-                // probably fine to infer closing parentheses at the end
+            case lexeme_type::DECIMAL:
+                return literal(10, 0);
+            case lexeme_type::OCTAL:
+                return literal(8, 0);
+            case lexeme_type::HEXADECIMAL:
+                return literal(16, 2); // skip 0x/0X
+            case lexeme_type::OPEN_PAREN:
+            {
+                ++_at;
+                auto result = binary_expr(1);
+                if (!result)
+                    return std::nullopt;
+                auto close = peek();
+                if (close == _end || close->type != lexeme_type::CLOSE_PAREN) {
+                    PARSE_ERR(close == _end ? last() : &*close, "missing )");
+                    // probably fine to infer closing parentheses at the end
+                    return result;
+                }
+                ++_at;
                 return result;
             }
-            l = next_lexeme(l, end);
-            return result;
-        }
-        PARSE_ERR(&*l, "unexpected token");
-        return nullptr;
-    }
-
-private:
-    template<typename T, typename... Args>
-    T* create(Args&&... args) {
-        if (_chunks == nullptr || (_chunks->data.data() + _chunks->data.size() - sizeof(T) < _chunks->head)) {
-            auto c = new chunk{};
-            c->head = c->data.data();
-            c->next = _chunks;
-            _chunks = c;
+            default:
+                PARSE_ERR(&*l, "unexpected token");
+                return std::nullopt;
         }
-
-        T* result = new(_chunks->head) T(this, std::forward<Args>(args)...);
-        _chunks->head += sizeof(T);
-        return result;
     }
 
-    struct chunk {
-        std::array<std::byte, 65536> data{};
-        std::byte* head{};
-        chunk* next{};
-    };
-    chunk* _chunks{};
-    preprocessor* _preprocessor{};
+    preprocessor* _preprocessor;
+    lex_iter _at;         // the lexeme read next
+    lex_iter _unexpanded; // from here on macros are not expanded yet, it is never in front of _at
+    lex_iter _end;
+    bool _skipping = false; // in an operand that can't change the result
 
+#undef PARSE_WARN
 #undef PARSE_ERR
 };
 
 preprocessor::preprocessor(
     std::ostream& out,
     file_service* fserv,
-    std::vector<define> defines
+    std::vector<define> defines,
+    lexer_options lex_options,
+    arena_options arena_opts,
+    token_cache* tokens
 ) :
     _out(&out),
     _fserv(fserv),
-    _expr_parser(std::make_unique<expression_parser>(this)),
+    _tokens(tokens),
+    _lex_options(lex_options),
+    _arena(arena_opts),
+    _spellings(arena_options{64 * 1024}),
     _if_depth(0),
-    _erasing_depth(0),
-    _else_seen() {
+    _else_seen(),
+    _branch_taken() {
+    _lex_options.symbols = &_symbols;
+    _lex_options.lexemes = &_arena;
+    _lex_options.fold_trivia = true;
+    if (_lex_options.sources == nullptr)
+        _lex_options.sources = &default_source_map();
     for (auto&& def : defines) {
-        _defines.emplace(def.name.text, def);
+        def.name.symbol = _symbols.intern(def.name.text);
+        for (auto&& c : def.content) {
+            if (c.type == lexeme_type::IDENTIFIER)
+                c.symbol = _symbols.intern(c.text);
+        }
+        define_macro(def.name.symbol, std::move(def));
     }
     _else_seen.push_back(true);
+    _branch_taken.push_back(true);
 }
 
-// need this here to avoid having to define expression_parser in the header
+// need this here to avoid having to define lexed_file in the header
 preprocessor::~preprocessor() = default;
 
 bool preprocessor::preprocess_file(std::string_view in, std::string_view cwd) {
-    std::vector<std::string> files;
+    std::vector<lexer_cursor> open_files; // innermost include last
+    std::ostringstream output;
+    lexeme_type written = lexeme_type::LINE_END; // type of the last lexeme written to output
+    bool skip_branch = false; // the line is a conditional and the lines up to its next branch are inactive
+    bool skipped = false;     // the line is a conditional behind an inactive branch
+    std::vector<include_guard> guards; // of every open file
+    std::string include_key;
+
+    _lexemes.clear();
+    _scratch.clear();
+    _arena.reset();
+    _spellings.reset();
+    _lex_errors.clear();
+    _include_paths.clear();
+    _included_once.clear();
+
+    auto guarded = [&](std::string_view file) {
+        if (_included_once.contains(file))
+            return true;
+        auto guard = _include_guards.find(file);
+        return guard != _include_guards.end() && is_defined(guard->second);
+    };
+    // include_key is the key the file is going to be found under once it is resolved
+    auto include_skipped = [&](char kind, std::string_view path) {
+        include_key.assign(1, kind).append(path);
+        auto file = _include_paths.find(include_key);
+        return file != _include_paths.end() && guarded(file->second);
+    };
 
     auto fcont = _fserv->resolve_load(cwd, in);
     auto l = _lexemes.begin();
@@ -707,29 +474,63 @@ bool preprocessor::preprocess_file(std::string_view in, std::string_view cwd) {
 
     if (fcont.begin == nullptr)
         return false;
+    std::string root_file = fcont.file;
 
 #define PP_ERR(MSG) error(&*l, MSG_DEBUG "error: "   MSG)
 #define PP_WARN(MSG) warn(&*l, MSG_DEBUG "warning: " MSG)
 
     file:
-    {
-        files.push_back(fcont.file);
-        auto lex_result = lexer{*(files.rbegin())}.run(fcont.begin, fcont.end);
-        if (lex_result.errors.size() > 0) {
-            for (auto&& e : lex_result.errors) {
-                _errors.push_back(std::format("{}({},{}): {}\n", *(files.rbegin()), e.line, e.line_offset, e.explanation));
+    if (auto lexed = lexed_file_of(fcont, !open_files.empty())) {
+        open_files.emplace_back(*lexed, _lex_options);
+    } else {
+        auto base = _lexed_files.find(fcont.file)->second.base;
+        open_files.emplace_back(fcont.begin, fcont.end, base, _lex_options);
+    }
+    guards.push_back(include_guard{fcont.file, _if_depth});
+
+    // Only the current line is lexed. Once it is processed it is written out and its lexemes are discarded.
+    // Inactive branches of conditionals are skipped as a whole, only their line endings are written.
+next_line:
+    for (auto&& done : _lexemes) {
+        if (done.trivia == 0 && needs_separator(written, done.type))
+            output.put(' ');
+        done.write_to(output);
+        written = done.type;
+    }
+    _lexemes.clear();
+    _scratch.clear();
+    _arena.reset();
+    _spellings.reset();
+    skipped = skip_branch;
+    if (skip_branch) {
+        write_line_ends(output, open_files.back().skip_branch(_lex_errors));
+        skip_branch = false;
+    }
+
+    while (!open_files.empty()) {
+        auto&& cursor = open_files.back();
+        bool more = cursor.next_line(_lexemes, _lex_errors);
+        if (_lex_errors.size() > 0) {
+            for (auto&& e : _lex_errors) {
+                auto where = _lex_options.sources->resolve(e.location);
+                _errors.push_back(std::format("{}({},{}): {}\n", where.file_path, where.line, where.column, e.explanation));
             }
             return false;
         }
-
-        auto l2 = lex_result.lexemes.begin();
-        _lexemes.splice(l, lex_result.lexemes);
-        l = l2;
+        if (more)
+            break;
+        if (guards.back().state == include_guard::AFTER)
+            _include_guards[guards.back().file] = guards.back().name;
+        guards.pop_back();
+        open_files.pop_back();
     }
+    if (open_files.empty())
+        goto eof;
+    l = _lexemes.begin();
 
 dispatch:
     if (l == end) {
-        goto eof;
+        goto next_line;
     }
     switch (l->type) {
         case lexeme_type::HASH:
@@ -743,75 +544,77 @@ dispatch:
             goto dispatch;
 
         default:
-            while (l != end && l->type != lexeme_type::LINE_END) {
-                if (_erasing_depth > 0) {
-                    _lexemes.erase_and_dispose(l++, lexeme::disposer{});
-                } else {
-                    l = replace_identifier(l);
-                }
-            }
+            if (_if_depth == guards.back().depth)
+                guards.back().state = include_guard::NONE;
+            while (l != end && l->type != lexeme_type::LINE_END)
+                l = replace_identifier(l, end, &open_files.back());
             goto dispatch;
     }
 
 directive:
     l = next_lexeme(l, end);
+    if (_if_depth == guards.back().depth) {
+        // only the first directive may open the guard, any other outside of it means there is none
+        auto&& guard = guards.back();
+        bool opens = guard.state == include_guard::START && l != end && l->type == lexeme_type::IDENTIFIER &&
+            symbol_of(*l) == symbol_table::IFNDEF;
+        guard.state = opens ? include_guard::INSIDE : include_guard::NONE;
+    }
     if (l == end) {
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::IDENTIFIER) {
         dir_id = l;
-        if (l->text == dir_else) {
+        auto dir = symbol_of(*l);
+        if (dir == symbol_table::ELSE) {
             goto else_directive;
-        } else if (l->text == dir_elif) {
+        } else if (dir == symbol_table::ELIF) {
             goto elif_directive;
-        } else if (l->text == dir_endif) {
+        } else if (dir == symbol_table::ENDIF) {
             goto endif_directive;
-        } else if (_erasing_depth > 0) {
-            while (l != end && l->type != lexeme_type::LINE_END) {
-                ++l;
-            }
-            remove(dir_start, l);
-            goto dispatch;
-        } else if (l->text == dir_if) {
+        } else if (dir == symbol_table::IF) {
             goto if_directive;
-        } else if (l->text == dir_ifdef) {
+        } else if (dir == symbol_table::IFDEF) {
             goto ifdef_directive;
-        } else if (l->text == dir_undef) {
+        } else if (dir == symbol_table::UNDEF) {
             goto undef_directive;
-        } else if (l->text == dir_define) {
+        } else if (dir == symbol_table::DEFINE) {
             goto define_directive;
-        } else if (l->text == dir_ifndef) {
+        } else if (dir == symbol_table::IFNDEF) {
             goto ifndef_directive;
-        } else if (l->text == dir_include) {
+        } else if (dir == symbol_table::INCLUDE) {
             goto include_directive;
+        } else if (dir == symbol_table::PRAGMA) {
+            goto pragma_directive;
         }
         goto other;
     }
     goto dispatch;
 
 other:
-    if (l == end) {
-        goto eof;
-    } else if (l->type == lexeme_type::LINE_END) {
-        ++l;
-        goto dispatch;
-    } else {
-        auto it = l++;
-        replace_identifier(it);
-        goto other;
+    {
+        auto line_end = l;
+        while (line_end != end && line_end->type != lexeme_type::LINE_END)
+            ++line_end;
+        while (l != line_end)
+            l = replace_identifier(l, line_end);
     }
+    if (l == end)
+        goto next_line;
+    ++l;
+    goto dispatch;
 
 else_directive:
     if (_if_depth == 0) {
         PP_ERR("spurious else");
     } else if (_else_seen[_if_depth]) {
         PP_ERR("second else");
+        skip_branch = skipped;
     } else {
+        if (_if_depth == guards.back().depth + 1)
+            guards.back().state = include_guard::NONE;
         _else_seen[_if_depth] = true;
-        if (_erasing_depth > 0) {
-            _erasing_depth = 0;
-        } else {
-            _erasing_depth = _if_depth;
-        }
+        skip_branch = _branch_taken[_if_depth];
+        _branch_taken[_if_depth] = true;
         while (++l != end && l->type != lexeme_type::LINE_END) {
             if (l->type != lexeme_type::WHITESPACE && l->type != lexeme_type::COMMENT) {
                 PP_ERR("unexpected token");
@@ -822,22 +625,28 @@ else_directive:
     goto dispatch;
 
 elif_directive:
+    if (_if_depth == guards.back().depth + 1)
+        guards.back().state = include_guard::NONE;
     if (_if_depth == 0) {
         PP_ERR("spurious elif");
     } else if (_else_seen[_if_depth]) {
         PP_ERR("elif after else");
+        skip_branch = skipped;
+    } else if (_branch_taken[_if_depth]) {
+        // the condition of a branch behind the one taken is not looked at
+        l = seek_line_end(l, end);
+        remove(dir_start, l);
+        skip_branch = true;
     } else {
-        expression_parser parser{this};
         auto expr_begin = ++l;
         auto expr_end = seek_line_end(l, end);
-        expression* expr = parser.parse(expr_begin, expr_end);
-        if (expr) {
-            value v = expr->evaluate();
-            _erasing_depth = v.int_value() ? 0 : _if_depth;
+        auto value = evaluate_condition(expr_begin, expr_end);
+        if (value) {
+            _branch_taken[_if_depth] = *value != 0;
         } else {
             PP_ERR("error parsing expression");
-            _erasing_depth = _if_depth;
         }
+        skip_branch = !_branch_taken[_if_depth];
         remove(dir_start, expr_end);
         l = expr_end;
     }
@@ -846,10 +655,9 @@ elif_directive:
 endif_directive:
     if (_if_depth > 0) {
         _else_seen[_if_depth] = false;
-        if (_erasing_depth > 0) {
-            _erasing_depth = 0;
-        }
         _if_depth -= 1;
+        if (_if_depth == guards.back().depth && guards.back().state == include_guard::INSIDE)
+            guards.back().state = include_guard::AFTER;
         while (++l != end && l->type != lexeme_type::LINE_END) {
             if (l->type != lexeme_type::WHITESPACE && l->type != lexeme_type::COMMENT) {
                 PP_ERR("unexpected token");
@@ -863,20 +671,21 @@ endif_directive:
 
 if_directive:
     {
-        expression_parser parser{this};
         auto expr_begin = ++l;
         auto expr_end = seek_line_end(l, end);
-        expression* expr = parser.parse(expr_begin, expr_end);
+        auto value = evaluate_condition(expr_begin, expr_end);
         _if_depth += 1;
-        if (_if_depth >= _else_seen.size())
+        if (std::size_t(_if_depth) >= _else_seen.size()) {
             _else_seen.push_back(false);
-        if (expr) {
-            value v = expr->evaluate();
-            _erasing_depth = v.int_value() ? 0 : _if_depth;
+            _branch_taken.push_back(false);
+        }
+        _branch_taken[_if_depth] = false;
+        if (value) {
+            _branch_taken[_if_depth] = *value != 0;
         } else {
             PP_ERR("error parsing expression");
-            _erasing_depth = _if_depth;
         }
+        skip_branch = !_branch_taken[_if_depth];
         remove(dir_start, expr_end);
         l = expr_end;
     }
@@ -886,7 +695,7 @@ ifdef_directive:
     l = next_lexeme(l, end);
     if (l == end) {
         PP_ERR("missing define");
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::IDENTIFIER) {
         define_name = l;
         goto ifdef_define;
@@ -903,11 +712,12 @@ ifdef_define:
             }
         }
         _if_depth += 1;
-        if (_if_depth >= _else_seen.size())
+        if (std::size_t(_if_depth) >= _else_seen.size()) {
             _else_seen.push_back(false);
-        if (is_defined(define_name->text) && _erasing_depth <= 0) {
-            _erasing_depth = _if_depth;
+            _branch_taken.push_back(false);
         }
+        _branch_taken[_if_depth] = is_defined(symbol_of(*define_name));
+        skip_branch = !_branch_taken[_if_depth];
 
         remove(dir_start, l);
     }
@@ -917,7 +727,7 @@ undef_directive:
     l = next_lexeme(l, end);
     if (l == end) {
         PP_ERR("unexpected EOF");
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::IDENTIFIER) {
         define_name = l;
         goto undef_define;
@@ -928,11 +738,13 @@ undef_directive:
 
 undef_define:
     {
-        auto def = _defines.find(define_name->text);
-        if (def == _defines.end()) {
+        auto name = symbol_of(*define_name);
+        if (_symbols.macro(name) == nullptr) {
             PP_ERR("macro not defined");
+        } else {
+            _symbols.set_macro(name, nullptr);
+            _defines.erase(name);
         }
-        _defines.erase(def);
     }
     while (++l != end && l->type != lexeme_type::LINE_END) {
         if (l->type != lexeme_type::WHITESPACE && l->type != lexeme_type::COMMENT) {
@@ -947,7 +759,7 @@ define_directive:
     l = next_lexeme(l, end);
     if (l == end) {
         PP_ERR("unexpected EOF");
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::IDENTIFIER) {
         define_name = l;
         goto define_parameters;
@@ -957,14 +769,69 @@ define_directive:
     }
 
 define_parameters:
-    if (++l != end && l->type == lexeme_type::OPEN_PAREN) {
-        PP_ERR("parameterized not yet supported");
+    // only a parenthesis right behind the name starts parameters
+    if (++l != end && l->type == lexeme_type::OPEN_PAREN && l->trivia == 0) {
+        goto define_function;
     } else {
         std::vector<lexeme> c;
         for (l = next_lexeme(define_name, end); l != end && l->type != lexeme_type::LINE_END; l = next_lexeme(l, end)) {
             c.push_back(*l);
         }
-        _defines.emplace(define_name->text, define{*define_name, std::move(c)});
+        define def{*define_name, std::move(c)};
+        if (auto msg = misplaced_operator(def)) {
+            error(&*define_name, msg);
+            goto other;
+        }
+        define_macro(symbol_of(*define_name), std::move(def));
+        remove(dir_start, l);
+    }
+    goto dispatch;
+
+define_function:
+    {
+        // names separated by commas, an ellipsis can only be last
+        std::vector<lexeme> parameters;
+        bool variadic = false;
+        l = next_lexeme(l, end);
+        while (l != end && l->type != lexeme_type::CLOSE_PAREN) {
+            if (l->type != lexeme_type::IDENTIFIER && l->type != lexeme_type::ELLIPSIS) {
+                PP_ERR("expected parameter name");
+                goto other;
+            }
+            if (l->type == lexeme_type::IDENTIFIER && std::ranges::any_of(parameters, [&](const lexeme& p) {
+                return p.type == lexeme_type::IDENTIFIER && symbol_of(p) == symbol_of(*l);
+            })) {
+                PP_ERR("duplicate parameter name");
+                goto other;
+            }
+            variadic = l->type == lexeme_type::ELLIPSIS;
+            parameters.push_back(*l);
+            l = next_lexeme(l, end);
+            if (variadic || l == end || l->type != lexeme_type::COMMA)
+                break;
+            l = next_lexeme(l, end);
+            if (l != end && l->type == lexeme_type::CLOSE_PAREN) {
+                PP_ERR("expected parameter name");
+                goto other;
+            }
+        }
+        if (l == end || l->type != lexeme_type::CLOSE_PAREN) {
+            if (l == end)
+                l = define_name;
+            PP_ERR("expected ) behind the parameters");
+            goto other;
+        }
+
+        std::vector<lexeme> c;
+        for (l = next_lexeme(l, end); l != end && l->type != lexeme_type::LINE_END; l = next_lexeme(l, end)) {
+            c.push_back(*l);
+        }
+        define def{*define_name, std::move(c), std::move(parameters), variadic};
+        if (auto msg = misplaced_operator(def)) {
+            error(&*define_name, msg);
+            goto other;
+        }
+        define_macro(symbol_of(*define_name), std::move(def));
         remove(dir_start, l);
     }
     goto dispatch;
@@ -973,7 +840,7 @@ ifndef_directive:
     l = next_lexeme(l, end);
     if (l == end) {
         PP_ERR("expected define");
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::IDENTIFIER) {
         define_name = l;
         goto ifndef_define;
@@ -990,11 +857,14 @@ ifndef_define:
             }
         }
         _if_depth += 1;
-        if (_if_depth >= _else_seen.size())
+        if (std::size_t(_if_depth) >= _else_seen.size()) {
             _else_seen.push_back(false);
-        if (is_defined(define_name->text) && _erasing_depth <= 0) {
-            _erasing_depth = _if_depth;
+            _branch_taken.push_back(false);
         }
+        _branch_taken[_if_depth] = !is_defined(symbol_of(*define_name));
+        skip_branch = !_branch_taken[_if_depth];
+        if (_if_depth == guards.back().depth + 1 && guards.back().state == include_guard::INSIDE)
+            guards.back().name = symbol_of(*define_name);
 
         remove(dir_start, l);
     }
@@ -1004,7 +874,7 @@ include_directive:
     l = next_lexeme(l, end);
     if (l == end) {
         PP_ERR("unexpected EOF");
-        goto eof;
+        goto next_line;
     } else if (l->type == lexeme_type::STRING) {
         include_content = l;
         goto include_rel;
@@ -1023,18 +893,20 @@ include_rel:
             PP_ERR("unexpected token");
         }
     }
-    fcont = _fserv->resolve_load(files[0], include_content->text.substr(1, include_content->text.size() - 2));
-    if (fcont.begin) {
+    if (include_skipped('"', include_content->text.substr(1, include_content->text.size() - 2))) {
         remove(dir_start, l);
-        goto file;
+        goto dispatch;
     }
+    fcont = _fserv->resolve_load(root_file, include_content->text.substr(1, include_content->text.size() - 2));
+    if (fcont.begin)
+        goto include_found;
     PP_ERR("could not find included file");
     goto dispatch;
 
 include_dir:
     if (++l == end) {
         PP_ERR("unexpected EOF");
-        goto eof;
+        goto next_line;
     } else {
         switch (l->type) {
             case lexeme_type::LINE_END:
@@ -1044,11 +916,9 @@ include_dir:
             case lexeme_type::GT:
             {
                 auto l2 = _lexemes.insert(include_content, *create_lexeme(
-                    include_content->file_path,
+                    _arena,
                     lexeme_type::INCLUDE_STRING,
-                    include_content->line,
-                    include_content->line_offset,
-                    i32(l->text.end() - include_content->text.begin()),
+                    include_content->location,
                     std::string_view{include_content->text.begin(), l->text.end()}
                 ));
                 remove(include_content, ++l);
@@ -1069,28 +939,52 @@ include_dir:
     }
 
 include_file:
-    fcont = _fserv->resolve_load("", include_content->text.substr(1, include_content->text.size() - 2));
-    if (fcont.begin) {
+    if (include_skipped('<', include_content->text.substr(1, include_content->text.size() - 2))) {
         remove(dir_start, l);
-        goto file;
+        goto dispatch;
     }
+    fcont = _fserv->resolve_load("", include_content->text.substr(1, include_content->text.size() - 2));
+    if (fcont.begin)
+        goto include_found;
     PP_ERR("could not find included file");
     goto dispatch;
 
+include_found:
+    _include_paths.emplace(include_key, fcont.file);
+    if (guarded(fcont.file)) {
+        remove(dir_start, l);
+        goto dispatch;
+    }
+    // the rest of the line is lexed again once the included file is done
+    if (l != end)
+        open_files.back().rewind(*l);
+    remove(dir_start, end);
+    goto file;
+
+pragma_directive:
+    {
+        // other pragmas are left to whatever reads the output
+        auto arg = next_lexeme(l, end);
+        if (arg == end || arg->type != lexeme_type::IDENTIFIER || symbol_of(*arg) != symbol_table::ONCE)
+            goto other;
+        _included_once.insert(guards.back().file);
+        l = arg;
+        while (++l != end && l->type != lexeme_type::LINE_END) {
+            if (l->type != lexeme_type::WHITESPACE && l->type != lexeme_type::COMMENT) {
+                PP_ERR("unexpected token");
+            }
+        }
+        remove(dir_start, l);
+    }
+    goto dispatch;
+
 eof:
 
     if (_errors.size() > 0) {
         return false;
     } else {
-        auto cur = _lexemes.begin();
-        auto next = cur;
-        next++;
-
-        while (next != _lexemes.end()) {
-            cur->write_to(*_out, *next);
-            cur = next++;
-        }
-        cur->write_to(*_out);
+        auto text = output.view();
+        _out->write(text.data(), std::streamsize(text.size()));
         return true;
     }
 
@@ -1098,41 +992,495 @@ eof:
 #undef PP_ERR
 }
 
-lex_iter preprocessor::replace_identifier(lex_iter id_lex) {
-    if (id_lex->type == lexeme_type::META_USED_DEFINE_POP) {
-        _used_defines.pop_back();
-        _lexemes.erase_and_dispose(id_lex++, lexeme::disposer{});
-        return id_lex;
-    }
-    if (id_lex->type != lexeme_type::IDENTIFIER)
+lex_iter preprocessor::replace_identifier(lex_iter id_lex, lex_iter end, lexer_cursor* lines, bool condition) {
+    auto def = id_lex->type == lexeme_type::IDENTIFIER ? expandable(*id_lex) : nullptr;
+    if (def == nullptr) {
+        // an argument expanded inside of the expansion of the macro
+        if (!_expansions.empty() && painted(*id_lex))
+            id_lex->flags |= PAINTED;
         return ++id_lex;
+    }
 
-    auto r = _defines.find(id_lex->text);
-    if (r != _defines.end() &&
-        r->second.has_parameters == false &&
-        std::find(_used_defines.begin(), _used_defines.end(), &r->second) == _used_defines.end()
-    ) {
-        auto ins_iter = id_lex;
-        ++ins_iter;
-        _used_defines.push_back(&r->second);
-        for (auto&& c : r->second.content)
-            _lexemes.insert(ins_iter, *create_lexeme(c));
-
-        _lexemes.insert(ins_iter, *create_lexeme(
-            id_lex->file_path,
-            lexeme_type::META_USED_DEFINE_POP,
-            id_lex->line,
-            id_lex->line_offset,
-            id_lex->src_length,
-            ""
-        ));
-
-        auto rem_iter = id_lex++;
-        _lexemes.erase_and_dispose(rem_iter, lexeme::disposer{});
-        return id_lex;
+    // The name stays in front of the expansion until it is done, so an invocation always starts behind the lexeme
+    // in front of it.
+    expansion_input in{std::next(id_lex), end, lines, _expansions.size(), condition};
+    bool expanded = true;
+    if (def->has_parameters) {
+        auto next = peek(in);
+        expanded = next != nullptr && next->type == lexeme_type::OPEN_PAREN && invoke(def, in);
     } else {
-        return ++id_lex;
+        // where no other macro is expanding an object-like macro always expands to the same lexemes, as long as
+        // the macros it looks up stay as they are
+        if (_expansions.empty() && !condition && _memo_input == nullptr) {
+            if (memo_holds(*def)) {
+                for (auto&& m : def->memo)
+                    _lexemes.insert(in.at, *create_lexeme(_arena, m));
+                keep_trivia(*id_lex, id_lex);
+                _lexemes.erase_and_dispose(id_lex, lexeme::disposer{});
+                return in.at;
+            }
+            _memo_input = &in;
+            _memo_spoiled = false;
+            _memo_symbols.clear();
+        }
+        def->expanding = true;
+        _expansions.push_back(expansion{def, 0, {}, {}, 0});
+    }
+    auto error_count = _errors.size();
+
+    // The content of the macros expanding and the arguments substituted are read where they are, only lexemes
+    // that are not expanded further are copied, once, so the expansion takes time linear in what it produces.
+    enum { NONE, DEFINED, DEFINED_PAREN } operand = NONE; // of a defined operator in a condition, read so far
+    while (_expansions.size() > in.floor) {
+        auto&& top = _expansions.back();
+        const lexeme* c;
+        if (top.def == nullptr) {
+            if (top.at == top.end) {
+                pop_expansion();
+                continue;
+            }
+            c = &*top.at++;
+            if (is_space(c->type))
+                continue;
+        } else {
+            if (top.next == top.def->content.size()) {
+                pop_expansion();
+                continue;
+            }
+            if (top.def->operated[top.next]) {
+                apply_operators();
+                continue;
+            }
+            auto i = top.next++;
+            if (top.def->has_parameters && top.def->references[i] != define::NoParameter) {
+                auto arg = _arguments[top.arguments + top.def->references[i]];
+                _expansions.push_back(expansion{nullptr, 0, std::next(arg.before), arg.after, 0});
+                continue;
+            }
+            c = &top.def->content[i];
+        }
+
+        auto inner = c->type == lexeme_type::IDENTIFIER && operand == NONE ? expandable(*c) : nullptr;
+        if (in.condition) {
+            if (c->type == lexeme_type::IDENTIFIER && symbol_of(*c) == symbol_table::DEFINED)
+                operand = DEFINED;
+            else if (c->type == lexeme_type::OPEN_PAREN && operand == DEFINED)
+                operand = DEFINED_PAREN;
+            else
+                operand = NONE;
+        }
+        if (inner && !inner->has_parameters) {
+            inner->expanding = true;
+            _expansions.push_back(expansion{inner, 0, {}, {}, 0});
+            continue;
+        }
+        auto copy = _lexemes.insert(in.at, *create_lexeme(_arena, *c));
+        copy->trivia = 0;
+        // a space in front is kept for the # operators the lexeme may go into
+        copy->flags = (spaced(*c) ? SPACE_BEFORE : 0) | (c->flags & PAINTED || painted(*c) ? PAINTED : 0);
+        if (inner) {
+            // the name stays if no arguments follow it, peeking may pop the frame c is in
+            auto next = peek(in);
+            if (next != nullptr && next->type == lexeme_type::OPEN_PAREN && invoke(inner, in))
+                _lexemes.erase_and_dispose(copy, lexeme::disposer{});
+        }
+    }
+
+    if (_memo_input == &in) {
+        _memo_input = nullptr;
+        if (!_memo_spoiled && _errors.size() == error_count) {
+            std::sort(_memo_symbols.begin(), _memo_symbols.end());
+            _memo_symbols.erase(std::unique(_memo_symbols.begin(), _memo_symbols.end()), _memo_symbols.end());
+            def->memo.assign(std::next(id_lex), in.at);
+            def->memo_symbols = _memo_symbols;
+            def->memo_generation = _symbols.generation();
+            def->memoized = true;
+        }
+    }
+
+    if (expanded) {
+        keep_trivia(*id_lex, id_lex);
+        _lexemes.erase_and_dispose(id_lex, lexeme::disposer{});
+    }
+    // the lines the arguments went on are joined, their line ends go behind the line the expansion ends on, so the
+    // lines behind it keep their numbers
+    if (lines && !_line_ends.empty()) {
+        auto line_end = in.at;
+        while (line_end != _lexemes.end() && line_end->type != lexeme_type::LINE_END)
+            ++line_end;
+        _lexemes.splice(line_end == _lexemes.end() ? line_end : std::next(line_end), _line_ends);
+    }
+    return in.at;
+}
+
+define* preprocessor::expandable(const lexeme& l) {
+    if (l.flags & PAINTED)
+        return nullptr;
+    auto symbol = symbol_of(l);
+    if (_memo_input || _condition_input)
+        _memo_symbols.push_back(symbol);
+    auto def = _symbols.macro(symbol);
+    return def != nullptr && !def->expanding ? def : nullptr;
+}
+
+bool preprocessor::painted(const lexeme& l) {
+    if (l.type != lexeme_type::IDENTIFIER)
+        return false;
+    auto symbol = symbol_of(l);
+    if (_memo_input || _condition_input)
+        _memo_symbols.push_back(symbol);
+    auto def = _symbols.macro(symbol);
+    return def != nullptr && def->expanding;
+}
+
+bool preprocessor::memo_holds(define& def) {
+    if (!def.memoized)
+        return false;
+    def.memoized = unchanged(def.memo_symbols, def.memo_generation);
+    return def.memoized;
+}
+
+bool preprocessor::unchanged(const std::vector<symbol_id>& symbols, u32& generation) {
+    if (generation != _symbols.generation()) {
+        for (auto symbol : symbols) {
+            if (_symbols.changed(symbol) > generation)
+                return false;
+        }
+        // checked once for every generation
+        generation = _symbols.generation();
+    }
+    return true;
+}
+
+std::optional<u32> preprocessor::evaluate_condition(lex_iter begin, lex_iter end) {
+    // the names in the condition are looked at before they are expanded, the names looked up in what they expand
+    // to are recorded while it is evaluated
+    _condition_key.clear();
+    _memo_symbols.clear();
+    for (auto l = begin; l != end; ++l) {
+        if (is_space(l->type))
+            continue;
+        _condition_key.push_back(char(l->type));
+        _condition_key.append(l->text);
+        _condition_key.push_back('\0');
+        if (l->type == lexeme_type::IDENTIFIER)
+            _memo_symbols.push_back(symbol_of(*l));
     }
+    auto cached = _conditions.find(std::string_view{_condition_key});
+    if (cached != _conditions.end() && unchanged(cached->second.symbols, cached->second.generation))
+        return cached->second.value;
+
+    auto errors = _errors.size();
+    auto warnings = _warns.size();
+    _condition_input = true;
+    auto value = condition_evaluator{this, begin, end}.evaluate();
+    _condition_input = false;
+    if (!value || _errors.size() != errors || _warns.size() != warnings)
+        return value;
+
+    std::sort(_memo_symbols.begin(), _memo_symbols.end());
+    _memo_symbols.erase(std::unique(_memo_symbols.begin(), _memo_symbols.end()), _memo_symbols.end());
+    auto&& entry = _conditions[_condition_key];
+    entry.value = *value;
+    entry.symbols = _memo_symbols;
+    entry.generation = _symbols.generation();
+    return value;
+}
+
+const lexeme* preprocessor::peek(expansion_input& in) {
+    while (_expansions.size() > in.floor) {
+        auto&& top = _expansions.back();
+        if (top.def == nullptr) {
+            while (top.at != top.end && is_space(top.at->type))
+                ++top.at;
+            if (top.at != top.end)
+                return &*top.at;
+        } else if (top.next != top.def->content.size()) {
+            auto i = top.next;
+            if (top.def->operated[i]) {
+                apply_operators();
+                continue;
+            }
+            if (!top.def->has_parameters || top.def->references[i] == define::NoParameter)
+                return &top.def->content[i];
+            ++top.next;
+            auto arg = _arguments[top.arguments + top.def->references[i]];
+            _expansions.push_back(expansion{nullptr, 0, std::next(arg.before), arg.after, 0});
+            continue;
+        }
+        pop_expansion();
+    }
+
+    // what comes behind the name of the macro is read, the expansion depends on it
+    if (&in == _memo_input)
+        _memo_spoiled = true;
+    auto l = in.at;
+    bool line_start = false;
+    for (;;) {
+        for (; l != in.end && is_space(l->type); ++l)
+            line_start |= l->type == lexeme_type::LINE_END;
+        // a directive is not part of the arguments, it ends them
+        if (l != in.end)
+            return line_start && l->type == lexeme_type::HASH ? nullptr : &*l;
+        // the end of the lexemes, the arguments may go on on the next line
+        if (in.lines == nullptr || l != _lexemes.end())
+            return nullptr;
+        auto last = std::prev(l);
+        if (!in.lines->next_line(_lexemes, _lex_errors) || !_lex_errors.empty())
+            return nullptr;
+        l = std::next(last);
+    }
+}
+
+lex_iter preprocessor::take(expansion_input& in) {
+    if (_expansions.size() > in.floor) {
+        auto&& top = _expansions.back();
+        auto&& l = top.def ? top.def->content[top.next++] : *top.at++;
+        return _lexemes.insert(in.at, *create_lexeme(_arena, l));
+    }
+    bool line_end = false;
+    while (is_space(in.at->type)) {
+        auto space = in.at++;
+        if (space->type == lexeme_type::LINE_END) {
+            _lexemes.erase(space);
+            space->trivia = 0;
+            space->flags = 0;
+            _line_ends.push_back(*space);
+            line_end = true;
+        }
+    }
+    // the line end still separates the lexemes around it for the # operator
+    if (line_end)
+        in.at->flags |= SPACE_BEFORE;
+    return in.at++;
+}
+
+bool preprocessor::invoke(define* def, expansion_input& in) {
+    auto name = std::prev(in.at);
+    auto open = take(in);
+
+    // The arguments are split at the commas outside of parentheses, the variadic one takes the commas in it.
+    // Frames that end while they are read are popped with their own arguments, these go behind them once all
+    // are read.
+    _collected.clear();
+    auto before = open;
+    auto named = def->parameters.size() - def->variadic;
+    for (int depth = 0;;) {
+        if (peek(in) == nullptr) {
+            error(&*name, MSG_DEBUG "error: unterminated argument list");
+            return false;
+        }
+        auto l = take(in);
+        if (l->type == lexeme_type::OPEN_PAREN) {
+            ++depth;
+        } else if (l->type == lexeme_type::CLOSE_PAREN && depth-- == 0) {
+            _collected.push_back(argument{before, l, std::next(before), l});
+            break;
+        } else if (l->type == lexeme_type::COMMA && depth == 0 && (!def->variadic || _collected.size() < named)) {
+            _collected.push_back(argument{before, l, std::next(before), l});
+            before = l;
+        }
+    }
+    auto close = std::prev(in.at);
+    auto first = _arguments.size();
+    _arguments.insert(_arguments.end(), _collected.begin(), _collected.end());
+
+    // nothing between the parentheses is no argument for a macro without parameters, and the variadic argument
+    // may be left out
+    auto count = _arguments.size() - first;
+    if (def->parameters.empty() && count == 1 && std::all_of(std::next(open), close, [](const lexeme& l) {
+        return is_space(l.type);
+    })) {
+        _arguments.pop_back();
+        count = 0;
+    }
+    bool variadic_left_out = def->variadic && count == named;
+    if (count != def->parameters.size() && !variadic_left_out) {
+        error(&*name, MSG_DEBUG "error: wrong number of macro arguments");
+        _arguments.resize(first);
+        return false;
+    }
+
+    // operands of # and ## read the arguments as they are, a copy is kept of those that are expanded as well
+    for (std::size_t i = 0; i < count; ++i) {
+        auto&& arg = _arguments[first + i];
+        if (!def->raw[i] || !def->expanded[i])
+            continue;
+        auto at = _scratch.begin();
+        arg.raw = arg.raw_end = at;
+        for (auto l = std::next(arg.before); l != arg.after; ++l) {
+            auto copy = _scratch.insert(at, *create_lexeme(_arena, *l));
+            if (arg.raw == at)
+                arg.raw = copy;
+        }
+    }
+
+    // before the macro is expanding, in place, the invocation is not written anyway
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!def->expanded[i])
+            continue;
+        auto arg = _arguments[first + i];
+        for (auto l = std::next(arg.before); l != arg.after;)
+            l = replace_identifier(l, arg.after, nullptr, in.condition);
+    }
+    if (variadic_left_out)
+        _arguments.push_back(argument{std::prev(close), close, close, close});
+
+    def->expanding = true;
+    _expansions.push_back(expansion{def, 0, std::next(name), close, first});
+    return true;
+}
+
+void preprocessor::pop_expansion() {
+    auto top = _expansions.back();
+    _expansions.pop_back();
+    if (top.def == nullptr)
+        return;
+    top.def->expanding = false;
+    if (top.def->has_parameters) {
+        // nothing reads the arguments anymore
+        _arguments.resize(top.arguments);
+        _lexemes.erase_and_dispose(top.at, std::next(top.end), lexeme::disposer{});
+    }
+}
+
+void preprocessor::apply_operators() {
+    auto&& frame = _expansions.back();
+    auto def = frame.def;
+    auto args = frame.arguments;
+    auto i = frame.next;
+    auto size = def->content.size();
+
+    // The operands are put in front of at one after the other, the first lexeme of an operand is pasted onto the
+    // last one put there if a ## goes in between. Operands without lexemes paste nothing.
+    auto at = _scratch.begin();
+    auto first = at;
+    auto last = at;
+    bool pasting = false;
+    auto put = [&](const lexeme& l) {
+        if (!pasting || last == at || !paste(*last, l)) {
+            last = _scratch.insert(at, *create_lexeme(_arena, l));
+            last->trivia = 0;
+            last->flags &= SPACE_BEFORE | PAINTED;
+            if (first == at)
+                first = last;
+        }
+        pasting = false;
+    };
+    for (;;) {
+        auto end = operand_end(*def, i);
+        auto param = def->has_parameters ? def->references[end - 1] : define::NoParameter;
+        if (param == define::NoParameter) {
+            put(def->content[i]);
+        } else {
+            auto arg = _arguments[args + param];
+            if (end == i + 2) {
+                put(stringify(def->content[i], arg.raw, arg.raw_end));
+            } else {
+                for (auto l = arg.raw; l != arg.raw_end; ++l) {
+                    if (!is_space(l->type))
+                        put(*l);
+                }
+            }
+        }
+        i = end;
+        if (i + 1 >= size || def->content[i].type != lexeme_type::TOKEN_CONCAT)
+            break;
+        ++i;
+        pasting = true;
+    }
+
+    frame.next = i;
+    if (first != at)
+        _expansions.push_back(expansion{nullptr, 0, first, at, 0});
+}
+
+lexeme preprocessor::stringify(const lexeme& hash, lex_iter begin, lex_iter end) {
+    // spaces between the lexemes become one, quotes and backslashes of strings and names are escaped
+    auto escaped = [](const lexeme& l) {
+        return l.type == lexeme_type::STRING || l.type == lexeme_type::NAME;
+    };
+    std::size_t size = 2;
+    bool leading = true;
+    for (auto l = begin; l != end; ++l) {
+        if (is_space(l->type))
+            continue;
+        size += !leading && spaced(*l);
+        size += l->text.size();
+        if (escaped(*l))
+            size += std::ranges::count_if(l->text, [](char c) { return c == '"' || c == '\\'; });
+        leading = false;
+    }
+
+    auto text = static_cast<char*>(_spellings.allocate(size, 1));
+    auto c = text;
+    *c++ = '"';
+    leading = true;
+    for (auto l = begin; l != end; ++l) {
+        if (is_space(l->type))
+            continue;
+        if (!leading && spaced(*l))
+            *c++ = ' ';
+        for (auto t : l->text) {
+            if (escaped(*l) && (t == '"' || t == '\\'))
+                *c++ = '\\';
+            *c++ = t;
+        }
+        leading = false;
+    }
+    *c++ = '"';
+
+    // the spelling only lives as long as the line
+    if (_memo_input)
+        _memo_spoiled = true;
+    lexeme result{lexeme_type::STRING, hash.location, std::string_view{text, size}};
+    result.flags = hash.flags & SPACE_BEFORE;
+    return result;
+}
+
+bool preprocessor::paste(lexeme& l, const lexeme& r) {
+    auto size = l.text.size() + r.text.size();
+    auto text = static_cast<char*>(_spellings.allocate(size, 1));
+    std::memcpy(text, l.text.data(), l.text.size());
+    std::memcpy(text + l.text.size(), r.text.data(), r.text.size());
+
+    auto type = lexer{""}.lex_one(text, text + size);
+    if (!type) {
+        error(&l, MSG_DEBUG "error: pasting does not give a valid lexeme");
+        return false;
+    }
+    l.type = *type;
+    l.text = {text, size};
+    l.flags &= SPACE_BEFORE;
+    l.symbol = symbol_table::NONE;
+    if (l.type == lexeme_type::IDENTIFIER) {
+        // identifiers are spelled the way the symbol table keeps them, which outlives the line
+        l.symbol = _symbols.intern(l.text);
+        l.text = _symbols.spelling(l.symbol);
+    } else if (_memo_input) {
+        _memo_spoiled = true;
+    }
+    return true;
+}
+
+const char* preprocessor::misplaced_operator(const define& def) {
+    auto&& c = def.content;
+    if (!c.empty() && (c.front().type == lexeme_type::TOKEN_CONCAT || c.back().type == lexeme_type::TOKEN_CONCAT))
+        return MSG_DEBUG "error: ## can't be at either end of a macro";
+    if (!def.has_parameters)
+        return nullptr;
+    for (std::size_t i = 0; i < c.size(); ++i) {
+        if (c[i].type != lexeme_type::HASH)
+            continue;
+        bool parameter = i + 1 < c.size() && c[i + 1].type == lexeme_type::IDENTIFIER &&
+            std::ranges::any_of(def.parameters, [&](const lexeme& p) {
+                return p.type == lexeme_type::ELLIPSIS ? symbol_of(c[i + 1]) == symbol_table::VA_ARGS
+                    : symbol_of(p) == symbol_of(c[i + 1]);
+            });
+        if (!parameter)
+            return MSG_DEBUG "error: expected a parameter behind #";
+    }
+    return nullptr;
 }
 
 lex_iter preprocessor::insert(lex_iter where, lexeme* l) {
@@ -1142,18 +1490,133 @@ lex_iter preprocessor::insert(lex_iter where, lexeme* l) {
 }
 
 void preprocessor::remove(lex_iter beg, lex_iter end) {
+    // the trivia in front of the range stays, the trivia in front of end goes with the range
+    if (beg != end) {
+        keep_trivia(*beg, beg);
+        if (end != _lexemes.end()) {
+            end->trivia = 0;
+            end->flags = 0;
+        }
+    }
     _lexemes.erase_and_dispose(beg, end, lexeme::disposer{});
 }
 
+void preprocessor::keep_trivia(const lexeme& l, lex_iter where) {
+    if (l.trivia == 0)
+        return;
+    auto type = l.flags & COMMENT_BEFORE ? lexeme_type::COMMENT : lexeme_type::WHITESPACE;
+    _lexemes.insert(where, *create_lexeme(_arena, type, l.location - l.trivia, l.leading_trivia()));
+}
+
 bool preprocessor::is_defined(std::string_view name) {
-    return _defines.find(name) != _defines.end();
+    return is_defined(_symbols.find(name));
+}
+
+bool preprocessor::is_defined(symbol_id name) {
+    return _symbols.macro(name) != nullptr;
+}
+
+bool preprocessor::is_function_like(symbol_id name) {
+    auto def = _symbols.macro(name);
+    return def && def->has_parameters;
+}
+
+symbol_id preprocessor::symbol_of(const lexeme& l) {
+    // lexemes not produced by a lexer that knows the symbol table are interned on first use
+    return l.symbol != symbol_table::NONE ? l.symbol : _symbols.intern(l.text);
+}
+
+void preprocessor::define_macro(symbol_id name, define def) {
+    // the content is written without the whitespace and comments in between, # operators still see where they were
+    for (auto&& c : def.content) {
+        c.flags = spaced(c) ? SPACE_BEFORE : 0;
+        c.trivia = 0;
+    }
+    // parameters are looked up once here, not whenever the macro is expanded
+    if (def.has_parameters) {
+        def.references.assign(def.content.size(), define::NoParameter);
+        def.expanded.assign(def.parameters.size(), false);
+        for (std::size_t i = 0; i < def.content.size(); ++i) {
+            if (def.content[i].type != lexeme_type::IDENTIFIER)
+                continue;
+            auto symbol = symbol_of(def.content[i]);
+            for (std::size_t p = 0; p < def.parameters.size(); ++p) {
+                auto&& param = def.parameters[p];
+                bool named = param.type == lexeme_type::ELLIPSIS ? symbol == symbol_table::VA_ARGS
+                    : symbol_of(param) == symbol;
+                if (named) {
+                    def.references[i] = u32(p);
+                    break;
+                }
+            }
+        }
+    }
+    // Operands of # and ## are read as they are, the last lexeme of an operand is the parameter if it names one.
+    // Arguments of parameters named anywhere else are expanded.
+    auto size = def.content.size();
+    def.raw.assign(def.parameters.size(), false);
+    def.operated.assign(size, false);
+    for (std::size_t i = 0; i < size;) {
+        auto end = operand_end(def, i);
+        bool pasted = end + 1 < size && def.content[end].type == lexeme_type::TOKEN_CONCAT;
+        if (end == i + 1 && !pasted) {
+            if (def.has_parameters && def.references[i] != define::NoParameter)
+                def.expanded[def.references[i]] = true;
+            i = end;
+            continue;
+        }
+        def.operated[i] = true;
+        for (;;) {
+            if (def.has_parameters && def.references[end - 1] != define::NoParameter)
+                def.raw[def.references[end - 1]] = true;
+            if (end + 1 >= size || def.content[end].type != lexeme_type::TOKEN_CONCAT)
+                break;
+            end = operand_end(def, end + 1);
+        }
+        i = end;
+    }
+    auto it = _defines.emplace(name, std::move(def)).first;
+    _symbols.set_macro(name, &it->second);
+}
+
+const lexed_file* preprocessor::lexed_file_of(const file_content& file, bool included) {
+    auto hash = XXH3_64bits(file.begin, std::size_t(file.end - file.begin));
+    auto it = _lexed_files.find(file.file);
+    if (it == _lexed_files.end() || it->second.hash != hash || it->second.begin != file.begin) {
+        // the old content and its lexed file go away, so does their range, else every change of the file would
+        // take its size out of the source locations for good
+        if (it != _lexed_files.end()) {
+            it->second.lexed = nullptr;
+            _lex_options.sources->release(it->second.base);
+        }
+        auto base = _lex_options.sources->add(file.file, file.begin, file.end);
+        // lexing all of it only pays off for files included more than once, in this run or in the runs sharing
+        // the token cache, the file preprocessed is not included by others
+        it = _lexed_files.insert_or_assign(file.file, lexed_file_entry{hash, file.begin, nullptr, true, base}).first;
+        if (_tokens == nullptr || !included)
+            return nullptr;
+        it->second.lexed = _tokens->load(file.file, file.begin, file.end, hash, _lex_options, base);
+        if (it->second.lexed)
+            return it->second.lexed.get();
+    }
+
+    auto&& entry = it->second;
+    if (entry.lexed == nullptr && entry.cacheable) {
+        entry.lexed = lexed_file::lex(file.file, file.begin, file.end, _lex_options, entry.base);
+        entry.cacheable = entry.lexed != nullptr;
+        if (_tokens && entry.lexed)
+            _tokens->save(*entry.lexed, hash);
+    }
+    return entry.lexed.get();
 }
 
 void preprocessor::error(lexeme* l, const char* msg) {
-    _errors.push_back(std::format("{}({},{}): {}\n", l->file_path, l->line, l->line_offset, msg));
+    auto where = _lex_options.sources->resolve(l->location);
+    _errors.push_back(std::format("{}({},{}): {}\n", where.file_path, where.line, where.column, msg));
 }
 
 void preprocessor::warn(lexeme* l, const char* msg) {
-    _warns.push_back(std::format("{}({},{}): {}\n", l->file_path, l->line, l->line_offset, msg));
+    auto where = _lex_options.sources->resolve(l->location);
+    _warns.push_back(std::format("{}({},{}): {}\n", where.file_path, where.line, where.column, msg));
 }
 
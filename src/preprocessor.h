@@ -2,6 +2,7 @@
 
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <string_view>
 #include <vector>
 #include <climits>
@@ -15,6 +16,7 @@
 
 #include "file_service.h"
 #include "lexer.h"
+#include "symbol_table.h"
 
 struct string_hash {
     using is_transparent = std::true_type;
@@ -45,20 +47,36 @@ struct string_hash {
 };
 
 struct define {
+    static constexpr u32 NoParameter = ~u32(0);
+
     lexeme name;
     std::vector<lexeme> content;
     bool has_parameters = false;
-    std::vector<lexeme> parameters;
+    std::vector<lexeme> parameters; // of a variadic macro the ellipsis last
+    bool variadic = false;          // __VA_ARGS__ names the arguments behind the other parameters
+    std::vector<u32> references;    // of every lexeme of the content, the parameter it names, NoParameter if none
+    std::vector<bool> expanded;     // of every parameter, whether its argument is expanded, not if it is never named
+    std::vector<bool> raw;          // of every parameter, whether its argument is an operand of # or ## as it is
+    std::vector<bool> operated;     // of every lexeme of the content, whether the operands of # or ## start there
+    bool expanding = false; // the content is being expanded, the name is left as it is inside of it
+    // Of an object-like macro, what it expands to where no other macro is expanding, made the first time it is
+    // expanded there. It holds while the macros of memo_symbols, the names looked up on the way, are not changed
+    // after memo_generation.
+    bool memoized = false;
+    std::vector<lexeme> memo;
+    std::vector<symbol_id> memo_symbols;
+    u32 memo_generation = 0;
 
     define(lexeme name, std::vector<lexeme> content) :
         name(name), content(content), has_parameters(false), parameters()
     {}
 
-    define(lexeme name, std::vector<lexeme> content, std::vector<lexeme> parameters) :
+    define(lexeme name, std::vector<lexeme> content, std::vector<lexeme> parameters, bool variadic = false) :
         name(name),
         content(content),
         has_parameters(true),
-        parameters(parameters)
+        parameters(parameters),
+        variadic(variadic)
     {}
 };
 
@@ -67,18 +85,41 @@ public:
     explicit preprocessor(
         std::ostream& out,
         file_service* fserv,
-        std::vector<define> defines
+        std::vector<define> defines,
+        lexer_options lex_options = {},
+        arena_options arena_opts = {},
+        class token_cache* tokens = nullptr // images of included files are loaded from and saved to it if set
     );
     ~preprocessor();
 
+    /**
+     * Preprocesses a file and writes the result. Lexemes of the previous file are discarded and their memory
+     * is reused.
+     */
     bool preprocess_file(std::string_view in, std::string_view cwd);
-    lex_iter replace_identifier(lex_iter id);
+    /**
+     * Expands the macro named by id, if it is one, up to end at most. The arguments of a macro invoked may go on
+     * past end on the lines lines hands out, if set, end has to be the end of the lexemes then. In a condition the
+     * operands of defined operators the expansion produces are left as they are. Returns the lexeme behind the
+     * expansion.
+     */
+    lex_iter replace_identifier(lex_iter id, lex_iter end, class lexer_cursor* lines = nullptr, bool condition = false);
     lex_iter insert(lex_iter where, lexeme* l);
     void remove(lex_iter beg, lex_iter end);
     bool is_defined(std::string_view name);
+    bool is_defined(symbol_id name);
+    bool is_function_like(symbol_id name); // defined with parameters
+    symbol_id symbol_of(const lexeme& l);
     void error(lexeme* l, const char* msg);
     void warn(lexeme* l, const char* msg);
 
+    const arena& lexeme_arena() const {
+        return _arena;
+    }
+    arena& lexeme_arena() {
+        return _arena;
+    }
+
     constexpr auto errors() const {
         return std::ranges::subrange{&*_errors.begin(), &*_errors.begin() + _errors.size()};
     }
@@ -93,15 +134,125 @@ public:
 private:
     std::ostream* _out;
     file_service* _fserv;
-    std::unique_ptr<struct expression_parser> _expr_parser;
+    class token_cache* _tokens;
+    lexer_options _lex_options;
     
+    void define_macro(symbol_id name, define def);
+    // the file lexed before if it was included before with the same content or has an image in _tokens, nullptr if
+    // it has to be lexed
+    const class lexed_file* lexed_file_of(const file_content& file, bool included);
+    // inserts the trivia folded into l as a lexeme of its own in front of where, for when l is removed
+    void keep_trivia(const lexeme& l, lex_iter where);
+    // the macro l is expanded to, nullptr if it is not expanded
+    define* expandable(const lexeme& l);
+    // whether l names a macro expanding, so it is not expanded anywhere the expansion goes
+    bool painted(const lexeme& l);
+    // whether the memo of def holds for the macros defined now
+    bool memo_holds(define& def);
+    // whether none of the macros of symbols changed after generation, which is moved up to now if so
+    bool unchanged(const std::vector<symbol_id>& symbols, u32& generation);
+    // the value of the condition of an #if or #elif, nothing if it could not be evaluated; macros in it are expanded
+    std::optional<u32> evaluate_condition(lex_iter begin, lex_iter end);
+    // the # and ## operators of def that are misplaced, nullptr if there are none
+    const char* misplaced_operator(const define& def);
+
+    // where an expansion reads the lexemes behind its frames from, and puts what it produces
+    struct expansion_input {
+        lex_iter at; // the lexeme read next, the expansion goes in front of it
+        lex_iter end;
+        class lexer_cursor* lines; // of the rest of the file, for arguments on the lines behind end
+        std::size_t floor;         // the frames below belong to the expansion this one is part of
+        bool condition;
+    };
+    // the next lexeme of the expansion that is not whitespace, nullptr if there is none; frames that are done are
+    // popped on the way, the lexemes of the input stay where they are
+    const lexeme* peek(expansion_input& in);
+    // moves the lexeme peek returned in front of in.at, copied if it is read from a frame
+    lex_iter take(expansion_input& in);
+    // invokes def with the arguments behind the lexeme in front of in.at, a parenthesis comes next
+    bool invoke(define* def, expansion_input& in);
+    void pop_expansion();
+    // The content of the macro expanding innermost goes on with the operands of # or ## operators: what they
+    // produce is put together in _scratch and read from a frame of its own, the content goes on behind them.
+    void apply_operators();
+    // the string the lexemes of [begin, end) are spelled as, for the lexeme of the # operator
+    lexeme stringify(const lexeme& hash, lex_iter begin, lex_iter end);
+    // pastes r onto the end of l, false if they don't paste to one lexeme, l is left as it is then
+    bool paste(lexeme& l, const lexeme& r);
+
+    arena _arena;
+    arena _spellings; // of the lexemes pasted and stringified, reset with _arena
+    // Lexemes of the current line, with the expansions of its macros spliced in. It stays a list of nodes: it never
+    // holds more than a line and its expansions, and lexemes are inserted and removed in the middle all the time.
+    // Files included more than once are kept compact as lexed files instead.
     lexeme_list _lexemes;
-    phmap::flat_hash_map<std::string, define, string_hash> _defines;
-    std::vector<define*> _used_defines;
+    lexeme_list _scratch; // what # and ## operators produce and the arguments they read that are also expanded
+    symbol_table _symbols;
+    phmap::node_hash_map<symbol_id, define> _defines; // node based, symbols point to their define
+    // Of every macro expanding the lexeme of its content read next, of every argument substituted the lexeme of
+    // the argument read next, the innermost last. Arguments are the lexemes of the invocation in _lexemes, which
+    // stays in front of the expansion until the macro is done, and are expanded once before they are substituted.
+    struct expansion {
+        define* def;      // nullptr for an argument
+        std::size_t next; // of a macro, index into its content
+        lex_iter at;      // of an argument, the lexeme read next; of a macro invoked, the start of the invocation
+        lex_iter end;     // of an argument, behind its last lexeme; of a macro invoked, the closing parenthesis
+        std::size_t arguments; // of a macro invoked, its first argument in _arguments
+    };
+    // the lexemes between two of the parentheses and commas of an invocation, which are kept as they are
+    struct argument {
+        lex_iter before;
+        lex_iter after;
+        // as it was before it was expanded, for # and ##; a copy in _scratch if the argument is expanded too
+        lex_iter raw;
+        lex_iter raw_end;
+    };
+    std::vector<expansion> _expansions;
+    std::vector<argument> _arguments;
+    std::vector<argument> _collected; // of the invocation read, not invoked yet
+    lexeme_list _line_ends; // of the lines arguments went on, they go behind the line the invocation ends on
+    // The expansion whose result becomes the memo of its macro, nullptr if none is. Every name looked up while it
+    // expands is recorded; if it reads past the content of its macro, what it produces depends on what follows
+    // the name and is not memoized.
+    const expansion_input* _memo_input = nullptr;
+    bool _memo_spoiled = false;
+    bool _condition_input = false; // a condition is evaluated, the names it looks up are recorded as well
+    std::vector<symbol_id> _memo_symbols;
+    std::vector<lex_err> _lex_errors;
     std::vector<std::string> _errors;
     std::vector<std::string> _warns;
 
     int _if_depth;
-    int _erasing_depth;
     std::vector<bool> _else_seen;
+    std::vector<bool> _branch_taken; // of every conditional open, whether one of its branches is active
+
+    // Files included again are skipped without loading them if all of them is one #ifndef of a macro still
+    // defined, or if they have a #pragma once. Includes are looked up by their spelling, of the current file only.
+    template<typename T>
+    using string_map = phmap::flat_hash_map<std::string, T, string_hash, std::equal_to<>>;
+    string_map<std::string> _include_paths;  // '"' or '<' and the path included, to the file it resolved to
+    string_map<symbol_id> _include_guards;   // file to the macro guarding it
+    phmap::flat_hash_set<std::string, string_hash, std::equal_to<>> _included_once;
+
+    // Files are lexed up front once they are included a second time, or the first time if there is a token cache,
+    // includes after that copy their lexemes
+    struct lexed_file_entry {
+        u64 hash; // of the content
+        const char* begin;
+        std::unique_ptr<class lexed_file> lexed;
+        bool cacheable = true; // false if lexing found errors
+        source_location base; // of the content, whether it is lexed line by line or whole, kept from run to run
+    };
+    string_map<lexed_file_entry> _lexed_files;
+
+    // Values of the conditions evaluated before, by the type and spelling of their lexemes. A value holds while the
+    // macros of the names looked up on the way are not changed after generation. Conditions that warned or failed
+    // are evaluated every time.
+    struct condition_entry {
+        u32 value;
+        std::vector<symbol_id> symbols;
+        u32 generation;
+    };
+    string_map<condition_entry> _conditions;
+    std::string _condition_key; // of the condition evaluated, kept for its memory
 };
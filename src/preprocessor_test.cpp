@@ -0,0 +1,464 @@
+#include "preprocessor.h"
+#include "token_cache.h"
+#include <catch.hpp>
+#include <filesystem>
+#include <map>
+#include <sstream>
+#include <string>
+
+struct preprocess_result {
+    bool ok;
+    std::string output;
+};
+
+static preprocess_result preprocess(
+    std::string_view source,
+    std::vector<define> defines = {},
+    std::vector<std::pair<std::string_view, std::string_view>> other_files = {}
+) {
+    memory_file_service files;
+    files.add_file("main.uc", source);
+    for (auto&& [path, content] : other_files)
+        files.add_file(path, content);
+
+    std::ostringstream out;
+    preprocessor pp{out, &files, std::move(defines)};
+    bool ok = pp.preprocess_file("main.uc", "");
+    return preprocess_result{ok, out.str()};
+}
+
+TEST_CASE("object-like macros are expanded") {
+    auto r = preprocess("#define FOO 1\n#define BAR FOO + 2\nx = BAR;\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nx = 1+2;\n");
+}
+
+TEST_CASE("macros are not expanded again inside of their own expansion") {
+    auto r = preprocess("#define A B A x\n#define B A 1 C\n#define C C B\nA B C\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nA 1 C B A x B A x 1 C B C B A x 1 C\n");
+}
+
+TEST_CASE("macros expand again after the macros in their expansion change") {
+    auto r = preprocess("#define A B C\n#define B 1\nA\n#undef B\n#define B 2\nA\n#define C 3\nA\n#define D 4\nA\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n1 C\n\n\n2 C\n\n2 3\n\n2 3\n");
+
+    r = preprocess("#define f(x) [x]\n#define A f\nA A(1) A\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nf [1] f\n");
+}
+
+TEST_CASE("function-like macros substitute their expanded arguments") {
+    auto r = preprocess("#define SQ(x) x * x\n#define ADD(a, b) a + b\nADD(SQ(2), SQ(ADD(1, 3)))\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n2*2+1+3*1+3\n");
+}
+
+TEST_CASE("variadic macros substitute the arguments behind the named ones") {
+    auto r = preprocess(
+        "#define LOG(fmt, ...) log(fmt, __VA_ARGS__)\n#define LIST(...) [__VA_ARGS__]\n"
+        "LOG(\"a\", 1, (2, 3)) LOG(\"b\") LIST() LIST(x, y)\n"
+    );
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nlog(\"a\",1,(2,3)) log(\"b\",) [] [x,y]\n");
+}
+
+TEST_CASE("# spells its argument as a string") {
+    auto r = preprocess(
+        "#define S(x) #x\n#define XS(x) S(x)\n#define P a  b\n"
+        "S(a  +\n  b) S(\"q\\\\\" 'n') S() XS(P) S(P)\n"
+    );
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\n\"a + b\" \"\\\"q\\\\\\\\\\\" 'n'\" \"\" \"a b\" \"P\"\n\n");
+}
+
+TEST_CASE("## pastes its operands into one lexeme that is expanded again") {
+    auto r = preprocess(
+        "#define CAT(a, b) a ## b\n#define XCAT(a, b) CAT(a, b)\n#define AB done\n#define N 1\n"
+        "CAT(A, B) CAT(x, N) XCAT(x, N) CAT(, y) CAT(z, ) CAT(<, =) CAT(1 2, 3 4)\n"
+        "#define V(p, ...) p ## __VA_ARGS__\n#define O a ## b ## c\nV(q) V(q, r) O\n"
+    );
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\n\ndone xN x1 y z <= 1 23 4\n\n\nq qr abc\n");
+}
+
+TEST_CASE("misplaced # and ## operators are errors") {
+    REQUIRE_FALSE(preprocess("#define F(x) #y\n").ok);
+    REQUIRE_FALSE(preprocess("#define F ## x\n").ok);
+    REQUIRE_FALSE(preprocess("#define F(x) x ##\n").ok);
+    REQUIRE_FALSE(preprocess("#define F(a, b) a ## b\nF(+, /)\n").ok);
+    REQUIRE(preprocess("#define H # x\nH\n").ok);
+}
+
+TEST_CASE("function-like macro names without arguments are left as they are") {
+    auto r = preprocess("#define F(a) a\n#define G F\nF + G F(G)(1)\n#define f(x) x\n#define A f(A) B\n#define B A\nA\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nF + F F(1)\n\n\n\nA A\n");
+}
+
+TEST_CASE("arguments going on on the next lines keep the line numbers behind them") {
+    auto r = preprocess("#define F(a, b) a - b\nx = F(1,\n  2) + F\n(3, 4);\ny\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\nx = 1-2 + 3-4;\n\n\ny\n");
+}
+
+TEST_CASE("directives go on over line endings behind a backslash") {
+    auto r = preprocess("#define X 1 \\\n + 2\nX\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n1+2\n");
+
+    r = preprocess("#define F(a, \\\r\n  b) a - \\\r\n  b\nF(1, 2)\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n1-2\n");
+
+    r = preprocess("#define A 1\n#if A \\\n  && B\na\n#else\nb\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\n\nb\n\n");
+}
+
+TEST_CASE("skipped branches go on over line endings behind a backslash") {
+    auto r = preprocess("#if 0\na \\\n#endif\n#endif\nb\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\n\nb\n");
+
+    // but not in a line comment
+    r = preprocess("#if 0\na // \\\n#endif\nb\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nb\n");
+}
+
+TEST_CASE("invoking a macro with the wrong number of arguments is an error") {
+    REQUIRE_FALSE(preprocess("#define F(a, b) a\nF(1)\n").ok);
+    REQUIRE_FALSE(preprocess("#define F(a) a\nF(1\n#define G\n)\n").ok);
+}
+
+TEST_CASE("undef removes a macro") {
+    auto r = preprocess("#define FOO 1\nFOO\n#undef FOO\nFOO\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n1\n\nFOO\n");
+}
+
+TEST_CASE("undef of an unknown macro is an error") {
+    auto r = preprocess("#undef FOO\n");
+    REQUIRE_FALSE(r.ok);
+}
+
+TEST_CASE("defined checks whether a macro is defined") {
+    auto r = preprocess("#define FOO\n#if defined(FOO) && !defined BAR\nyes\n#else\nno\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nyes\n\n\n\n");
+}
+
+TEST_CASE("defined is evaluated where a macro expands to it") {
+    auto r = preprocess("#define X\n#define D defined(X) && !defined Y\n#if D\nyes\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nyes\n\n");
+}
+
+TEST_CASE("conditions are evaluated with the precedence of their operators") {
+    auto r = preprocess("#define N 2\n#if 1 + N * 3 == 7 && (8 >> 1 | 1) == 5 && -N == 0 - 2 && !(N - 2) && ~0 == -1\nyes\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nyes\n\n");
+}
+
+TEST_CASE("the operand of && and || that does not decide the condition is not expanded") {
+    auto r = preprocess("#define F(a, b) a\n#if 1 || F(1) / 0\nyes\n#endif\n#if 0 && F(1) || defined F\nyes\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nyes\n\n\nyes\n\n");
+
+    REQUIRE_FALSE(preprocess("#if 1 && 1 / 0\n#endif\n").ok);
+
+    // but its syntax is checked
+    REQUIRE(preprocess("#define F(a) a\n#if 1 || F(1, (2)) && defined(X) || -(3 + 4) * 5\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#if 1 || 1 1\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#if 1 || (2\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#if 0 && (1 ||)\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#if 0 && defined(X\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#define F(a) a\n#if 1 || F(1\n#endif\n").ok);
+    REQUIRE_FALSE(preprocess("#if 1 2\n#endif\n").ok);
+}
+
+TEST_CASE("conditions seen before are evaluated again after the macros they read change") {
+    auto r = preprocess(
+        "#define V 3\n#define A V\n#if defined B || A >= 3\nyes\n#endif\n#undef V\n#define V 2\n"
+        "#if defined B || A >= 3\nyes\n#endif\n#define B\n#if defined B || A >= 3\nyes\n#endif\n"
+    );
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nyes\n\n\n\n\n\n\n\n\nyes\n\n");
+}
+
+TEST_CASE("macros passed to the preprocessor are expanded") {
+    std::string text = "FOO=bar baz";
+    std::vector<char> chars(text.begin(), text.end());
+    auto lexemes = lexer{"cmd"}.run(chars).lexemes;
+    std::vector<lexeme> content;
+    for (auto l = std::next(lexemes.begin(), 2); l != lexemes.end(); ++l)
+        content.push_back(*l);
+
+    auto r = preprocess("FOO\n", {define{*lexemes.begin(), content}});
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "bar baz\n");
+}
+
+TEST_CASE("included files are preprocessed") {
+    auto r = preprocess("#include \"b.uh\"\nB\n", {}, {{"b.uh", "#define B 42\n"}});
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n42\n");
+}
+
+TEST_CASE("preprocessing another file reuses lexeme memory") {
+    memory_file_service files;
+    files.add_file("a.uc", "#define FOO 1\nvar int a = FOO;\n");
+    files.add_file("b.uc", "var int b = FOO;\n");
+
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}};
+    REQUIRE(pp.preprocess_file("a.uc", ""));
+    auto reserved = pp.lexeme_arena().reserved();
+    auto high_water_mark = pp.lexeme_arena().high_water_mark();
+    REQUIRE(high_water_mark > 0);
+
+    out.str("");
+    REQUIRE(pp.preprocess_file("b.uc", ""));
+    REQUIRE(out.str() == "var int b = 1;\n");
+    REQUIRE(pp.lexeme_arena().reserved() == reserved);
+    REQUIRE(pp.lexeme_arena().high_water_mark() == high_water_mark);
+}
+
+TEST_CASE("includes in the middle of a file keep the lines around them") {
+    auto r = preprocess("a\n#include \"b.uh\" // comment\nB c\n", {}, {{"b.uh", "#define B 42\nb"}});
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "a\n\nb\n42 c\n");
+}
+
+TEST_CASE("lexemes are only held for the current line") {
+    std::string source = "#if 0\n";
+    for (int i = 0; i < 1000; ++i)
+        source += "var int a" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    source += "#endif\n";
+    for (int i = 0; i < 1000; ++i)
+        source += "b = " + std::to_string(i) + ";\n";
+
+    memory_file_service files;
+    files.add_file("main.uc", source);
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}};
+    REQUIRE(pp.preprocess_file("main.uc", ""));
+    REQUIRE(pp.lexeme_arena().high_water_mark() < 20 * sizeof(lexeme));
+}
+
+TEST_CASE("errors point at the file, line and column of the lexeme") {
+    memory_file_service files;
+    files.add_file("main.uc", "x\n#include \"b.uh\"\n");
+    files.add_file("b.uh", "\n  #undef FOO\n");
+
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}};
+    REQUIRE_FALSE(pp.preprocess_file("main.uc", ""));
+    REQUIRE(pp.errors().size() == 1);
+    REQUIRE(pp.errors()[0].starts_with("b.uh(2,9): "));
+}
+
+TEST_CASE("UTF-16LE files are preprocessed as UTF-8") {
+    std::u16string text = u"#define N \"\u00e9\"\r\nx = N;\r\n";
+    std::string bytes = "\xFF\xFE";
+    for (auto unit : text) {
+        bytes += char(unit & 0xFF);
+        bytes += char(unit >> 8);
+    }
+    auto r = preprocess(bytes);
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\r\nx = \"\xc3\xa9\";\r\n");
+}
+
+TEST_CASE("whitespace and comments around directives and macros are kept") {
+    auto r = preprocess("  #define FOO /* one */ 1\nx = /* a */ FOO  // b\n#if FOO\n\ty\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "  \nx = /* a */ 1  // b\n\n\ty\n\n");
+}
+
+TEST_CASE("conditionals nested in inactive branches are skipped with them") {
+    auto r = preprocess("#if 0\n#if 1\na\n#else\nb\n#endif\n#elif 1\nc\n#else\nd\n#endif\ne\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\n\n\n\n\nc\n\n\n\ne\n");
+}
+
+TEST_CASE("ifdef and ifndef check whether a macro is defined") {
+    auto r = preprocess("#define FOO\n#ifdef FOO\na\n#endif\n#ifndef FOO\nb\n#else\nc\n#endif\n#ifdef BAR\nd\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\na\n\n\n\n\nc\n\n\n\n\n");
+}
+
+TEST_CASE("branches behind the one taken are skipped without looking at their conditions") {
+    auto r = preprocess("#if 1\na\n#elif )\nb\n#else\nc\n#endif\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\na\n\n\n\n\n\n");
+}
+
+TEST_CASE("skipped branches keep the line numbers of the lines behind them") {
+    auto r = preprocess("#if 0\r\n/* a\r\nb */\r\n#endif\r\nd\r\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\r\n\r\n\r\n\r\nd\r\n");
+}
+
+TEST_CASE("skipped branches are not lexed") {
+    auto r = preprocess("#if 0\n'a \" $ 0x\n#endif\nb\n");
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nb\n");
+
+    // except that a comment left open hides the end of the conditional
+    r = preprocess("#if 0\n/* a\n#endif\nb\n");
+    REQUIRE_FALSE(r.ok);
+}
+
+struct counting_file_service : memory_file_service {
+    std::map<std::string, int, std::less<>> loads;
+
+    file_content resolve_load(std::string_view cwd, std::string_view path) override {
+        ++loads[std::string{path}];
+        return memory_file_service::resolve_load(cwd, path);
+    }
+};
+
+// hands out other content of big.uh every time it is loaded
+struct changing_file_service : memory_file_service {
+    std::string big = "#if 0\n/*" + std::string(std::size_t(1) << 28, 'x') + "*/\n#endif\n";
+    int loads = 0;
+
+    file_content resolve_load(std::string_view cwd, std::string_view path) override {
+        if (path != "big.uh")
+            return memory_file_service::resolve_load(cwd, path);
+        big[8] = char('a' + loads++ % 26);
+        return {"big.uh", big.data(), big.data() + big.size()};
+    }
+};
+
+TEST_CASE("files changed from run to run don't use up source locations") {
+    source_map sources;
+    lexer_options options;
+    options.sources = &sources;
+    changing_file_service files;
+    files.add_file("main.uc", "#include \"big.uh\"\n#include \"big.uh\"\n");
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}, options};
+    // 256 MiB a time, 2 included a run, 13 runs are half again as many locations as there are
+    for (int i = 0; i < 13; ++i) {
+        out.str("");
+        REQUIRE(pp.preprocess_file("main.uc", ""));
+        REQUIRE(out.str() == "\n\n\n\n\n\n\n\n");
+    }
+    REQUIRE(files.loads == 26);
+}
+
+TEST_CASE("guarded files are not loaded again while their guard is defined") {
+    counting_file_service files;
+    files.add_file("main.uc", "#include \"b.uh\"\n#include \"b.uh\"\nB\n#undef B_UH\n#include \"b.uh\"\n");
+    files.add_file("b.uh", "// b\n#ifndef B_UH\n#define B_UH\n#define B 1\nb\n#endif\n\n");
+
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}};
+    REQUIRE(pp.preprocess_file("main.uc", ""));
+    REQUIRE(out.str() == "// b\n\n\n\nb\n\n\n\n\n1\n\n// b\n\n\n\nb\n\n\n\n");
+    REQUIRE(files.loads["b.uh"] == 2);
+}
+
+TEST_CASE("files with anything outside of their ifndef are included again") {
+    auto once = std::string_view{"#ifndef B_UH\n#define B_UH\nb\n#endif\n"};
+    for (auto [header, output] : {
+        std::pair{"#ifndef B_UH\n#define B_UH\nb\n#endif\nc\n", "\n\nb\n\nc\n\n\n\n\n\nc\n\n"},
+        std::pair{"#ifndef B_UH\n#define B_UH\nb\n#else\nc\n#endif\n", "\n\nb\n\n\n\n\n\n\n\n\nc\n\n\n"},
+        std::pair{"#define B_UH\n#ifndef B_UH\nb\n#endif\n", "\n\n\n\n\n\n\n\n\n\n"},
+    }) {
+        auto r = preprocess("#include \"b.uh\"\n#include \"b.uh\"\n", {}, {{"b.uh", header}});
+        REQUIRE(r.ok);
+        REQUIRE(r.output == output);
+    }
+    auto r = preprocess("#include \"b.uh\"\n#include \"b.uh\"\n", {}, {{"b.uh", once}});
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\nb\n\n\n\n");
+}
+
+TEST_CASE("files with pragma once are included once") {
+    counting_file_service files;
+    files.add_file("main.uc", "#include \"b.uh\"\n#include <b.uh>\n#include \"b.uh\"\n#pragma pack\n");
+    files.add_file("b.uh", "#pragma once\nb\n");
+
+    std::ostringstream out;
+    preprocessor pp{out, &files, {}};
+    REQUIRE(pp.preprocess_file("main.uc", ""));
+    REQUIRE(out.str() == "\nb\n\n\n\n#pragma pack\n");
+    REQUIRE(files.loads["b.uh"] == 2); // once for every spelling
+}
+
+TEST_CASE("files included again are preprocessed from the lexemes of the first time") {
+    auto r = preprocess(
+        "#include \"d.uh\"\n#define V 2\n#include \"d.uh\"\n#undef V\n#include \"d.uh\"\n",
+        {},
+        {{"d.uh", "#ifdef V\nv = V; /* c */\n#else\nnone\n#endif\n"}}
+    );
+    REQUIRE(r.ok);
+    REQUIRE(r.output == "\n\n\nnone\n\n\n\n\nv = 2; /* c */\n\n\n\n\n\n\n\n\nnone\n\n\n");
+}
+
+TEST_CASE("files included again are lexed whole by the engine asked for") {
+    std::string expected;
+    for (auto engine : {lexer_engine::STATE_MACHINE, lexer_engine::STRUCTURAL, lexer_engine::DFA}) {
+        memory_file_service files;
+        files.add_file("main.uc", "#include \"d.uh\"\n#define V 2\n#include \"d.uh\"\n");
+        files.add_file("d.uh", "#ifdef V\nv = V; /* c */\n#else\nnone\n#endif\n");
+        lexer_options options;
+        options.engine = engine;
+        options.threads = 2;
+        std::ostringstream out;
+        preprocessor pp{out, &files, {}, options};
+        REQUIRE(pp.preprocess_file("main.uc", ""));
+        if (expected.empty())
+            expected = out.str();
+        REQUIRE(out.str() == expected);
+    }
+    REQUIRE(expected == "\n\n\nnone\n\n\n\n\nv = 2; /* c */\n\n\n\n\n");
+}
+
+TEST_CASE("included files are loaded from the token cache of an earlier run") {
+    auto directory = (std::filesystem::temp_directory_path() / "ucpp_token_cache_test").string();
+    std::filesystem::remove_all(directory);
+
+    auto run = [&]() {
+        memory_file_service files;
+        files.add_file("main.uc", "#define V 1\n#include \"d.uh\"\n");
+        files.add_file("d.uh", "#ifdef V\nv = V; /* c */\n#endif\n");
+        token_cache tokens{directory};
+        std::ostringstream out;
+        preprocessor pp{out, &files, {}, {}, {}, &tokens};
+        REQUIRE(pp.preprocess_file("main.uc", ""));
+        return out.str();
+    };
+    REQUIRE(run() == "\n\nv = 1; /* c */\n\n\n");
+    // one image, the file preprocessed is not included by anything
+    REQUIRE(std::distance(std::filesystem::directory_iterator{directory}, {}) == 1);
+    REQUIRE(run() == "\n\nv = 1; /* c */\n\n\n");
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("the token cache keeps images of files lexed with and without folded trivia apart") {
+    auto directory = (std::filesystem::temp_directory_path() / "ucpp_token_cache_fold_test").string();
+    std::filesystem::remove_all(directory);
+
+    std::string s = "a /* c */ b\n";
+    auto hash = XXH3_64bits(s.data(), s.size());
+    token_cache tokens{directory};
+    for (bool fold : {false, true}) {
+        lexer_options options;
+        options.fold_trivia = fold;
+        tokens.save(*lexed_file::lex("d.uh", s.data(), s.data() + s.size(), options), hash);
+    }
+    for (bool fold : {false, true}) {
+        lexer_options options;
+        options.fold_trivia = fold;
+        auto loaded = tokens.load("d.uh", s.data(), s.data() + s.size(), hash, options);
+        REQUIRE(loaded != nullptr);
+        REQUIRE(loaded->fold_trivia() == fold);
+    }
+    std::filesystem::remove_all(directory);
+}
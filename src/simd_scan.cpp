@@ -0,0 +1,476 @@
+#include "simd_scan.h"
+
+#include <bit>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define UCPP_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#else
+#define UCPP_X86 0
+#endif
+
+// MSVC allows intrinsics for any instruction set in any function, GCC and Clang need to be told per function
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE42
+#define TARGET_AVX2
+#else
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static constexpr bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+static constexpr bool is_identifier(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char* scalar_whitespace(const char* c, const char* end) {
+    while (c != end && is_whitespace(*c))
+        ++c;
+    return c;
+}
+
+static const char* scalar_identifier(const char* c, const char* end) {
+    while (c != end && is_identifier(*c))
+        ++c;
+    return c;
+}
+
+static const char* scalar_line_comment(const char* c, const char* end) {
+    while (c != end && *c != '\r' && *c != '\n')
+        ++c;
+    return c;
+}
+
+static const char* scalar_block_comment(const char* c, const char* end) {
+    while (c != end && *c != '*' && *c != '\r' && *c != '\n')
+        ++c;
+    return c;
+}
+
+static const char* scalar_quoted(const char* c, const char* end, char quote) {
+    while (c != end && *c != quote && *c != '\\' && *c != '\r' && *c != '\n')
+        ++c;
+    return c;
+}
+
+static const char* scalar_inactive(const char* c, const char* end) {
+    while (c != end && *c != '/' && *c != '"' && *c != '\'' && *c != '\r' && *c != '\n')
+        ++c;
+    return c;
+}
+
+static const char* scalar_ascii(const char* c, const char* end) {
+    while (c != end && u8(*c) < 0x80)
+        ++c;
+    return c;
+}
+
+static const char* scalar_narrow_utf16(const char* c, const char* end, char* out) {
+    while (end - c >= 2 && u8(c[0]) < 0x80 && c[1] == 0) {
+        *out++ = c[0];
+        c += 2;
+    }
+    return c;
+}
+
+static void scalar_classify(const char* c, block_masks& out) {
+    out = {};
+    for (int i = 0; i < 64; ++i) {
+        u64 bit = u64(1) << i;
+        char ch = c[i];
+        out.whitespace |= is_whitespace(ch) ? bit : 0;
+        out.identifier |= is_identifier(ch) ? bit : 0;
+        out.digit |= (ch >= '0' && ch <= '9') ? bit : 0;
+        out.line_feed |= (ch == '\n') ? bit : 0;
+        out.carriage_return |= (ch == '\r') ? bit : 0;
+        out.double_quote |= (ch == '"') ? bit : 0;
+        out.single_quote |= (ch == '\'') ? bit : 0;
+        out.backslash |= (ch == '\\') ? bit : 0;
+        out.slash |= (ch == '/') ? bit : 0;
+        out.star |= (ch == '*') ? bit : 0;
+    }
+}
+
+static constexpr scan_kernels scalar_kernels{
+    scalar_whitespace,
+    scalar_identifier,
+    scalar_line_comment,
+    scalar_block_comment,
+    scalar_quoted,
+    scalar_inactive,
+    scalar_ascii,
+    scalar_narrow_utf16,
+    scalar_classify,
+};
+
+#if UCPP_X86
+
+// SSE4.2 kernels use PCMPESTRI with explicit lengths, so NUL bytes in the input do not end the scan early.
+
+constexpr int any_first_match = _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT;
+constexpr int any_first_mismatch = any_first_match | _SIDD_NEGATIVE_POLARITY;
+constexpr int range_first_mismatch = _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT | _SIDD_NEGATIVE_POLARITY;
+
+TARGET_SSE42 static const char* sse42_whitespace(const char* c, const char* end) {
+    const __m128i set = _mm_setr_epi8(' ', '\t', '\v', '\f', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(set, 4, _mm_loadu_si128((const __m128i*) c), 16, any_first_mismatch);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_whitespace(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_identifier(const char* c, const char* end) {
+    const __m128i ranges = _mm_setr_epi8('a', 'z', 'A', 'Z', '0', '9', '_', '_', 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(ranges, 8, _mm_loadu_si128((const __m128i*) c), 16, range_first_mismatch);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_identifier(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_line_comment(const char* c, const char* end) {
+    const __m128i set = _mm_setr_epi8('\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(set, 2, _mm_loadu_si128((const __m128i*) c), 16, any_first_match);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_line_comment(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_block_comment(const char* c, const char* end) {
+    const __m128i set = _mm_setr_epi8('*', '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(set, 3, _mm_loadu_si128((const __m128i*) c), 16, any_first_match);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_block_comment(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_quoted(const char* c, const char* end, char quote) {
+    const __m128i set = _mm_setr_epi8(quote, '\\', '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(set, 4, _mm_loadu_si128((const __m128i*) c), 16, any_first_match);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_quoted(c, end, quote);
+}
+
+TARGET_SSE42 static const char* sse42_inactive(const char* c, const char* end) {
+    const __m128i set = _mm_setr_epi8('/', '"', '\'', '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; end - c >= 16; c += 16) {
+        int idx = _mm_cmpestri(set, 5, _mm_loadu_si128((const __m128i*) c), 16, any_first_match);
+        if (idx < 16)
+            return c + idx;
+    }
+    return scalar_inactive(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_ascii(const char* c, const char* end) {
+    for (; end - c >= 16; c += 16) {
+        u32 stop = u32(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) c)));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return scalar_ascii(c, end);
+}
+
+TARGET_SSE42 static const char* sse42_narrow_utf16(const char* c, const char* end, char* out) {
+    const __m128i non_ascii = _mm_set1_epi16(i16(0xFF80));
+    for (; end - c >= 16; c += 16, out += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) c);
+        if (!_mm_testz_si128(v, non_ascii))
+            break;
+        _mm_storel_epi64((__m128i*) out, _mm_packus_epi16(v, v));
+    }
+    return scalar_narrow_utf16(c, end, out);
+}
+
+TARGET_SSE42 static u64 sse42_eq(const __m128i (&v)[4], char ch) {
+    __m128i needle = _mm_set1_epi8(ch);
+    u64 result = 0;
+    for (int i = 0; i < 4; ++i)
+        result |= u64(u16(_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], needle)))) << (16 * i);
+    return result;
+}
+
+TARGET_SSE42 static u64 sse42_in_range(const __m128i (&v)[4], char lo, char hi) {
+    __m128i vlo = _mm_set1_epi8(lo);
+    __m128i vhi = _mm_set1_epi8(hi);
+    u64 result = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i clamped = _mm_min_epu8(_mm_max_epu8(v[i], vlo), vhi);
+        result |= u64(u16(_mm_movemask_epi8(_mm_cmpeq_epi8(clamped, v[i])))) << (16 * i);
+    }
+    return result;
+}
+
+TARGET_SSE42 static void sse42_classify(const char* c, block_masks& out) {
+    const __m128i v[4] = {
+        _mm_loadu_si128((const __m128i*) c),
+        _mm_loadu_si128((const __m128i*) (c + 16)),
+        _mm_loadu_si128((const __m128i*) (c + 32)),
+        _mm_loadu_si128((const __m128i*) (c + 48)),
+    };
+    const __m128i lower[4] = {
+        _mm_or_si128(v[0], _mm_set1_epi8(0x20)),
+        _mm_or_si128(v[1], _mm_set1_epi8(0x20)),
+        _mm_or_si128(v[2], _mm_set1_epi8(0x20)),
+        _mm_or_si128(v[3], _mm_set1_epi8(0x20)),
+    };
+    out.line_feed = sse42_eq(v, '\n');
+    out.carriage_return = sse42_eq(v, '\r');
+    out.whitespace = (sse42_eq(v, ' ') | sse42_in_range(v, '\t', '\f')) & ~out.line_feed;
+    out.digit = sse42_in_range(v, '0', '9');
+    out.identifier = sse42_in_range(lower, 'a', 'z') | out.digit | sse42_eq(v, '_');
+    out.double_quote = sse42_eq(v, '"');
+    out.single_quote = sse42_eq(v, '\'');
+    out.backslash = sse42_eq(v, '\\');
+    out.slash = sse42_eq(v, '/');
+    out.star = sse42_eq(v, '*');
+}
+
+static constexpr scan_kernels sse42_kernels{
+    sse42_whitespace,
+    sse42_identifier,
+    sse42_line_comment,
+    sse42_block_comment,
+    sse42_quoted,
+    sse42_inactive,
+    sse42_ascii,
+    sse42_narrow_utf16,
+    sse42_classify,
+};
+
+// AVX2 kernels build a 32-bit mask of stop bytes per block and return the lowest set bit.
+
+TARGET_AVX2 static __m256i avx2_in_range(__m256i v, char lo, char hi) {
+    __m256i clamped = _mm256_min_epu8(_mm256_max_epu8(v, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi));
+    return _mm256_cmpeq_epi8(clamped, v);
+}
+
+TARGET_AVX2 static const char* avx2_whitespace(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        __m256i ws = _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+            avx2_in_range(v, '\t', '\f'));
+        // '\t' '\n' '\v' '\f' are contiguous, take '\n' back out
+        ws = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), ws);
+        u32 stop = ~u32(_mm256_movemask_epi8(ws));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_whitespace(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_identifier(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i id = _mm256_or_si256(
+            _mm256_or_si256(avx2_in_range(lower, 'a', 'z'), avx2_in_range(v, '0', '9')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        u32 stop = ~u32(_mm256_movemask_epi8(id));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_identifier(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_line_comment(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        u32 stop = u32(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_line_comment(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_block_comment(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        u32 stop = u32(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_block_comment(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_quoted(const char* c, const char* end, char quote) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        u32 stop = u32(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(quote)),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_quoted(c, end, quote);
+}
+
+TARGET_AVX2 static const char* avx2_inactive(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        u32 stop = u32(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))))));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_inactive(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_ascii(const char* c, const char* end) {
+    for (; end - c >= 32; c += 32) {
+        u32 stop = u32(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) c)));
+        if (stop)
+            return c + std::countr_zero(stop);
+    }
+    return sse42_ascii(c, end);
+}
+
+TARGET_AVX2 static const char* avx2_narrow_utf16(const char* c, const char* end, char* out) {
+    const __m256i non_ascii = _mm256_set1_epi16(i16(0xFF80));
+    for (; end - c >= 32; c += 32, out += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) c);
+        if (!_mm256_testz_si256(v, non_ascii))
+            break;
+        // packing works per 128 bit lane, the narrowed halves end up in the first and third quadword
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0b1000);
+        _mm_storeu_si128((__m128i*) out, _mm256_castsi256_si128(packed));
+    }
+    return sse42_narrow_utf16(c, end, out);
+}
+
+TARGET_AVX2 static u64 avx2_mask(__m256i lo, __m256i hi) {
+    return u64(u32(_mm256_movemask_epi8(lo))) | (u64(u32(_mm256_movemask_epi8(hi))) << 32);
+}
+
+TARGET_AVX2 static u64 avx2_eq(__m256i lo, __m256i hi, char ch) {
+    __m256i needle = _mm256_set1_epi8(ch);
+    return avx2_mask(_mm256_cmpeq_epi8(lo, needle), _mm256_cmpeq_epi8(hi, needle));
+}
+
+TARGET_AVX2 static void avx2_classify(const char* c, block_masks& out) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*) c);
+    __m256i hi = _mm256_loadu_si256((const __m256i*) (c + 32));
+    __m256i lower_lo = _mm256_or_si256(lo, _mm256_set1_epi8(0x20));
+    __m256i lower_hi = _mm256_or_si256(hi, _mm256_set1_epi8(0x20));
+    out.line_feed = avx2_eq(lo, hi, '\n');
+    out.carriage_return = avx2_eq(lo, hi, '\r');
+    out.whitespace = (avx2_eq(lo, hi, ' ') | avx2_mask(avx2_in_range(lo, '\t', '\f'), avx2_in_range(hi, '\t', '\f'))) & ~out.line_feed;
+    out.digit = avx2_mask(avx2_in_range(lo, '0', '9'), avx2_in_range(hi, '0', '9'));
+    out.identifier = avx2_mask(avx2_in_range(lower_lo, 'a', 'z'), avx2_in_range(lower_hi, 'a', 'z')) | out.digit | avx2_eq(lo, hi, '_');
+    out.double_quote = avx2_eq(lo, hi, '"');
+    out.single_quote = avx2_eq(lo, hi, '\'');
+    out.backslash = avx2_eq(lo, hi, '\\');
+    out.slash = avx2_eq(lo, hi, '/');
+    out.star = avx2_eq(lo, hi, '*');
+}
+
+static constexpr scan_kernels avx2_kernels{
+    avx2_whitespace,
+    avx2_identifier,
+    avx2_line_comment,
+    avx2_block_comment,
+    avx2_quoted,
+    avx2_inactive,
+    avx2_ascii,
+    avx2_narrow_utf16,
+    avx2_classify,
+};
+
+#endif
+
+bool scan_isa_supported(scan_isa isa) {
+    switch (isa) {
+        case scan_isa::SCALAR:
+            return true;
+#if UCPP_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+        case scan_isa::SSE42:
+        {
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 20)) != 0;
+        }
+        case scan_isa::AVX2:
+        {
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] < 7)
+                return false;
+            __cpuid(info, 1);
+            bool osxsave = (info[2] & (1 << 27)) != 0;
+            bool avx = (info[2] & (1 << 28)) != 0;
+            if (osxsave == false || avx == false || (_xgetbv(0) & 6) != 6)
+                return false;
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+        }
+#else
+        case scan_isa::SSE42:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.2");
+        case scan_isa::AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+#endif
+        default:
+            return false;
+    }
+}
+
+const scan_kernels& scan_kernels_for(scan_isa isa) {
+    switch (isa) {
+#if UCPP_X86
+        case scan_isa::SSE42:
+            return sse42_kernels;
+        case scan_isa::AVX2:
+            return avx2_kernels;
+#endif
+        default:
+            return scalar_kernels;
+    }
+}
+
+const scan_kernels& scan_kernels_active() {
+    static const scan_kernels& active = []() -> const scan_kernels& {
+        if (scan_isa_supported(scan_isa::AVX2))
+            return scan_kernels_for(scan_isa::AVX2);
+        if (scan_isa_supported(scan_isa::SSE42))
+            return scan_kernels_for(scan_isa::SSE42);
+        return scan_kernels_for(scan_isa::SCALAR);
+    }();
+    return active;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "types.h"
+
+enum class scan_isa : char {
+    SCALAR,
+    SSE42,
+    AVX2,
+};
+
+/**
+ * Bitmaps of the byte classes in a block of 64 bytes, bit i describes byte i of the block.
+ */
+struct block_masks {
+    u64 whitespace;      // ' ' '\t' '\v' '\f'
+    u64 identifier;      // [A-Za-z0-9_]
+    u64 digit;           // [0-9]
+    u64 line_feed;       // '\n'
+    u64 carriage_return; // '\r'
+    u64 double_quote;    // '"'
+    u64 single_quote;    // '\''
+    u64 backslash;       // '\\'
+    u64 slash;           // '/'
+    u64 star;            // '*'
+};
+
+/**
+ * Kernels that find the end of a run of bytes the lexer would otherwise consume one at a time.
+ * Every run kernel returns a pointer to the first byte in [c, end) that stops the run, or end.
+ */
+struct scan_kernels {
+    // stops at the first byte that is not ' ', '\t', '\v' or '\f'
+    const char* (*whitespace)(const char* c, const char* end);
+    // stops at the first byte that is not in [A-Za-z0-9_]
+    const char* (*identifier)(const char* c, const char* end);
+    // stops at the first '\r' or '\n'
+    const char* (*line_comment)(const char* c, const char* end);
+    // stops at the first '*', '\r' or '\n'
+    const char* (*block_comment)(const char* c, const char* end);
+    // stops at the first quote, '\\', '\r' or '\n'
+    const char* (*quoted)(const char* c, const char* end, char quote);
+    // stops at the first byte that can start a comment, string or name or end a line: '/', '"', '\'', '\r' or '\n'
+    const char* (*inactive)(const char* c, const char* end);
+    // stops at the first byte >= 0x80
+    const char* (*ascii)(const char* c, const char* end);
+    // reads UTF-16LE code units and stops at the first one >= 0x80, or at a last odd byte, writing every unit
+    // before it to out as one byte
+    const char* (*narrow_utf16)(const char* c, const char* end, char* out);
+    // classifies the 64 bytes starting at c
+    void (*classify)(const char* c, block_masks& out);
+};
+
+/**
+ * Returns true if the kernels for isa can run on this CPU.
+ */
+bool scan_isa_supported(scan_isa isa);
+
+/**
+ * Returns the kernels for a specific instruction set. The scalar kernels are the reference implementation.
+ * Calling kernels of an unsupported instruction set is undefined behavior.
+ */
+const scan_kernels& scan_kernels_for(scan_isa isa);
+
+/**
+ * Returns the kernels for the best instruction set available on this CPU, detected once on first use.
+ */
+const scan_kernels& scan_kernels_active();
@@ -0,0 +1,107 @@
+#include "source_map.h"
+#include "simd_scan.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+std::vector<u32> find_line_starts(const char* begin, const char* end) {
+    auto&& scan = scan_kernels_active();
+    std::vector<u32> starts{0};
+    for (auto c = scan.line_comment(begin, end); c != end; c = scan.line_comment(c, end)) {
+        if (*c == '\r' && c + 1 != end && c[1] == '\n')
+            ++c;
+        ++c;
+        starts.push_back(u32(c - begin));
+    }
+    return starts;
+}
+
+source_map::range& source_map::reserve(std::size_t size) {
+    // one location past the end, for whatever is found at the end of the buffer
+    ++size;
+
+    // the smallest range given back that is large enough
+    auto best = _released.end();
+    for (auto i = _released.begin(); i != _released.end(); ++i) {
+        auto&& r = _ranges[*i];
+        if (r.size >= size && (best == _released.end() || r.size < _ranges[*best].size))
+            best = i;
+    }
+    if (best != _released.end()) {
+        auto&& r = _ranges[*best];
+        _released.erase(best);
+        return r;
+    }
+
+    if (size > std::size_t(std::numeric_limits<source_location>::max() - _next))
+        throw std::length_error("source locations exhausted");
+    auto&& r = _ranges.emplace_back();
+    r.base = _next;
+    r.size = source_location(size);
+    _next += r.size;
+    return r;
+}
+
+source_location source_map::add(std::string_view path, const char* begin, const char* end) {
+    auto&& r = reserve(std::size_t(end - begin));
+    r = range{r.base, r.size, std::string{path}, begin, end, 1, 0, {}};
+    return r.base;
+}
+
+source_location source_map::add_fragment(
+    std::string_view path,
+    const char* begin,
+    const char* end,
+    i32 first_line,
+    i32 first_column
+) {
+    auto&& r = reserve(std::size_t(end - begin));
+    r = range{r.base, r.size, std::string{path}, nullptr, end, first_line, first_column, find_line_starts(begin, end)};
+    return r.base;
+}
+
+void source_map::release(source_location location) {
+    auto i = std::size_t(find(location) - _ranges.begin());
+    auto&& r = _ranges[i];
+    r = range{r.base, r.size, {}, nullptr, nullptr, 0, 0, {}, true};
+    _released.push_back(i);
+
+    // ranges given back at the end go back to the space behind them, so a buffer added and released over and over
+    // keeps getting the same range even when it grows
+    while (!_ranges.empty() && _ranges.back().released) {
+        _released.erase(std::find(_released.begin(), _released.end(), _ranges.size() - 1));
+        _next = _ranges.back().base;
+        _ranges.pop_back();
+    }
+}
+
+std::deque<source_map::range>::const_iterator source_map::find(source_location location) const {
+    auto r = std::upper_bound(_ranges.begin(), _ranges.end(), location, [](source_location l, const range& r) {
+        return l < r.base;
+    });
+    return std::prev(r);
+}
+
+source_map::resolved source_map::resolve(source_location location) const {
+    auto&& r = *find(location);
+    if (r.begin != nullptr) {
+        r.line_starts = find_line_starts(r.begin, r.end);
+        r.begin = nullptr;
+    }
+
+    auto offset = location - r.base;
+    auto line = std::upper_bound(r.line_starts.begin(), r.line_starts.end(), offset) - 1;
+    auto index = i32(line - r.line_starts.begin());
+    i32 column = index == 0 ? r.first_column + i32(offset) : i32(offset - *line);
+    return resolved{r.path, r.first_line + index, column};
+}
+
+std::string_view source_map::file_path(source_location location) const {
+    return find(location)->path;
+}
+
+source_map& default_source_map() {
+    thread_local source_map sources;
+    return sources;
+}
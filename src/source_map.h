@@ -0,0 +1,80 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+
+using source_location = u32;
+
+/**
+ * Returns the offsets of the first byte of every line of [begin, end), the first line starts at 0. Lines end with
+ * "\n", "\r\n" or "\r".
+ */
+std::vector<u32> find_line_starts(const char* begin, const char* end);
+
+/**
+ * One space of 32 bit source locations for all buffers that get lexed. Every buffer is given a range of it, a
+ * location is the start of that range plus a byte offset, so lexemes carry 4 bytes instead of a file path, line
+ * and column. Lines and columns are only worked out when a location is resolved, the line table of a buffer is
+ * built the first time one of its locations is.
+ *
+ * Buffers that are done with give their range back, so the locations of buffers lexed over and over, like the blocks
+ * of a stream or a file edited again and again, don't use up the space.
+ *
+ * Like an arena a source map is not synchronized, each thread uses its own: either one owned by whatever runs on
+ * the thread or default_source_map().
+ */
+class source_map {
+public:
+    struct resolved {
+        std::string_view file_path;
+        i32 line;
+        i32 column;
+    };
+
+    /**
+     * Gives [begin, end) a range of locations and returns the location of begin. The buffer has to stay alive
+     * until the last location in it is resolved.
+     */
+    source_location add(std::string_view path, const char* begin, const char* end);
+
+    /**
+     * Adds a piece of a larger input that starts at first_line and first_column, like one block of a stream. Its
+     * line table is built right away, so the buffer can go away once this returns.
+     */
+    source_location add_fragment(std::string_view path, const char* begin, const char* end, i32 first_line, i32 first_column);
+
+    /**
+     * Gives the range of the buffer location is in back, later buffers get its locations. Nothing in the buffer may
+     * be resolved any more, and its file path goes away.
+     */
+    void release(source_location location);
+
+    resolved resolve(source_location location) const;
+
+    std::string_view file_path(source_location location) const;
+
+private:
+    struct range {
+        source_location base;
+        source_location size; // of the range, at least one more than the size of the buffer
+        std::string path;
+        mutable const char* begin; // nullptr once the line table is built
+        const char* end;
+        i32 first_line;
+        i32 first_column;
+        mutable std::vector<u32> line_starts;
+        bool released = false;
+    };
+
+    range& reserve(std::size_t size);
+    std::deque<range>::const_iterator find(source_location location) const;
+
+    std::deque<range> _ranges; // sorted by base, a deque keeps the paths in place
+    std::vector<std::size_t> _released; // indices of the ranges given back, none of them is the last range
+    source_location _next = 0;
+};
+
+source_map& default_source_map();
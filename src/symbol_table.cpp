@@ -0,0 +1,24 @@
+#include "symbol_table.h"
+
+symbol_table::symbol_table() {
+    _symbols.push_back(symbol{"", nullptr, 0});
+    for (auto s : {"include", "define", "undef", "if", "elif", "else", "endif", "ifdef", "ifndef", "defined", "pragma", "once", "__VA_ARGS__"})
+        intern(s);
+}
+
+symbol_id symbol_table::intern(std::string_view spelling) {
+    auto it = _ids.find(spelling);
+    if (it != _ids.end())
+        return it->second;
+
+    std::string_view stored = _spellings.emplace_back(spelling);
+    symbol_id id = symbol_id(_symbols.size());
+    _symbols.push_back(symbol{stored, nullptr, 0});
+    _ids.emplace(stored, id);
+    return id;
+}
+
+symbol_id symbol_table::find(std::string_view spelling) const {
+    auto it = _ids.find(spelling);
+    return it == _ids.end() ? NONE : it->second;
+}
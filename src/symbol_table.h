@@ -0,0 +1,90 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "types.h"
+
+using symbol_id = u32;
+
+/**
+ * Interns identifier spellings. The lexer hashes every identifier once when it produces it, everything after that
+ * compares symbol ids. Each symbol has a slot for the macro currently defined under its name.
+ */
+class symbol_table {
+public:
+    // symbols the preprocessor looks for, interned by the constructor in this order
+    enum predefined : symbol_id {
+        NONE, // not a symbol, lexemes that are not identifiers have this id
+        INCLUDE,
+        DEFINE,
+        UNDEF,
+        IF,
+        ELIF,
+        ELSE,
+        ENDIF,
+        IFDEF,
+        IFNDEF,
+        DEFINED,
+        PRAGMA,
+        ONCE,
+        VA_ARGS, // __VA_ARGS__
+    };
+
+    symbol_table();
+
+    symbol_id intern(std::string_view spelling);
+
+    /**
+     * Returns the id of an already interned spelling, NONE if it was never interned.
+     */
+    symbol_id find(std::string_view spelling) const;
+
+    std::string_view spelling(symbol_id id) const {
+        return _symbols[id].spelling;
+    }
+
+    struct define* macro(symbol_id id) const {
+        return _symbols[id].macro;
+    }
+
+    void set_macro(symbol_id id, struct define* macro) {
+        _symbols[id].macro = macro;
+        _symbols[id].changed = ++_generation;
+    }
+
+    /**
+     * Counts the macros defined and undefined so far. Whatever was worked out from the macros in some generation
+     * holds for as long as the symbols it looked at were not changed in a later one.
+     */
+    u32 generation() const {
+        return _generation;
+    }
+
+    /**
+     * Returns the generation the macro of a symbol was last defined or undefined in, 0 if it never was.
+     */
+    u32 changed(symbol_id id) const {
+        return _symbols[id].changed;
+    }
+
+    std::size_t size() const {
+        return _symbols.size();
+    }
+
+private:
+    struct symbol {
+        std::string_view spelling;
+        struct define* macro;
+        u32 changed;
+    };
+
+    std::deque<std::string> _spellings;
+    std::vector<symbol> _symbols;
+    phmap::flat_hash_map<std::string_view, symbol_id> _ids;
+    u32 _generation = 0;
+};
@@ -0,0 +1,119 @@
+#include "text_encoding.h"
+#include "simd_scan.h"
+#include "types.h"
+
+std::size_t utf8_bom_size(const char* c, const char* end) {
+    if (end - c >= 3 && u8(c[0]) == 0xEF && u8(c[1]) == 0xBB && u8(c[2]) == 0xBF)
+        return 3;
+    return 0;
+}
+
+std::size_t utf8_sequence_size(const char* c, const char* end) {
+    auto available = std::size_t(end - c);
+    if (available == 0)
+        return 0;
+
+    u8 lead = u8(c[0]);
+    if (lead < 0x80)
+        return 1;
+
+    // the second byte has a narrower range after some lead bytes, that rules out overlong forms, surrogates and
+    // code points above U+10FFFF
+    std::size_t size;
+    u8 lo = 0x80, hi = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        size = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        size = 3;
+        lo = lead == 0xE0 ? 0xA0 : 0x80;
+        hi = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        size = 4;
+        lo = lead == 0xF0 ? 0x90 : 0x80;
+        hi = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        return 0;
+    }
+
+    if (available < size || u8(c[1]) < lo || u8(c[1]) > hi)
+        return 0;
+    for (std::size_t i = 2; i < size; ++i) {
+        if (u8(c[i]) < 0x80 || u8(c[i]) > 0xBF)
+            return 0;
+    }
+    return size;
+}
+
+const char* validate_utf8(const char* c, const char* end) {
+    auto&& scan = scan_kernels_active();
+    for (;;) {
+        c = scan.ascii(c, end);
+        if (c == end)
+            return end;
+        auto size = utf8_sequence_size(c, end);
+        if (size == 0)
+            return c;
+        c += size;
+    }
+}
+
+void utf16le_to_utf8(const char* begin, const char* end, std::vector<char>& out) {
+    // every code unit takes at most 3 bytes, a surrogate pair takes 4
+    auto start = out.size();
+    out.resize(start + std::size_t(end - begin) / 2 * 3 + 3);
+    auto o = out.data() + start;
+
+    auto unit = [](const char* c) {
+        return u32(u8(c[0])) | u32(u8(c[1])) << 8;
+    };
+    auto put = [&o](u32 cp) {
+        if (cp < 0x800) {
+            *o++ = char(0xC0 | cp >> 6);
+        } else if (cp < 0x10000) {
+            *o++ = char(0xE0 | cp >> 12);
+            *o++ = char(0x80 | (cp >> 6 & 0x3F));
+        } else {
+            *o++ = char(0xF0 | cp >> 18);
+            *o++ = char(0x80 | (cp >> 12 & 0x3F));
+            *o++ = char(0x80 | (cp >> 6 & 0x3F));
+        }
+        *o++ = char(0x80 | (cp & 0x3F));
+    };
+
+    auto&& scan = scan_kernels_active();
+    auto c = begin;
+    for (;;) {
+        auto ascii_end = scan.narrow_utf16(c, end, o);
+        o += (ascii_end - c) / 2;
+        c = ascii_end;
+        if (end - c < 2)
+            break;
+
+        u32 cp = unit(c);
+        c += 2;
+        if (cp >= 0xD800 && cp <= 0xDBFF && end - c >= 2 && unit(c) >= 0xDC00 && unit(c) <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (unit(c) - 0xDC00);
+            c += 2;
+        } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+        put(cp);
+    }
+    if (c != end)
+        put(0xFFFD);
+
+    out.resize(std::size_t(o - out.data()));
+}
+
+text_encoding decode_source(std::vector<char>& bytes) {
+    auto begin = bytes.data();
+    auto end = begin + bytes.size();
+    if (bytes.size() >= 2 && u8(begin[0]) == 0xFF && u8(begin[1]) == 0xFE) {
+        std::vector<char> utf8;
+        utf16le_to_utf8(begin + 2, end, utf8);
+        bytes = std::move(utf8);
+        return text_encoding::UTF16LE;
+    }
+
+    return validate_utf8(begin + utf8_bom_size(begin, end), end) == end ? text_encoding::UTF8 : text_encoding::BYTES;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+enum class text_encoding : char {
+    UTF8,    // valid UTF-8, with or without byte order mark, also plain ASCII
+    UTF16LE, // UTF-16 little endian with byte order mark, transcoded to UTF-8
+    BYTES,   // neither, most likely an 8 bit code page, passed on as is
+};
+
+/**
+ * Size of the UTF-8 byte order mark at c, 0 if there is none.
+ */
+std::size_t utf8_bom_size(const char* c, const char* end);
+
+/**
+ * Size of the well formed UTF-8 sequence at c, 0 if there is none. Overlong forms, surrogates and code points above
+ * U+10FFFF are not well formed.
+ */
+std::size_t utf8_sequence_size(const char* c, const char* end);
+
+/**
+ * Returns the first byte of [c, end) that doesn't start a well formed UTF-8 sequence, or end.
+ */
+const char* validate_utf8(const char* c, const char* end);
+
+/**
+ * Appends UTF-16LE text without byte order mark to out as UTF-8. Unpaired surrogates and a last odd byte become
+ * U+FFFD.
+ */
+void utf16le_to_utf8(const char* begin, const char* end, std::vector<char>& out);
+
+/**
+ * Works out the encoding of a loaded source file from its byte order mark and content. UTF-16LE is replaced by
+ * its UTF-8 transcoding, without byte order mark, everything else is left alone.
+ */
+text_encoding decode_source(std::vector<char>& bytes);
@@ -0,0 +1,113 @@
+#include "token_buffer.h"
+
+#include <algorithm>
+#include <ostream>
+
+u16 token_buffer::add_file(std::string_view path, const char* begin, const char* end) {
+    _sources.push_back(source{path, begin, end, {}});
+    return u16(_sources.size() - 1);
+}
+
+token_buffer::index token_buffer::push_back(lexeme_type type, u16 file, u32 offset, u32 length, u32 symbol) {
+    index i = index(_types.size());
+    _types.push_back(type);
+    _offsets.push_back(offset);
+    _lengths.push_back(length);
+    _files.push_back(file);
+    _symbols.push_back(symbol);
+
+    if (_tail != npos && _segments[_tail].last == i) {
+        _segments[_tail].last += 1;
+    } else {
+        link_before(npos, i, i + 1);
+    }
+    return i;
+}
+
+u32 token_buffer::link_before(u32 next, index first, index last) {
+    u32 prev = (next == npos) ? _tail : _segments[next].prev;
+    u32 s = u32(_segments.size());
+    _segments.push_back(segment{first, last, prev, next});
+
+    if (prev == npos)
+        _head = s;
+    else
+        _segments[prev].next = s;
+
+    if (next == npos)
+        _tail = s;
+    else
+        _segments[next].prev = s;
+
+    return s;
+}
+
+u32 token_buffer::split(position at) {
+    if (at == end())
+        return npos;
+    if (_segments[at.segment].first == at.token)
+        return at.segment;
+
+    auto old = _segments[at.segment];
+    u32 s = u32(_segments.size());
+    _segments.push_back(segment{at.token, old.last, at.segment, old.next});
+    _segments[at.segment].last = at.token;
+    _segments[at.segment].next = s;
+    if (old.next == npos)
+        _tail = s;
+    else
+        _segments[old.next].prev = s;
+
+    return s;
+}
+
+token_buffer::position token_buffer::insert(position at, index first, index last) {
+    if (first == last)
+        return at == end() ? at : position{split(at), at.token};
+    return position{link_before(split(at), first, last), first};
+}
+
+token_buffer::position token_buffer::erase(position from, position to) {
+    if (from == to)
+        return from;
+
+    u32 a = split(from);
+    if (to.segment == from.segment && to.token >= from.token)
+        to.segment = a; // to was in the part of the segment that got split off
+    u32 b = split(to);
+
+    u32 prev = _segments[a].prev;
+    if (prev == npos)
+        _head = b;
+    else
+        _segments[prev].next = b;
+
+    if (b == npos) {
+        _tail = prev;
+        return end();
+    }
+    _segments[b].prev = prev;
+    return position{b, to.token};
+}
+
+token_buffer::line_column token_buffer::location(index i) const {
+    auto&& src = _sources[_files[i]];
+    auto&& starts = src.line_starts;
+    if (starts.empty())
+        starts = find_line_starts(src.begin, src.end);
+
+    auto line = std::upper_bound(starts.begin(), starts.end(), _offsets[i]) - 1;
+    return line_column{i32(line - starts.begin() + 1), i32(_offsets[i] - *line)};
+}
+
+void token_buffer::write_to(std::ostream& os) const {
+    for (auto p = begin(); p != end();) {
+        auto t = text(p.token);
+        os.write(t.data(), t.size());
+
+        auto n = next(p);
+        if (n != end() && needs_separator(type(p.token), type(n.token)))
+            os.put(' ');
+        p = n;
+    }
+}
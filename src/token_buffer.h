@@ -0,0 +1,136 @@
+#pragma once
+
+#include <iosfwd>
+#include <string_view>
+#include <vector>
+#include "lexer.h"
+#include "types.h"
+
+/**
+ * Compact storage for lexemes as parallel arrays of type, source offset, length, file id and symbol id (15 bytes
+ * per lexeme instead of a lexeme node). Lexemes are never moved or removed once added. The order in which they
+ * are visited is a doubly linked list of segments, each a range of consecutive lexeme indices, so including
+ * a file or expanding a macro splices a segment instead of relinking every lexeme.
+ *
+ * This is a standalone container, filled by lexer::run for tools that want the whole file at once. The
+ * preprocessor does not use it. It holds only the lexemes of the current line, in a list, and keeps included files
+ * compact as lexed files, see lexer_cursor.h.
+ */
+class token_buffer {
+public:
+    using index = u32;
+    static constexpr index npos = ~index(0);
+
+    struct position {
+        u32 segment;
+        index token;
+
+        bool operator==(const position&) const = default;
+    };
+
+    struct line_column {
+        i32 line;
+        i32 column;
+    };
+
+    /**
+     * Registers the source text lexemes of a file will refer to, returns the id of the file.
+     */
+    u16 add_file(std::string_view path, const char* begin, const char* end);
+
+    /**
+     * Appends a lexeme to the storage and to the end of the visiting order.
+     */
+    index push_back(lexeme_type type, u16 file, u32 offset, u32 length, u32 symbol = 0);
+
+    /**
+     * Inserts the stored lexemes [first, last) before at. Lexemes can be inserted any number of times.
+     * Returns the position of first, positions previously obtained may be invalidated.
+     */
+    position insert(position at, index first, index last);
+
+    /**
+     * Removes [from, to) from the visiting order, the lexemes themselves stay stored.
+     * Returns the position of the lexeme that followed the removed ones, positions previously obtained may be
+     * invalidated.
+     */
+    position erase(position from, position to);
+
+    position begin() const {
+        return _head == npos ? end() : position{_head, _segments[_head].first};
+    }
+    position end() const {
+        return position{npos, npos};
+    }
+    position next(position p) const {
+        auto&& s = _segments[p.segment];
+        if (p.token + 1 < s.last)
+            return position{p.segment, p.token + 1};
+        return s.next == npos ? end() : position{s.next, _segments[s.next].first};
+    }
+
+    std::size_t size() const {
+        return _types.size();
+    }
+    lexeme_type type(index i) const {
+        return _types[i];
+    }
+    u16 file(index i) const {
+        return _files[i];
+    }
+    u32 offset(index i) const {
+        return _offsets[i];
+    }
+    u32 length(index i) const {
+        return _lengths[i];
+    }
+    u32 symbol(index i) const {
+        return _symbols[i];
+    }
+    std::string_view text(index i) const {
+        return std::string_view{_sources[_files[i]].begin + _offsets[i], _lengths[i]};
+    }
+    std::string_view file_path(u16 file) const {
+        return _sources[file].path;
+    }
+
+    /**
+     * Returns the line and column of a lexeme, builds the line table of its file on first use.
+     */
+    line_column location(index i) const;
+
+    /**
+     * Writes the lexemes in visiting order, separated the same way lexeme::write_to separates them.
+     */
+    void write_to(std::ostream& os) const;
+
+private:
+    struct segment {
+        index first;
+        index last;
+        u32 prev;
+        u32 next;
+    };
+
+    struct source {
+        std::string_view path;
+        const char* begin;
+        const char* end;
+        mutable std::vector<u32> line_starts;
+    };
+
+    // makes at.token the first lexeme of a segment, returns that segment
+    u32 split(position at);
+    u32 link_before(u32 next, index first, index last);
+
+    std::vector<lexeme_type> _types;
+    std::vector<u32> _offsets;
+    std::vector<u32> _lengths;
+    std::vector<u16> _files;
+    std::vector<u32> _symbols;
+
+    std::vector<source> _sources;
+    std::vector<segment> _segments;
+    u32 _head = npos;
+    u32 _tail = npos;
+};
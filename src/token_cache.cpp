@@ -0,0 +1,133 @@
+#include "token_cache.h"
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+namespace fs = std::filesystem;
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// a file mapped read only, empty if it can't be
+class mapped_file {
+public:
+    explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+        _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (_file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+            return;
+        _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (_mapping == nullptr)
+            return;
+        auto p = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (p == nullptr)
+            return;
+        _data = static_cast<const char*>(p);
+        _size = std::size_t(size.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                _data = static_cast<const char*>(p);
+                _size = std::size_t(st.st_size);
+            }
+        }
+        close(fd); // the mapping stays
+#endif
+    }
+
+    ~mapped_file() {
+#ifdef _WIN32
+        if (_data)
+            UnmapViewOfFile(_data);
+        if (_mapping)
+            CloseHandle(_mapping);
+        if (_file != INVALID_HANDLE_VALUE)
+            CloseHandle(_file);
+#else
+        if (_data)
+            munmap(const_cast<char*>(_data), _size);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    std::string_view view() const {
+        return {_data, _size};
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#endif
+    const char* _data = nullptr;
+    std::size_t _size = 0;
+};
+
+}
+
+token_cache::token_cache(std::string directory) : _directory(std::move(directory)) {
+    std::error_code ec;
+    fs::create_directories(_directory, ec);
+}
+
+std::unique_ptr<lexed_file> token_cache::load(
+    std::string_view fp,
+    char* begin,
+    char* end,
+    u64 hash,
+    lexer_options options,
+    std::optional<source_location> base
+) {
+    // the lexemes are decoded from the mapped image, it stays mapped as long as the lexed file is around
+    auto image = std::make_shared<mapped_file>(image_path(hash, options.fold_trivia));
+    auto view = image->view();
+    if (view.empty())
+        return nullptr;
+    return lexed_file::from_image(view, std::move(image), fp, begin, end, hash, options, base);
+}
+
+void token_cache::save(const lexed_file& file, u64 hash) {
+    auto path = image_path(hash, file.fold_trivia());
+    auto temporary = std::format("{}.{:08x}.tmp", path, std::random_device{}());
+    bool written;
+    {
+        std::ofstream out{temporary, std::ios::out | std::ios::binary | std::ios::trunc};
+        if (!out)
+            return;
+        file.write_image(out, hash);
+        written = bool(out.flush());
+    }
+
+    std::error_code ec;
+    if (written)
+        fs::rename(temporary, path, ec);
+    if (!written || ec)
+        fs::remove(temporary, ec);
+}
+
+std::string token_cache::image_path(u64 hash, bool fold_trivia) const {
+    auto name = std::format("{:016x}-{}{}.tok", hash, LexerVersion, fold_trivia ? "-folded" : "");
+    return (fs::path(_directory) / name).string();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include "lexer_cursor.h"
+
+/**
+ * A directory of images of lexed files, shared by every run that is given it. An image is named after the XXH3 of
+ * the text, the LexerVersion and whether trivia is folded, so a file is lexed once for all runs with the same options
+ * as long as its content stays the same, no matter which path it is included by.
+ *
+ * Images are written to a file of their own first and then renamed, runs at the same time never map half an image.
+ */
+class token_cache {
+public:
+    explicit token_cache(std::string directory);
+
+    /**
+     * Maps the image of [begin, end), whose XXH3 is hash, and turns it back into the lexed file. Returns nullptr if
+     * there is no image that fits. base is taken like lexed_file::lex takes it.
+     */
+    std::unique_ptr<lexed_file> load(
+        std::string_view fp,
+        char* begin,
+        char* end,
+        u64 hash,
+        lexer_options options,
+        std::optional<source_location> base = std::nullopt
+    );
+
+    /**
+     * Writes the image of file, hash is the XXH3 of its text. An image that can't be written is left out, the file
+     * is lexed again next time.
+     */
+    void save(const lexed_file& file, u64 hash);
+
+private:
+    std::string image_path(u64 hash, bool fold_trivia) const;
+
+    std::string _directory;
+};